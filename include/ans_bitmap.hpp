@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+namespace answers {
+
+    // One bit per triangle id. Bits are set with an atomic or, so query threads
+    // share the bitmap without locks; ids are read back by a linear scan.
+    class ans_bitmap_t {
+        using word_t = uint64_t;
+
+        static const int WORD_BITS = 64;
+
+        size_t sz_;
+        std::unique_ptr<std::atomic<word_t>[]> words_;
+
+        size_t words_num() const { return (sz_ + WORD_BITS - 1) / WORD_BITS; }
+
+        public:
+            explicit ans_bitmap_t(size_t sz) : sz_(sz), words_(new std::atomic<word_t>[words_num()]) {
+                for (size_t i = 0; i < words_num(); ++i) words_[i].store(0, std::memory_order_relaxed);
+            }
+
+            size_t size() const { return sz_; }
+
+            bool test(size_t id) const {
+                return words_[id / WORD_BITS].load(std::memory_order_relaxed) & (word_t{1} << (id % WORD_BITS));
+            }
+
+            void set(size_t id) {
+                word_t bit = word_t{1} << (id % WORD_BITS);
+                std::atomic<word_t> &word = words_[id / WORD_BITS];
+
+                if (!(word.load(std::memory_order_relaxed) & bit))
+                    word.fetch_or(bit, std::memory_order_relaxed);
+            }
+
+            size_t count() const {
+                size_t cnt = 0;
+                for (size_t i = 0; i < words_num(); ++i)
+                    cnt += __builtin_popcountll(words_[i].load(std::memory_order_relaxed));
+                return cnt;
+            }
+
+            template <typename func_t>
+            void for_each(func_t func) const {
+                for (size_t i = 0; i < words_num(); ++i) {
+                    word_t word = words_[i].load(std::memory_order_relaxed);
+
+                    while (word) {
+                        func(i * WORD_BITS + __builtin_ctzll(word));
+                        word &= word - 1;
+                    }
+                }
+            }
+
+            // Prints the set ids in ascending order, one per line, with a single write.
+            bool write(FILE *out) const {
+                const size_t MAX_ID_LEN = 21;
+
+                std::vector<char> buf(count() * MAX_ID_LEN);
+                char *pos = buf.data();
+
+                for_each([&pos](size_t id) {
+                    pos = std::to_chars(pos, pos + MAX_ID_LEN - 1, id).ptr;
+                    *pos++ = '\n';
+                });
+
+                // An empty buffer has no data pointer to hand to fwrite.
+                size_t len = pos - buf.data();
+                if (len && std::fwrite(buf.data(), 1, len, out) != len) return false;
+                return !std::fflush(out);
+            }
+    };
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace array_views {
+
+    // Read-only array the query code of an index works on: the storage of an
+    // index built in this run or a part of a mapped index file.
+    template <typename elem_t>
+    class array_view_t {
+        const elem_t *data_ = nullptr;
+        size_t size_ = 0;
+
+        public:
+            array_view_t() = default;
+
+            array_view_t(const elem_t *data, size_t sz) : data_(data), size_(sz) {}
+
+            array_view_t(const std::vector<elem_t> &vec) : data_(vec.data()), size_(vec.size()) {}
+
+            const elem_t &operator[](size_t i) const { return data_[i]; }
+
+            const elem_t *data() const { return data_; }
+            size_t size() const { return size_; }
+            bool empty() const { return !size_; }
+
+            const elem_t *begin() const { return data_; }
+            const elem_t *end()   const { return data_ + size_; }
+    };
+}
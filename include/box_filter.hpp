@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "geometry.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BOX_FILTER_X86
+#endif
+
+namespace box_filter {
+
+    using geometry::basic_aabb_t;
+
+    // Entries past the last box, so a kernel may load a whole vector at the end
+    // of a range and mask off the lanes beyond it.
+    const size_t SOA_PADDING = 8;
+
+    // Read-only structure-of-arrays boxes the kernels scan, in a boxes_soa_t
+    // or in a mapped index file.
+    template <typename scalar_t>
+    struct boxes_view_t {
+        const scalar_t *x_min = nullptr, *y_min = nullptr, *z_min = nullptr;
+        const scalar_t *x_max = nullptr, *y_max = nullptr, *z_max = nullptr;
+
+        bool is_overlapped(size_t i, const basic_aabb_t<scalar_t> &box) const {
+            return box.x_min <= x_max[i] && x_min[i] <= box.x_max &&
+                   box.y_min <= y_max[i] && y_min[i] <= box.y_max &&
+                   box.z_min <= z_max[i] && z_min[i] <= box.z_max;
+        }
+    };
+
+    // Boxes of a triangle range stored as structure-of-arrays, so a block of
+    // neighbours can be tested against one box with a single vector compare per
+    // axis. Float boxes fit twice as many lanes in a vector.
+    template <typename scalar_t>
+    struct boxes_soa_t {
+        std::vector<scalar_t> x_min, y_min, z_min;
+        std::vector<scalar_t> x_max, y_max, z_max;
+
+        void resize(size_t sz) {
+            sz += SOA_PADDING;
+            x_min.resize(sz); y_min.resize(sz); z_min.resize(sz);
+            x_max.resize(sz); y_max.resize(sz); z_max.resize(sz);
+        }
+
+        void set(size_t i, const basic_aabb_t<scalar_t> &box) {
+            x_min[i] = box.x_min; y_min[i] = box.y_min; z_min[i] = box.z_min;
+            x_max[i] = box.x_max; y_max[i] = box.y_max; z_max[i] = box.z_max;
+        }
+
+        boxes_view_t<scalar_t> view() const {
+            return {x_min.data(), y_min.data(), z_min.data(), x_max.data(), y_max.data(), z_max.data()};
+        }
+    };
+
+    // Writes the indices from [begin, end) whose boxes overlap the box into out,
+    // returns how many were written. out must hold end - begin entries.
+    template <typename scalar_t>
+    using filter_func_t = uint32_t (*)(const basic_aabb_t<scalar_t> &box, const boxes_view_t<scalar_t> &boxes,
+                                       uint32_t begin, uint32_t end, uint32_t *out);
+
+    template <typename scalar_t>
+    uint32_t filter_scalar(const basic_aabb_t<scalar_t> &box, const boxes_view_t<scalar_t> &boxes,
+                           uint32_t begin, uint32_t end, uint32_t *out) {
+        uint32_t cnt = 0;
+
+        for (uint32_t i = begin; i < end; ++i)
+            if (boxes.is_overlapped(i, box)) out[cnt++] = i;
+
+        return cnt;
+    }
+
+#ifdef BOX_FILTER_X86
+    __attribute__((target("sse2")))
+    inline uint32_t filter_sse2(const basic_aabb_t<double> &box, const boxes_view_t<double> &boxes,
+                                uint32_t begin, uint32_t end, uint32_t *out) {
+        const __m128d x_min = _mm_set1_pd(box.x_min), x_max = _mm_set1_pd(box.x_max),
+                      y_min = _mm_set1_pd(box.y_min), y_max = _mm_set1_pd(box.y_max),
+                      z_min = _mm_set1_pd(box.z_min), z_max = _mm_set1_pd(box.z_max);
+        uint32_t cnt = 0, i = begin;
+
+        for (; i + 2 <= end; i += 2) {
+            __m128d ok = _mm_and_pd(_mm_cmple_pd(x_min, _mm_loadu_pd(&boxes.x_max[i])),
+                                    _mm_cmple_pd(_mm_loadu_pd(&boxes.x_min[i]), x_max));
+            ok = _mm_and_pd(ok, _mm_cmple_pd(y_min, _mm_loadu_pd(&boxes.y_max[i])));
+            ok = _mm_and_pd(ok, _mm_cmple_pd(_mm_loadu_pd(&boxes.y_min[i]), y_max));
+            ok = _mm_and_pd(ok, _mm_cmple_pd(z_min, _mm_loadu_pd(&boxes.z_max[i])));
+            ok = _mm_and_pd(ok, _mm_cmple_pd(_mm_loadu_pd(&boxes.z_min[i]), z_max));
+
+            int mask = _mm_movemask_pd(ok);
+            if (mask & 1) out[cnt++] = i;
+            if (mask & 2) out[cnt++] = i + 1;
+        }
+
+        return cnt + filter_scalar(box, boxes, i, end, out + cnt);
+    }
+
+    __attribute__((target("avx2")))
+    inline uint32_t filter_avx2(const basic_aabb_t<double> &box, const boxes_view_t<double> &boxes,
+                                uint32_t begin, uint32_t end, uint32_t *out) {
+        const __m256d x_min = _mm256_set1_pd(box.x_min), x_max = _mm256_set1_pd(box.x_max),
+                      y_min = _mm256_set1_pd(box.y_min), y_max = _mm256_set1_pd(box.y_max),
+                      z_min = _mm256_set1_pd(box.z_min), z_max = _mm256_set1_pd(box.z_max);
+        uint32_t cnt = 0, i = begin;
+
+        for (; i + 4 <= end; i += 4) {
+            __m256d ok = _mm256_and_pd(_mm256_cmp_pd(x_min, _mm256_loadu_pd(&boxes.x_max[i]), _CMP_LE_OQ),
+                                       _mm256_cmp_pd(_mm256_loadu_pd(&boxes.x_min[i]), x_max, _CMP_LE_OQ));
+            ok = _mm256_and_pd(ok, _mm256_cmp_pd(y_min, _mm256_loadu_pd(&boxes.y_max[i]), _CMP_LE_OQ));
+            ok = _mm256_and_pd(ok, _mm256_cmp_pd(_mm256_loadu_pd(&boxes.y_min[i]), y_max, _CMP_LE_OQ));
+            ok = _mm256_and_pd(ok, _mm256_cmp_pd(z_min, _mm256_loadu_pd(&boxes.z_max[i]), _CMP_LE_OQ));
+            ok = _mm256_and_pd(ok, _mm256_cmp_pd(_mm256_loadu_pd(&boxes.z_min[i]), z_max, _CMP_LE_OQ));
+
+            unsigned mask = _mm256_movemask_pd(ok);
+            while (mask) {
+                out[cnt++] = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+            }
+        }
+
+        return cnt + filter_scalar(box, boxes, i, end, out + cnt);
+    }
+
+    __attribute__((target("sse2")))
+    inline uint32_t filter_sse2_float(const basic_aabb_t<float> &box, const boxes_view_t<float> &boxes,
+                                      uint32_t begin, uint32_t end, uint32_t *out) {
+        const __m128 x_min = _mm_set1_ps(box.x_min), x_max = _mm_set1_ps(box.x_max),
+                     y_min = _mm_set1_ps(box.y_min), y_max = _mm_set1_ps(box.y_max),
+                     z_min = _mm_set1_ps(box.z_min), z_max = _mm_set1_ps(box.z_max);
+        uint32_t cnt = 0, i = begin;
+
+        for (; i < end; i += 4) {
+            __m128 ok = _mm_and_ps(_mm_cmple_ps(x_min, _mm_loadu_ps(&boxes.x_max[i])),
+                                   _mm_cmple_ps(_mm_loadu_ps(&boxes.x_min[i]), x_max));
+            ok = _mm_and_ps(ok, _mm_cmple_ps(y_min, _mm_loadu_ps(&boxes.y_max[i])));
+            ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_loadu_ps(&boxes.y_min[i]), y_max));
+            ok = _mm_and_ps(ok, _mm_cmple_ps(z_min, _mm_loadu_ps(&boxes.z_max[i])));
+            ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_loadu_ps(&boxes.z_min[i]), z_max));
+
+            unsigned mask = _mm_movemask_ps(ok);
+            if (end - i < 4) mask &= (1u << (end - i)) - 1;
+
+            while (mask) {
+                out[cnt++] = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+            }
+        }
+
+        return cnt;
+    }
+
+    __attribute__((target("avx2")))
+    inline uint32_t filter_avx2_float(const basic_aabb_t<float> &box, const boxes_view_t<float> &boxes,
+                                      uint32_t begin, uint32_t end, uint32_t *out) {
+        const __m256 x_min = _mm256_set1_ps(box.x_min), x_max = _mm256_set1_ps(box.x_max),
+                     y_min = _mm256_set1_ps(box.y_min), y_max = _mm256_set1_ps(box.y_max),
+                     z_min = _mm256_set1_ps(box.z_min), z_max = _mm256_set1_ps(box.z_max);
+        uint32_t cnt = 0, i = begin;
+
+        for (; i < end; i += 8) {
+            __m256 ok = _mm256_and_ps(_mm256_cmp_ps(x_min, _mm256_loadu_ps(&boxes.x_max[i]), _CMP_LE_OQ),
+                                      _mm256_cmp_ps(_mm256_loadu_ps(&boxes.x_min[i]), x_max, _CMP_LE_OQ));
+            ok = _mm256_and_ps(ok, _mm256_cmp_ps(y_min, _mm256_loadu_ps(&boxes.y_max[i]), _CMP_LE_OQ));
+            ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_loadu_ps(&boxes.y_min[i]), y_max, _CMP_LE_OQ));
+            ok = _mm256_and_ps(ok, _mm256_cmp_ps(z_min, _mm256_loadu_ps(&boxes.z_max[i]), _CMP_LE_OQ));
+            ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_loadu_ps(&boxes.z_min[i]), z_max, _CMP_LE_OQ));
+
+            unsigned mask = _mm256_movemask_ps(ok);
+            if (end - i < 8) mask &= (1u << (end - i)) - 1;
+
+            while (mask) {
+                out[cnt++] = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+            }
+        }
+
+        return cnt;
+    }
+#endif
+
+    // Picks the widest kernel the running CPU supports, once per process.
+    template <typename scalar_t>
+    filter_func_t<scalar_t> get_filter();
+
+    template <>
+    inline filter_func_t<double> get_filter<double>() {
+#ifdef BOX_FILTER_X86
+        static const filter_func_t<double> filter = __builtin_cpu_supports("avx2") ? filter_avx2 :
+                                                    __builtin_cpu_supports("sse2") ? filter_sse2 :
+                                                                                     filter_scalar<double>;
+        return filter;
+#else
+        return filter_scalar<double>;
+#endif
+    }
+
+    template <>
+    inline filter_func_t<float> get_filter<float>() {
+#ifdef BOX_FILTER_X86
+        static const filter_func_t<float> filter = __builtin_cpu_supports("avx2") ? filter_avx2_float :
+                                                   __builtin_cpu_supports("sse2") ? filter_sse2_float :
+                                                                                    filter_scalar<float>;
+        return filter;
+#else
+        return filter_scalar<float>;
+#endif
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <limits>
+#include "hits.hpp"
+#include "stats.hpp"
+
+namespace broad_phase {
+
+    using answers::hits_t;
+
+    enum broad_engine_t {OCTREE, GRID, BVH, DYNAMIC, LOOSE};
+
+    // Coordinates of the boxes the candidate reject runs on; the exact test is
+    // always in double.
+    enum precision_t {DOUBLE_BOXES, FLOAT_BOXES};
+
+    struct max_min_crds_t
+    {
+        double x_min = std::numeric_limits<double>::infinity();
+        double x_max = -x_min;
+
+        double y_min = std::numeric_limits<double>::infinity();
+        double y_max = -y_min;
+
+        double z_min = std::numeric_limits<double>::infinity();
+        double z_max = -z_min;
+
+        void update(double x, double y, double z) {
+            if (x < x_min) x_min = x;
+            if (x > x_max) x_max = x;
+            if (y < y_min) y_min = y;
+            if (y > y_max) y_max = y;
+            if (z < z_min) z_min = z;
+            if (z > z_max) z_max = z;
+        }
+    };
+
+    // Spatial index over a static set of triangles that finds every triangle
+    // intersecting another one. Engines share the narrow phase, so they differ
+    // only in which candidate pairs reach it.
+    class broad_phase_t {
+        public:
+            virtual ~broad_phase_t() = default;
+
+            virtual void get_intersections(hits_t &ans, int threads = 1) const = 0;
+
+            virtual stats::shape_stats_t get_shape_stats() const { return {}; }
+    };
+}
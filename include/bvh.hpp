@@ -0,0 +1,368 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "triangles.hpp"
+#include "thread_pool.hpp"
+#include "narrow_phase.hpp"
+#include "broad_phase.hpp"
+
+namespace bvhs {
+
+    using namespace triangles;
+    using thread_pool::work_stealing_pool_t;
+    using narrow_phase::narrow_engine_t;
+    using broad_phase::max_min_crds_t;
+    using broad_phase::broad_phase_t;
+    using answers::hits_t;
+
+    const int      BINS_NUM       = 16;
+    const uint32_t MIN_LEAF_SIZE  = 4;
+    const uint32_t MAX_LEAF_SIZE  = 16;
+    const uint32_t PARALLEL_BUILD = 1 << 12;
+    const uint32_t PARALLEL_QUERY = 1 << 10;
+    const uint32_t BVH_CHUNK      = narrow_phase::BATCH_SIZE;
+
+    // Cost of one box test against one exact pair test, relative to the leaf cost.
+    const double TRAVERSAL_COST = 1.0;
+
+    inline double get_area(const aabb_t &box) {
+        double dx = box.x_max - box.x_min, dy = box.y_max - box.y_min, dz = box.z_max - box.z_min;
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    inline aabb_t get_empty_box() {
+        double inf = std::numeric_limits<double>::infinity();
+        return {inf, inf, inf, -inf, -inf, -inf};
+    }
+
+    inline void merge_box(aabb_t &box, const aabb_t &add) {
+        box.x_min = std::min(box.x_min, add.x_min); box.x_max = std::max(box.x_max, add.x_max);
+        box.y_min = std::min(box.y_min, add.y_min); box.y_max = std::max(box.y_max, add.y_max);
+        box.z_min = std::min(box.z_min, add.z_min); box.z_max = std::max(box.z_max, add.z_max);
+    }
+
+    // Bounding volume hierarchy built top-down with the surface-area heuristic over
+    // BINS_NUM centroid bins. Large subtrees are built as separate pool tasks, the
+    // self-intersection query descends the tree against itself simultaneously.
+    class bvh_t : public broad_phase_t {
+        // Leaf: prims_num primitives from first in prim_ids_. Inner node: children
+        // are first and first + 1, count is 0.
+        struct bvh_node_t {
+            aabb_t   box;
+            uint32_t first;
+            uint32_t count;
+            uint32_t prims_num;
+
+            bool is_leaf() const { return count != 0; }
+        };
+
+        struct bin_t {
+            aabb_t   box = get_empty_box();
+            uint32_t count = 0;
+        };
+
+        const std::vector<triangle_t> &trs_;
+        narrow_engine_t narrow_;
+
+        // Boxes grown by EPS / 2 on every side, see hash_grid_t.
+        std::vector<aabb_t> boxes_;
+
+        std::vector<uint32_t>   prim_ids_;
+        std::vector<bvh_node_t> nodes_;
+        std::atomic<uint32_t>   nodes_num_{0};
+
+        double get_centroid(uint32_t id, int axis) const {
+            const aabb_t &box = boxes_[id];
+
+            if (axis == 0) return (box.x_min + box.x_max) / 2;
+            if (axis == 1) return (box.y_min + box.y_max) / 2;
+            return (box.z_min + box.z_max) / 2;
+        }
+
+        // Returns the position splitting [first, first + count) into two children,
+        // or 0 when the range should stay a leaf.
+        uint32_t split(uint32_t first, uint32_t count, const aabb_t &node_box) {
+            double c_min[3], c_max[3];
+
+            for (int axis = 0; axis < 3; axis++) {
+                c_min[axis] =  std::numeric_limits<double>::infinity();
+                c_max[axis] = -std::numeric_limits<double>::infinity();
+            }
+
+            for (uint32_t i = first; i < first + count; ++i)
+                for (int axis = 0; axis < 3; axis++) {
+                    double cntr = get_centroid(prim_ids_[i], axis);
+                    c_min[axis] = std::min(c_min[axis], cntr);
+                    c_max[axis] = std::max(c_max[axis], cntr);
+                }
+
+            int axis = 0;
+            for (int i = 1; i < 3; i++)
+                if (c_max[i] - c_min[i] > c_max[axis] - c_min[axis]) axis = i;
+
+            double extent = c_max[axis] - c_min[axis];
+            if (!(extent > 0)) return 0;
+
+            auto get_bin = [&](uint32_t id) {
+                int bin = (get_centroid(id, axis) - c_min[axis]) / extent * BINS_NUM;
+                return std::min(bin, BINS_NUM - 1);
+            };
+
+            bin_t bins[BINS_NUM];
+            for (uint32_t i = first; i < first + count; ++i) {
+                bin_t &bin = bins[get_bin(prim_ids_[i])];
+                merge_box(bin.box, boxes_[prim_ids_[i]]);
+                bin.count++;
+            }
+
+            double   right_area[BINS_NUM];
+            uint32_t right_count[BINS_NUM];
+            aabb_t   acc = get_empty_box();
+            uint32_t acc_count = 0;
+
+            for (int i = BINS_NUM - 1; i > 0; i--) {
+                merge_box(acc, bins[i].box);
+                acc_count += bins[i].count;
+                right_area[i]  = acc_count ? get_area(acc) : 0;
+                right_count[i] = acc_count;
+            }
+
+            double best_cost = std::numeric_limits<double>::infinity();
+            int best_bin = 0;
+
+            acc = get_empty_box();
+            acc_count = 0;
+
+            for (int i = 1; i < BINS_NUM; i++) {
+                merge_box(acc, bins[i - 1].box);
+                acc_count += bins[i - 1].count;
+
+                if (!acc_count || !right_count[i]) continue;
+
+                double cost = get_area(acc) * acc_count + right_area[i] * right_count[i];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_bin  = i;
+                }
+            }
+
+            if (!best_bin) return 0;
+
+            double leaf_cost = get_area(node_box) * count;
+            best_cost += TRAVERSAL_COST * get_area(node_box);
+
+            if (count <= MAX_LEAF_SIZE && best_cost >= leaf_cost) return 0;
+
+            auto mid = std::partition(prim_ids_.begin() + first, prim_ids_.begin() + first + count,
+                                      [&](uint32_t id) { return get_bin(id) < best_bin; });
+            return mid - prim_ids_.begin();
+        }
+
+        void build_node(work_stealing_pool_t *pool, int worker, uint32_t node_id, uint32_t first, uint32_t count) {
+            aabb_t box = get_empty_box();
+            for (uint32_t i = first; i < first + count; ++i) merge_box(box, boxes_[prim_ids_[i]]);
+
+            nodes_[node_id] = {box, first, count, count};
+
+            if (count <= MIN_LEAF_SIZE) return;
+
+            uint32_t mid = split(first, count, box);
+            if (!mid) return;
+
+            uint32_t left = nodes_num_.fetch_add(2);
+
+            nodes_[node_id].first = left;
+            nodes_[node_id].count = 0;
+
+            uint32_t left_count = mid - first, right_count = count - left_count;
+
+            if (pool && count >= PARALLEL_BUILD) {
+                pool->submit(worker, [this, left, first, left_count](work_stealing_pool_t &pool, int worker) {
+                    build_node(&pool, worker, left, first, left_count);
+                });
+                pool->submit(worker, [this, left, mid, right_count](work_stealing_pool_t &pool, int worker) {
+                    build_node(&pool, worker, left + 1, mid, right_count);
+                });
+                return;
+            }
+
+            build_node(pool, worker, left, first, left_count);
+            build_node(pool, worker, left + 1, mid, right_count);
+        }
+
+        void check_candidates(uint32_t id, const uint32_t *cands, uint32_t cnt, hits_t &ans) const {
+            const aabb_t &box = boxes_[id];
+            uint32_t kept_ids[BVH_CHUNK];
+
+            for (uint32_t first = 0; first < cnt && !ans.is_stopped(); first += BVH_CHUNK) {
+                uint32_t last = std::min(first + BVH_CHUNK, cnt), kept = 0;
+
+                for (uint32_t k = first; k < last; ++k) {
+                    uint32_t cand = cands[k];
+
+                    if (!box.is_overlapped(boxes_[cand])) continue;
+                    if (ans.is_marked(id) && ans.is_marked(cand)) continue;
+
+                    kept_ids[kept++] = cand;
+                }
+
+                narrow_phase::for_each_hit(narrow_, trs_[id], kept,
+                    [&](uint32_t k) -> const triangle_t & { return trs_[kept_ids[k]]; },
+                    [&](uint32_t k) {
+                        ans.add(id, kept_ids[k]);
+                    });
+            }
+        }
+
+        void get_leaf_intersections(const bvh_node_t &leaf, hits_t &ans) const {
+            for (uint32_t i = leaf.first; i + 1 < leaf.first + leaf.count; ++i)
+                check_candidates(prim_ids_[i], &prim_ids_[i + 1], leaf.first + leaf.count - i - 1, ans);
+        }
+
+        void get_leaves_intersections(const bvh_node_t &leaf1, const bvh_node_t &leaf2, hits_t &ans) const {
+            for (uint32_t i = leaf1.first; i < leaf1.first + leaf1.count; ++i)
+                check_candidates(prim_ids_[i], &prim_ids_[leaf2.first], leaf2.count, ans);
+        }
+
+        // Pairs between two disjoint subtrees: descend into the bigger node while
+        // the boxes overlap.
+        void get_pair_intersections(work_stealing_pool_t *pool, int worker, uint32_t id1, uint32_t id2,
+                                    hits_t &ans) const {
+            const bvh_node_t &node1 = nodes_[id1], &node2 = nodes_[id2];
+
+            if (ans.is_stopped() || !node1.box.is_overlapped(node2.box)) return;
+
+            if (node1.is_leaf() && node2.is_leaf()) {
+                get_leaves_intersections(node1, node2, ans);
+                return;
+            }
+
+            bool split_first = node2.is_leaf() || (!node1.is_leaf() && get_area(node1.box) >= get_area(node2.box));
+
+            uint32_t split_id = split_first ? id1 : id2, other_id = split_first ? id2 : id1;
+            uint32_t child = nodes_[split_id].first;
+
+            if (pool && node1.prims_num + node2.prims_num >= PARALLEL_QUERY) {
+                for (uint32_t c = child; c < child + 2; ++c)
+                    pool->submit(worker, [this, c, other_id, &ans](work_stealing_pool_t &pool, int worker) {
+                        get_pair_intersections(&pool, worker, c, other_id, ans);
+                    });
+                return;
+            }
+
+            get_pair_intersections(pool, worker, child, other_id, ans);
+            get_pair_intersections(pool, worker, child + 1, other_id, ans);
+        }
+
+        void get_self_intersections(work_stealing_pool_t *pool, int worker, uint32_t node_id,
+                                    hits_t &ans) const {
+            const bvh_node_t &node = nodes_[node_id];
+
+            if (ans.is_stopped()) return;
+
+            if (node.is_leaf()) {
+                get_leaf_intersections(node, ans);
+                return;
+            }
+
+            uint32_t left = node.first;
+
+            if (pool && node.prims_num >= PARALLEL_QUERY) {
+                for (uint32_t c = left; c < left + 2; ++c)
+                    pool->submit(worker, [this, c, &ans](work_stealing_pool_t &pool, int worker) {
+                        get_self_intersections(&pool, worker, c, ans);
+                    });
+                pool->submit(worker, [this, left, &ans](work_stealing_pool_t &pool, int worker) {
+                    get_pair_intersections(&pool, worker, left, left + 1, ans);
+                });
+                return;
+            }
+
+            get_self_intersections(pool, worker, left, ans);
+            get_self_intersections(pool, worker, left + 1, ans);
+            get_pair_intersections(pool, worker, left, left + 1, ans);
+        }
+
+        public:
+            // Peak bytes the hierarchy takes per triangle, the triangle not counted:
+            // its box and primitive id and the two nodes the build reserves for it.
+            static constexpr size_t TR_BYTES = sizeof(aabb_t) + sizeof(uint32_t) + 2 * sizeof(bvh_node_t);
+
+            bvh_t(const std::vector<triangle_t> &trs, const max_min_crds_t &,
+                  narrow_engine_t narrow = narrow_phase::CLASSIC, int threads = 1) : trs_(trs), narrow_(narrow) {
+                uint32_t sz = trs.size();
+
+                boxes_.resize(sz);
+                prim_ids_.resize(sz);
+
+                for (uint32_t i = 0; i < sz; ++i) {
+                    aabb_t box = trs[i].get_aabb();
+                    boxes_[i] = {box.x_min - EPS / 2, box.y_min - EPS / 2, box.z_min - EPS / 2,
+                                 box.x_max + EPS / 2, box.y_max + EPS / 2, box.z_max + EPS / 2};
+                    prim_ids_[i] = i;
+                }
+
+                if (!sz) return;
+
+                nodes_.resize(2 * sz);
+                nodes_num_ = 1;
+
+                if (threads <= 1) build_node(nullptr, 0, 0, 0, sz);
+                else {
+                    work_stealing_pool_t pool{threads};
+
+                    pool.submit(0, [this, sz](work_stealing_pool_t &pool, int worker) {
+                        build_node(&pool, worker, 0, 0, sz);
+                    });
+                    pool.run();
+                }
+
+                nodes_.resize(nodes_num_);
+            }
+
+            ~bvh_t() override                   = default;
+            bvh_t(const bvh_t& bvh)            = delete;
+            bvh_t& operator=(const bvh_t& bvh) = delete;
+
+            void get_intersections(hits_t &ans, int threads = 1) const override {
+                if (nodes_.empty()) return;
+
+                if (threads <= 1) {
+                    get_self_intersections(nullptr, 0, 0, ans);
+                    return;
+                }
+
+                work_stealing_pool_t pool{threads};
+
+                pool.submit(0, [this, &ans](work_stealing_pool_t &pool, int worker) {
+                    get_self_intersections(&pool, worker, 0, ans);
+                });
+                pool.run();
+            }
+
+            stats::shape_stats_t get_shape_stats() const override {
+                stats::shape_stats_t shape;
+                if (nodes_.empty()) return shape;
+
+                std::vector<std::pair<uint32_t, uint32_t>> stack = {{0, 0}};
+
+                while (!stack.empty()) {
+                    auto [node_id, depth] = stack.back();
+                    stack.pop_back();
+
+                    const bvh_node_t &node = nodes_[node_id];
+                    shape.add_node(depth, node.count, false);
+
+                    if (!node.is_leaf()) {
+                        stack.push_back({node.first, depth + 1});
+                        stack.push_back({node.first + 1, depth + 1});
+                    }
+                }
+                return shape;
+            }
+    };
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "octotree.hpp"
+#include "plane_groups.hpp"
+
+// Octree or loose tree query with the coplanar pass of plane_groups.hpp in
+// front: the tree leaves out the pairs of one plane family, and is not built
+// at all when every triangle is in one family, as on stacked parallel planes.
+namespace coplanar_queries {
+
+    using namespace octotrees;
+    using plane_groups::plane_groups_t;
+
+    template <typename tree_t>
+    class coplanar_query_t : public broad_phase_t {
+        plane_groups_t groups_;
+        std::unique_ptr<tree_t> tree_;
+
+        public:
+            // Takes the triangles by reference, they must outlive the query.
+            coplanar_query_t(const std::vector<triangle_t> &trs, const max_min_crds_t &crds, narrow_engine_t narrow,
+                             const octree_params_t &params = {}, int threads = 1) : groups_(trs, threads) {
+                const uint32_t *families = groups_.families();
+
+                bool is_one_family = groups_.families_num() == 1 &&
+                                     std::none_of(families, families + trs.size(), [](uint32_t family) {
+                                         return family == plane_groups::NO_FAMILY;
+                                     });
+                if (is_one_family) return;
+
+                tree_ = std::make_unique<tree_t>(trs, crds, narrow, params, threads);
+                tree_->set_families(families);
+            }
+
+            coplanar_query_t(const coplanar_query_t& query)            = delete;
+            coplanar_query_t& operator=(const coplanar_query_t& query) = delete;
+
+            void get_intersections(hits_t &ans, int threads = 1) const override {
+                groups_.get_intersections(ans, threads);
+                if (tree_) tree_->get_intersections(ans, threads);
+            }
+
+            stats::shape_stats_t get_shape_stats() const override {
+                return tree_ ? tree_->get_shape_stats() : stats::shape_stats_t{};
+            }
+    };
+}
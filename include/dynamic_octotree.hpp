@@ -0,0 +1,322 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "triangles.hpp"
+#include "narrow_phase.hpp"
+#include "hits.hpp"
+#include "broad_phase.hpp"
+#include "octotree.hpp"
+
+namespace octotrees {
+
+    const uint32_t DYN_MAX_TRS_NODE = 32;
+    const int      DYN_MAX_DEPTH    = 32;
+
+    // Octree over triangles that come and go by id. Every triangle is kept in the
+    // deepest node whose cube holds it, as in octotree_t, but nodes own plain id
+    // lists that are split lazily when they grow past DYN_MAX_TRS_NODE. Every
+    // operation retests only the changed triangle and keeps, per id, the number of
+    // other triangles it intersects, so the intersecting set is always up to date.
+    class dynamic_octotree_t : public broad_phase_t {
+
+        using node_id_t = uint32_t;
+
+        static constexpr node_id_t NO_NODE = std::numeric_limits<node_id_t>::max();
+
+        struct dyn_node_t {
+            std::array<node_id_t, CHILD_NUM> children_;
+            std::vector<uint32_t> ids_;
+
+            point_t center_;
+            double  radius_;
+            int     depth_;
+            bool    is_leaf_ = true;
+
+            dyn_node_t(const point_t &center, double radius, int depth) :
+                center_(center), radius_(radius), depth_(depth) { children_.fill(NO_NODE); }
+        };
+
+        // Node holding the id and the position of the id in its list.
+        struct location_t {
+            node_id_t node = NO_NODE;
+            uint32_t  pos  = 0;
+        };
+
+        narrow_engine_t narrow_;
+
+        std::vector<dyn_node_t> nodes_;
+        node_id_t root_ = NO_NODE;
+
+        // Indexed by id; boxes are grown by EPS for the candidate reject.
+        std::vector<triangle_t> trs_;
+        std::vector<aabb_t>     boxes_;
+        std::vector<location_t> locs_;
+        std::vector<uint32_t>   counts_;
+
+        size_t size_ = 0;
+
+        // Pairs are always tested in the same order, so erasing an id undoes
+        // exactly the hits its insertion counted.
+        bool is_pair_intersected(uint32_t id1, uint32_t id2) const {
+            const triangle_t &tr1 = trs_[std::min(id1, id2)], &tr2 = trs_[std::max(id1, id2)];
+
+            STATS_ADD(CANDIDATE_PAIRS, 1);
+
+            if (narrow_ == narrow_phase::CLASSIC) return tr1.is_intersected(tr2);
+            return narrow_phase::is_intersected(tr1, tr2);
+        }
+
+        static point_t get_child_center(const dyn_node_t &node, int i) {
+            double next_rad = node.radius_ / 2;
+
+            return {node.center_.x_ + ((i & 1) ? next_rad : -next_rad),
+                    node.center_.y_ + ((i & 2) ? next_rad : -next_rad),
+                    node.center_.z_ + ((i & 4) ? next_rad : -next_rad)};
+        }
+
+        static int get_bucket(const dyn_node_t &node, const triangle_t &tr) {
+            for (int i = 0; i < CHILD_NUM; ++i)
+                if (tr.is_in_cube(get_child_center(node, i), node.radius_ / 2)) return i;
+
+            return CHILD_NUM;
+        }
+
+        static bool is_cube_overlapped(const dyn_node_t &node, const aabb_t &box) {
+            aabb_t cube{node.center_.x_ - node.radius_, node.center_.y_ - node.radius_,
+                        node.center_.z_ - node.radius_, node.center_.x_ + node.radius_,
+                        node.center_.y_ + node.radius_, node.center_.z_ + node.radius_};
+
+            return cube.is_overlapped(box);
+        }
+
+        node_id_t get_child(node_id_t node_id, int i) {
+            if (nodes_[node_id].children_[i] != NO_NODE) return nodes_[node_id].children_[i];
+
+            node_id_t child_id = nodes_.size();
+            nodes_.emplace_back(get_child_center(nodes_[node_id], i), nodes_[node_id].radius_ / 2,
+                                nodes_[node_id].depth_ + 1);
+
+            nodes_[node_id].children_[i] = child_id;
+            return child_id;
+        }
+
+        void push_id(node_id_t node_id, uint32_t id) {
+            locs_[id] = {node_id, static_cast<uint32_t>(nodes_[node_id].ids_.size())};
+            nodes_[node_id].ids_.push_back(id);
+        }
+
+        void remove_id(uint32_t id) {
+            std::vector<uint32_t> &ids = nodes_[locs_[id].node].ids_;
+
+            ids[locs_[id].pos] = ids.back();
+            locs_[ids.back()].pos = locs_[id].pos;
+            ids.pop_back();
+
+            locs_[id] = {};
+        }
+
+        // Moves the ids that fit a child cube one level down. The node stays an
+        // inner node even if nothing moved, later inserts go straight to children.
+        void split(node_id_t node_id) {
+            std::vector<uint32_t> ids;
+            ids.swap(nodes_[node_id].ids_);
+            nodes_[node_id].is_leaf_ = false;
+
+            for (uint32_t id : ids) {
+                int bucket = get_bucket(nodes_[node_id], trs_[id]);
+                push_id(bucket == CHILD_NUM ? node_id : get_child(node_id, bucket), id);
+            }
+        }
+
+        // Doubles the root towards the triangle until the triangle fits, the old
+        // root becomes one of the octants of the new one.
+        void grow_root(const triangle_t &tr) {
+            const aabb_t &box = tr.get_aabb();
+
+            while (!tr.is_in_cube(nodes_[root_].center_, nodes_[root_].radius_)) {
+                const dyn_node_t &root = nodes_[root_];
+                if (!std::isfinite(root.radius_)) return;
+
+                double rad = root.radius_;
+                int dir_x = (box.x_min + box.x_max) / 2 < root.center_.x_ ? -1 : 1,
+                    dir_y = (box.y_min + box.y_max) / 2 < root.center_.y_ ? -1 : 1,
+                    dir_z = (box.z_min + box.z_max) / 2 < root.center_.z_ ? -1 : 1;
+
+                point_t center{root.center_.x_ + dir_x * rad, root.center_.y_ + dir_y * rad,
+                               root.center_.z_ + dir_z * rad};
+                int old_bucket = (dir_x < 0 ? 1 : 0) | (dir_y < 0 ? 2 : 0) | (dir_z < 0 ? 4 : 0);
+
+                node_id_t new_root = nodes_.size();
+                nodes_.emplace_back(center, 2 * rad, nodes_[root_].depth_ - 1);
+
+                nodes_[new_root].children_[old_bucket] = root_;
+                nodes_[new_root].is_leaf_ = false;
+                root_ = new_root;
+            }
+        }
+
+        void create_root(const aabb_t &box) {
+            double radius = std::max({box.x_max - box.x_min, box.y_max - box.y_min, box.z_max - box.z_min}) / 2;
+
+            nodes_.emplace_back(point_t{(box.x_max + box.x_min) / 2, (box.y_max + box.y_min) / 2,
+                                        (box.z_max + box.z_min) / 2},
+                                radius + EPS, 0);
+            root_ = nodes_.size() - 1;
+        }
+
+        void place(uint32_t id) {
+            const triangle_t &tr = trs_[id];
+
+            if (root_ == NO_NODE) create_root(tr.get_aabb());
+            grow_root(tr);
+
+            node_id_t node_id = root_;
+
+            while (!nodes_[node_id].is_leaf_) {
+                int bucket = get_bucket(nodes_[node_id], tr);
+                if (bucket == CHILD_NUM) break;
+
+                node_id = get_child(node_id, bucket);
+            }
+
+            push_id(node_id, id);
+
+            const dyn_node_t &node = nodes_[node_id];
+            if (node.is_leaf_ && node.ids_.size() > DYN_MAX_TRS_NODE &&
+                node.depth_ - nodes_[root_].depth_ < DYN_MAX_DEPTH) split(node_id);
+        }
+
+        // Calls func for every other stored id intersecting the triangle of id.
+        // A triangle lies inside its node cube, so nodes whose cube misses the
+        // grown box can't hold a candidate.
+        template <typename func_t>
+        void for_each_intersected(uint32_t id, func_t func) const {
+            if (root_ == NO_NODE) return;
+
+            const aabb_t &box = boxes_[id];
+            std::vector<node_id_t> stack = {root_};
+
+            while (!stack.empty()) {
+                const dyn_node_t &node = nodes_[stack.back()];
+                stack.pop_back();
+
+                if (!is_cube_overlapped(node, box)) continue;
+
+                for (uint32_t cand : node.ids_)
+                    if (cand != id && box.is_overlapped(boxes_[cand]) && is_pair_intersected(id, cand))
+                        func(cand);
+
+                for (node_id_t child_id : node.children_)
+                    if (child_id != NO_NODE) stack.push_back(child_id);
+            }
+        }
+
+        public:
+            // Peak bytes the tree takes per triangle, not counting the triangle it
+            // was given: its own copy, box, location and count, its id in a node
+            // list and its share of nodes of up to DYN_MAX_TRS_NODE ids, all twice
+            // as the arrays grow by doubling.
+            static constexpr size_t TR_BYTES = 2 * (sizeof(triangle_t) + sizeof(aabb_t) + sizeof(location_t) +
+                                                    sizeof(uint32_t) + sizeof(uint32_t) +
+                                                    (CHILD_NUM * sizeof(dyn_node_t) + DYN_MAX_TRS_NODE - 1) /
+                                                    DYN_MAX_TRS_NODE);
+
+            explicit dynamic_octotree_t(const max_min_crds_t &crds = {},
+                                        narrow_engine_t narrow = narrow_phase::CLASSIC) : narrow_(narrow) {
+                if (crds.x_min <= crds.x_max)
+                    create_root({crds.x_min, crds.y_min, crds.z_min, crds.x_max, crds.y_max, crds.z_max});
+            }
+
+            // Inserts the triangles with their indices as ids.
+            dynamic_octotree_t(const std::vector<triangle_t> &trs, const max_min_crds_t &crds,
+                               narrow_engine_t narrow = narrow_phase::CLASSIC) : dynamic_octotree_t(crds, narrow) {
+                for (size_t i = 0; i < trs.size(); ++i) insert(i, trs[i]);
+            }
+
+            ~dynamic_octotree_t() override                              = default;
+            dynamic_octotree_t(const dynamic_octotree_t& tr)            = delete;
+            dynamic_octotree_t(dynamic_octotree_t&& tr)                 = delete;
+            dynamic_octotree_t& operator=(const dynamic_octotree_t& tr) = delete;
+            dynamic_octotree_t& operator=(dynamic_octotree_t&& tr)      = delete;
+
+            // Inserting an id that is already stored replaces its triangle.
+            void insert(uint32_t id, const triangle_t &tr) {
+                if (contains(id)) erase(id);
+
+                if (id >= trs_.size()) {
+                    trs_.resize(id + 1, tr);
+                    boxes_.resize(id + 1);
+                    locs_.resize(id + 1);
+                    counts_.resize(id + 1, 0);
+                }
+
+                aabb_t box = tr.get_aabb();
+
+                trs_[id]   = tr;
+                boxes_[id] = {box.x_min - EPS, box.y_min - EPS, box.z_min - EPS,
+                              box.x_max + EPS, box.y_max + EPS, box.z_max + EPS};
+                counts_[id] = 0;
+
+                for_each_intersected(id, [&](uint32_t cand) {
+                    counts_[cand]++;
+                    counts_[id]++;
+                });
+
+                place(id);
+                size_++;
+            }
+
+            // Returns false if the id is not stored.
+            bool erase(uint32_t id) {
+                if (!contains(id)) return false;
+
+                remove_id(id);
+                for_each_intersected(id, [&](uint32_t cand) { counts_[cand]--; });
+
+                counts_[id] = 0;
+                size_--;
+                return true;
+            }
+
+            void update(uint32_t id, const triangle_t &tr) { insert(id, tr); }
+
+            bool contains(uint32_t id) const { return id < locs_.size() && locs_[id].node != NO_NODE; }
+
+            size_t size() const { return size_; }
+
+            // Amount of stored triangles the id intersects, 0 for absent ids.
+            uint32_t get_count(uint32_t id) const { return id < counts_.size() ? counts_[id] : 0; }
+
+            bool is_intersected(uint32_t id) const { return get_count(id) != 0; }
+
+            // The set is maintained on every change, so only pairs are searched for,
+            // every pair from the side of its smaller id.
+            void get_intersections(hits_t &ans, int = 1) const override {
+                for (uint32_t id = 0; id < counts_.size() && !ans.is_stopped(); ++id) {
+                    if (!counts_[id]) continue;
+
+                    if (ans.mode() != answers::PAIRS) {
+                        ans.mark(id);
+                        continue;
+                    }
+
+                    for_each_intersected(id, [&](uint32_t cand) {
+                        if (cand > id) ans.add(id, cand);
+                    });
+                }
+            }
+
+            stats::shape_stats_t get_shape_stats() const override {
+                stats::shape_stats_t shape;
+
+                for (const dyn_node_t &node : nodes_)
+                    shape.add_node(node.depth_ - nodes_[root_].depth_, node.ids_.size(), !node.is_leaf_);
+                return shape;
+            }
+    };
+}
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <iostream>
+#include <limits>
 #include "double_funcs.hpp"
 
 namespace geometry {
@@ -12,7 +15,7 @@ enum location_t {COINCIDE, PARALLEL, INTERSECT, INTERBR};
 
 class point_t {
     public:
-        const double x_, y_, z_;
+        double x_, y_, z_;
 
         point_t(double x = NAN, double y = NAN, double z = NAN) : x_(x), y_(y), z_(z) {};
 
@@ -37,6 +40,49 @@ class point_t {
         }
 };
 
+// Axis-aligned box, used by the broad phase to reject pairs before the exact test.
+// The coordinates may be float for rejects that only need to be conservative.
+template <typename scalar_t>
+struct basic_aabb_t {
+    scalar_t x_min, y_min, z_min;
+    scalar_t x_max, y_max, z_max;
+
+    void extend(const point_t &pnt) {
+        x_min = std::min(x_min, pnt.x_); x_max = std::max(x_max, pnt.x_);
+        y_min = std::min(y_min, pnt.y_); y_max = std::max(y_max, pnt.y_);
+        z_min = std::min(z_min, pnt.z_); z_max = std::max(z_max, pnt.z_);
+    }
+
+    bool is_overlapped(const basic_aabb_t &box, scalar_t margin = 0) const {
+        return x_min <= box.x_max + margin && box.x_min <= x_max + margin &&
+               y_min <= box.y_max + margin && box.y_min <= y_max + margin &&
+               z_min <= box.z_max + margin && box.z_min <= z_max + margin;
+    }
+};
+
+using aabb_t = basic_aabb_t<double>;
+
+// The box of scalar_t holding the box: every bound is rounded outwards, so a
+// test on the rounded boxes never rejects a pair the test on the exact ones keeps.
+template <typename scalar_t>
+basic_aabb_t<scalar_t> round_out(const aabb_t &box) {
+    // A step of |res| * epsilon plus the least subnormal moves res past at least
+    // one neighbour, and no scalar_t lies between val and its rounding res.
+    auto step = [](scalar_t res) {
+        return std::abs(res) * std::numeric_limits<scalar_t>::epsilon() + std::numeric_limits<scalar_t>::denorm_min();
+    };
+    auto down = [&](double val) {
+        scalar_t res = static_cast<scalar_t>(val);
+        return res > val ? res - step(res) : res;
+    };
+    auto up = [&](double val) {
+        scalar_t res = static_cast<scalar_t>(val);
+        return res < val ? res + step(res) : res;
+    };
+
+    return {down(box.x_min), down(box.y_min), down(box.z_min), up(box.x_max), up(box.y_max), up(box.z_max)};
+}
+
 class vector_t {
     double x_, y_, z_;
 
@@ -108,8 +154,8 @@ class vector_t {
 
 class line_t {
     public:
-        const point_t  pnt;
-        const vector_t dir_vec;
+        point_t  pnt;
+        vector_t dir_vec;
 
         line_t(const point_t &pnt, const vector_t &vec) :
             pnt(pnt), dir_vec(vec / (vec.is_zero_len() ? 1 : vec.len())) {}
@@ -150,9 +196,9 @@ class line_t {
 
 class line_segment_t {
     public:
-        const point_t pnt1;
-        const point_t pnt2;
-        const line_t  line;
+        point_t pnt1;
+        point_t pnt2;
+        line_t  line;
 
         line_segment_t(const point_t &p1 = point_t{}, const point_t &p2 = point_t{}) :
             pnt1(p1), pnt2(p2), line({p1, {p1, p2}}) {}
@@ -248,8 +294,8 @@ class line_segment_t {
 
 class plane_t {
     public:
-        const double a_, b_, c_, d_;
-        const vector_t norm_vec;
+        double a_, b_, c_, d_;
+        vector_t norm_vec;
 
         plane_t(double a = NAN, double b = NAN, double c = NAN, double d = NAN) :
             a_(a), b_(b), c_(c), d_(d) {};
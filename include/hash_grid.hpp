@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "triangles.hpp"
+#include "thread_pool.hpp"
+#include "box_filter.hpp"
+#include "narrow_phase.hpp"
+#include "broad_phase.hpp"
+
+namespace hash_grids {
+
+    using namespace triangles;
+    using thread_pool::work_stealing_pool_t;
+    using box_filter::boxes_soa_t;
+    using narrow_phase::narrow_engine_t;
+    using broad_phase::max_min_crds_t;
+    using broad_phase::broad_phase_t;
+    using answers::hits_t;
+
+    const int      KEY_BITS         = 21;
+    const uint64_t KEY_MASK         = (uint64_t{1} << KEY_BITS) - 1;
+    const uint64_t MAX_CELLS_PER_TR = 64;
+
+    // Cells a triangle no larger than a cell overlaps at most, two along each axis.
+    const uint64_t ENTRIES_PER_TR = 8;
+    const uint32_t CELLS_PER_TASK   = 256;
+    const uint32_t GRID_CHUNK       = narrow_phase::BATCH_SIZE;
+
+    // Uniform grid with the cell size taken from the median triangle extent. A
+    // triangle is registered in every cell its box overlaps as a (cell key, id)
+    // entry, the entries are sorted by key so each cell is one contiguous run.
+    // Triangles that would cover more than MAX_CELLS_PER_TR cells are kept in a
+    // separate list and checked against all triangles instead.
+    class hash_grid_t : public broad_phase_t {
+        struct entry_t {
+            uint64_t key;
+            uint32_t id;
+
+            bool operator<(const entry_t &ent) const {
+                return key < ent.key || (key == ent.key && id < ent.id);
+            }
+        };
+
+        struct cell_range_t {
+            uint32_t lo[3];
+            uint32_t hi[3];
+        };
+
+        const std::vector<triangle_t> &trs_;
+        narrow_engine_t narrow_;
+
+        double origin_[3] = {0, 0, 0};
+        double cell_ = 1;
+
+        // Boxes grown by EPS / 2 on every side: two of them overlap exactly when
+        // the octree's EPS-grown query box overlaps the plain box.
+        std::vector<aabb_t> boxes_;
+
+        std::vector<entry_t>  entries_;
+        std::vector<uint32_t> cell_starts_;
+        boxes_soa_t<double> entry_boxes_;
+
+        std::vector<uint32_t> large_;
+        boxes_soa_t<double> all_boxes_;
+
+        box_filter::filter_func_t<double> filter_ = box_filter::get_filter<double>();
+
+        uint32_t get_cell(double crd, int axis) const {
+            double cell = std::floor((crd - origin_[axis]) / cell_);
+
+            if (!(cell > 0)) return 0;
+            if (cell > KEY_MASK) return KEY_MASK;
+            return cell;
+        }
+
+        cell_range_t get_cell_range(const aabb_t &box) const {
+            return {{get_cell(box.x_min, 0), get_cell(box.y_min, 1), get_cell(box.z_min, 2)},
+                    {get_cell(box.x_max, 0), get_cell(box.y_max, 1), get_cell(box.z_max, 2)}};
+        }
+
+        static uint64_t get_key(uint64_t x, uint64_t y, uint64_t z) {
+            return x | (y << KEY_BITS) | (z << (2 * KEY_BITS));
+        }
+
+        // The pair is owned by the cell holding the min corner of the boxes' overlap,
+        // so a pair sharing several cells is decided once.
+        bool is_owner(uint64_t key, const aabb_t &box1, const aabb_t &box2) const {
+            return key == get_key(get_cell(std::max(box1.x_min, box2.x_min), 0),
+                                  get_cell(std::max(box1.y_min, box2.y_min), 1),
+                                  get_cell(std::max(box1.z_min, box2.z_min), 2));
+        }
+
+        double get_median_extent() const {
+            std::vector<double> extents(boxes_.size());
+
+            for (size_t i = 0; i < boxes_.size(); ++i) {
+                const aabb_t &box = boxes_[i];
+                extents[i] = std::max({box.x_max - box.x_min, box.y_max - box.y_min, box.z_max - box.z_min});
+            }
+
+            auto mid = extents.begin() + extents.size() / 2;
+            std::nth_element(extents.begin(), mid, extents.end());
+            return *mid;
+        }
+
+        void build(const max_min_crds_t &crds) {
+            origin_[0] = crds.x_min;
+            origin_[1] = crds.y_min;
+            origin_[2] = crds.z_min;
+
+            double domain = std::max({crds.x_max - crds.x_min, crds.y_max - crds.y_min, crds.z_max - crds.z_min});
+
+            cell_ = std::max(get_median_extent(), domain / KEY_MASK);
+            if (!(cell_ > 0)) cell_ = 1;
+
+            for (uint32_t id = 0; id < boxes_.size(); ++id) {
+                cell_range_t range = get_cell_range(boxes_[id]);
+
+                uint64_t cells_num = uint64_t{range.hi[0] - range.lo[0] + 1} *
+                                     (range.hi[1] - range.lo[1] + 1) * (range.hi[2] - range.lo[2] + 1);
+
+                if (cells_num > MAX_CELLS_PER_TR) {
+                    large_.push_back(id);
+                    continue;
+                }
+
+                for (uint64_t z = range.lo[2]; z <= range.hi[2]; ++z)
+                    for (uint64_t y = range.lo[1]; y <= range.hi[1]; ++y)
+                        for (uint64_t x = range.lo[0]; x <= range.hi[0]; ++x)
+                            entries_.push_back({get_key(x, y, z), id});
+            }
+
+            std::sort(entries_.begin(), entries_.end());
+
+            for (uint32_t i = 0; i < entries_.size(); ++i)
+                if (!i || entries_[i].key != entries_[i - 1].key) cell_starts_.push_back(i);
+            cell_starts_.push_back(entries_.size());
+
+            entry_boxes_.resize(entries_.size());
+            for (uint32_t i = 0; i < entries_.size(); ++i)
+                entry_boxes_.set(i, boxes_[entries_[i].id]);
+
+            all_boxes_.resize(boxes_.size());
+            for (uint32_t id = 0; id < boxes_.size(); ++id)
+                all_boxes_.set(id, boxes_[id]);
+        }
+
+        void check_pair_candidates(uint32_t id, const uint32_t *cands, uint32_t cnt, hits_t &ans) const {
+            const triangle_t &tr = trs_[id];
+
+            narrow_phase::for_each_hit(narrow_, tr, cnt,
+                [&](uint32_t k) -> const triangle_t & { return trs_[cands[k]]; },
+                [&](uint32_t k) {
+                    ans.add(id, cands[k]);
+                });
+        }
+
+        void get_cell_intersections(uint32_t cell, hits_t &ans) const {
+            uint32_t begin = cell_starts_[cell], end = cell_starts_[cell + 1];
+            uint64_t key   = entries_[begin].key;
+
+            uint32_t survivors[GRID_CHUNK];
+            box_filter::boxes_view_t<double> entry_boxes = entry_boxes_.view();
+
+            for (uint32_t i = begin; i < end; ++i) {
+                uint32_t id = entries_[i].id;
+                const aabb_t &box = boxes_[id];
+
+                for (uint32_t chunk = i + 1; chunk < end && !ans.is_stopped(); chunk += GRID_CHUNK) {
+                    uint32_t cnt = filter_(box, entry_boxes, chunk, std::min(chunk + GRID_CHUNK, end), survivors);
+                    uint32_t kept = 0;
+
+                    for (uint32_t k = 0; k < cnt; ++k) {
+                        uint32_t cand = entries_[survivors[k]].id;
+
+                        if (!is_owner(key, box, boxes_[cand])) continue;
+                        if (ans.is_marked(id) && ans.is_marked(cand)) continue;
+
+                        survivors[kept++] = cand;
+                    }
+                    check_pair_candidates(id, survivors, kept, ans);
+                }
+            }
+        }
+
+        // Large triangle against every other triangle; a pair of large triangles
+        // is taken by the one that comes first in large_.
+        void get_large_intersections(uint32_t large_pos, hits_t &ans) const {
+            uint32_t id = large_[large_pos];
+            uint32_t survivors[GRID_CHUNK];
+
+            for (uint32_t chunk = 0; chunk < boxes_.size() && !ans.is_stopped(); chunk += GRID_CHUNK) {
+                uint32_t end = std::min<uint32_t>(chunk + GRID_CHUNK, boxes_.size());
+                uint32_t cnt = filter_(boxes_[id], all_boxes_.view(), chunk, end, survivors);
+                uint32_t kept = 0;
+
+                for (uint32_t k = 0; k < cnt; ++k) {
+                    uint32_t cand = survivors[k];
+
+                    if (cand == id || (ans.is_marked(id) && ans.is_marked(cand))) continue;
+
+                    auto cand_large = std::lower_bound(large_.begin(), large_.end(), cand);
+                    if (cand_large != large_.end() && *cand_large == cand &&
+                        cand_large - large_.begin() <= large_pos) continue;
+
+                    survivors[kept++] = cand;
+                }
+                check_pair_candidates(id, survivors, kept, ans);
+            }
+        }
+
+        public:
+            // Peak bytes the grid takes per triangle, the triangle not counted: its
+            // two boxes and, for each of ENTRIES_PER_TR cells, the entry, twice as the
+            // array grows by doubling, the entry box and the cell start. Cells are
+            // the median extent, so this holds for triangles of similar sizes.
+            static constexpr size_t TR_BYTES = sizeof(aabb_t) + 6 * sizeof(double) +
+                                               ENTRIES_PER_TR * (2 * sizeof(entry_t) + 6 * sizeof(double) +
+                                                                 sizeof(uint32_t));
+
+            hash_grid_t(const std::vector<triangle_t> &trs, const max_min_crds_t &crds,
+                        narrow_engine_t narrow = narrow_phase::CLASSIC) : trs_(trs), narrow_(narrow) {
+                boxes_.resize(trs.size());
+
+                for (size_t i = 0; i < trs.size(); ++i) {
+                    aabb_t box = trs[i].get_aabb();
+                    boxes_[i] = {box.x_min - EPS / 2, box.y_min - EPS / 2, box.z_min - EPS / 2,
+                                 box.x_max + EPS / 2, box.y_max + EPS / 2, box.z_max + EPS / 2};
+                }
+
+                if (!trs.empty()) build(crds);
+            }
+
+            ~hash_grid_t() override                       = default;
+            hash_grid_t(const hash_grid_t& grid)            = delete;
+            hash_grid_t& operator=(const hash_grid_t& grid) = delete;
+
+            void get_intersections(hits_t &ans, int threads = 1) const override {
+                uint32_t cells_num = cell_starts_.empty() ? 0 : cell_starts_.size() - 1;
+
+                if (threads <= 1) {
+                    for (uint32_t cell = 0; cell < cells_num; ++cell)
+                        get_cell_intersections(cell, ans);
+                    for (uint32_t i = 0; i < large_.size(); ++i)
+                        get_large_intersections(i, ans);
+                    return;
+                }
+
+                work_stealing_pool_t pool{threads};
+
+                for (uint32_t first = 0; first < cells_num; first += CELLS_PER_TASK) {
+                    uint32_t last = std::min(first + CELLS_PER_TASK, cells_num);
+
+                    pool.submit(0, [this, first, last, &ans](work_stealing_pool_t &, int) {
+                        for (uint32_t cell = first; cell < last; ++cell)
+                            get_cell_intersections(cell, ans);
+                    });
+                }
+                for (uint32_t i = 0; i < large_.size(); ++i)
+                    pool.submit(0, [this, i, &ans](work_stealing_pool_t &, int) {
+                        get_large_intersections(i, ans);
+                    });
+
+                pool.run();
+            }
+
+            // Cells are the nodes of a grid; the large triangles, checked against
+            // all others, are reported as interior ones.
+            stats::shape_stats_t get_shape_stats() const override {
+                stats::shape_stats_t shape;
+
+                for (uint32_t cell = 0; cell + 1 < cell_starts_.size(); ++cell)
+                    shape.add_node(0, cell_starts_[cell + 1] - cell_starts_[cell], false);
+
+                shape.interior_trs = large_.size();
+                return shape;
+            }
+    };
+}
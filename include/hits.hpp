@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "ans_bitmap.hpp"
+
+namespace answers {
+
+    enum query_mode_t {ANY, COUNT, IDS, PAIRS};
+
+    const size_t PAIRS_BUF_SIZE = 1 << 16;
+
+    // Receives the intersecting pairs found by a broad phase. ids and count keep
+    // only the bitmap, so pairs of marked triangles may be skipped; any stops the
+    // query at the first hit; pairs are written out as they are found, through a
+    // small buffer shared by all query threads.
+    class hits_t {
+        query_mode_t mode_;
+        ans_bitmap_t ids_;
+
+        std::atomic<bool> stopped_{false};
+
+        FILE *out_;
+        std::mutex out_mutex_;
+        std::vector<char> out_buf_;
+        bool out_ok_ = true;
+
+        // Set while one tile of a tiled query runs, see set_tile.
+        const uint32_t *tile_ids_ = nullptr;
+        std::function<bool(size_t, size_t)> tile_owns_;
+
+        void flush_pairs() {
+            out_ok_ = out_ok_ && std::fwrite(out_buf_.data(), 1, out_buf_.size(), out_) == out_buf_.size();
+            out_buf_.clear();
+        }
+
+        void write_pair(size_t id1, size_t id2) {
+            const size_t MAX_PAIR_LEN = 42;
+
+            if (id1 > id2) std::swap(id1, id2);
+
+            std::lock_guard<std::mutex> lock(out_mutex_);
+
+            size_t len = out_buf_.size();
+            out_buf_.resize(len + MAX_PAIR_LEN);
+
+            char *pos = out_buf_.data() + len;
+            pos = std::to_chars(pos, pos + MAX_PAIR_LEN / 2, id1).ptr;
+            *pos++ = ' ';
+            pos = std::to_chars(pos, pos + MAX_PAIR_LEN / 2, id2).ptr;
+            *pos++ = '\n';
+
+            out_buf_.resize(pos - out_buf_.data());
+            if (out_buf_.size() >= PAIRS_BUF_SIZE) flush_pairs();
+        }
+
+        public:
+            hits_t(query_mode_t mode, size_t sz, FILE *out = stdout) : mode_(mode), ids_(sz), out_(out) {
+                if (mode_ == PAIRS) out_buf_.reserve(PAIRS_BUF_SIZE);
+            }
+
+            hits_t(const hits_t& hits)            = delete;
+            hits_t& operator=(const hits_t& hits) = delete;
+
+            query_mode_t mode() const { return mode_; }
+
+            const ans_bitmap_t &ids() const { return ids_; }
+
+            bool is_stopped() const { return stopped_.load(std::memory_order_relaxed); }
+
+            // Engine ids are taken as positions in ids until clear_tile, and only the
+            // pairs owns accepts are written: a pair found in several tiles is kept
+            // once. The other modes keep every pair, marking an id twice is harmless.
+            void set_tile(const uint32_t *ids, std::function<bool(size_t, size_t)> owns) {
+                tile_ids_  = ids;
+                tile_owns_ = std::move(owns);
+            }
+
+            void clear_tile() {
+                tile_ids_ = nullptr;
+                tile_owns_ = nullptr;
+            }
+
+            // Only true when a pair made of marked ids can't change the answer.
+            bool is_marked(size_t id) const {
+                return mode_ != PAIRS && ids_.test(tile_ids_ ? tile_ids_[id] : id);
+            }
+
+            void add(size_t id1, size_t id2) {
+                if (tile_ids_) {
+                    if (mode_ == PAIRS && !tile_owns_(id1, id2)) return;
+
+                    id1 = tile_ids_[id1];
+                    id2 = tile_ids_[id2];
+                }
+
+                if (mode_ == PAIRS) {
+                    write_pair(id1, id2);
+                    return;
+                }
+
+                ids_.set(id1);
+                ids_.set(id2);
+                if (mode_ == ANY) stopped_.store(true, std::memory_order_relaxed);
+            }
+
+            // For engines that know intersecting ids without the pairs.
+            void mark(size_t id) {
+                ids_.set(tile_ids_ ? tile_ids_[id] : id);
+                if (mode_ == ANY) stopped_.store(true, std::memory_order_relaxed);
+            }
+
+            // any prints 1 or 0, count the amount of intersecting triangles, ids one
+            // id per line and pairs flushes what is left of the stream.
+            bool write() {
+                if (mode_ == PAIRS) {
+                    flush_pairs();
+                    return out_ok_ && !std::fflush(out_);
+                }
+                if (mode_ == IDS) return ids_.write(out_);
+
+                size_t res = mode_ == ANY ? ids_.count() != 0 : ids_.count();
+                return std::fprintf(out_, "%zu\n", res) > 0 && !std::fflush(out_);
+            }
+    };
+}
@@ -0,0 +1,590 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include "triangles.hpp"
+#include "predicates.hpp"
+
+namespace narrow_phase {
+
+    using namespace triangles;
+    using predicates::orient_plane_t;
+
+    // CLASSIC is triangle_t::is_intersected, FAST decides pairs with the exact
+    // orientation predicates of predicates.hpp and handles blocks of candidates
+    // in one pass.
+    enum narrow_engine_t {CLASSIC, FAST};
+
+    const uint32_t BATCH_SIZE = 256;
+
+    inline bool is_same_side(int s0, int s1, int s2) {
+        return (s0 > 0 && s1 > 0 && s2 > 0) || (s0 < 0 && s1 < 0 && s2 < 0);
+    }
+
+    // Index of the axis with the largest normal component: dropping it gives
+    // the 2D projection with the least distortion.
+    inline int get_dominant_axis(double x, double y, double z) {
+        x = std::abs(x); y = std::abs(y); z = std::abs(z);
+
+        if (x >= y && x >= z) return 0;
+        if (y >= z) return 1;
+        return 2;
+    }
+
+    inline int get_dominant_axis(const orient_plane_t &pln) { return get_dominant_axis(pln.nx, pln.ny, pln.nz); }
+
+    struct pnt2_t { double u, v; };
+
+    // Dropping a coordinate is exact, so the 2D predicates stay exact too.
+    inline pnt2_t project(const point_t &pnt, int axis) {
+        if (axis == 0) return {pnt.y_, pnt.z_};
+        if (axis == 1) return {pnt.x_, pnt.z_};
+        return {pnt.x_, pnt.y_};
+    }
+
+    inline int orient2d(const pnt2_t &a, const pnt2_t &b, const pnt2_t &c) {
+        return predicates::orient2d(a.u, a.v, b.u, b.v, c.u, c.v);
+    }
+
+    inline bool is_in_box2d(const pnt2_t &a, const pnt2_t &b, const pnt2_t &p) {
+        return std::min(a.u, b.u) <= p.u && p.u <= std::max(a.u, b.u) &&
+               std::min(a.v, b.v) <= p.v && p.v <= std::max(a.v, b.v);
+    }
+
+    inline bool segs_intersect2d(const pnt2_t &a, const pnt2_t &b, const pnt2_t &c, const pnt2_t &d) {
+        int o1 = orient2d(a, b, c), o2 = orient2d(a, b, d),
+            o3 = orient2d(c, d, a), o4 = orient2d(c, d, b);
+
+        if (o1 * o2 < 0 && o3 * o4 < 0) return true;
+
+        return (o1 == 0 && is_in_box2d(a, b, c)) || (o2 == 0 && is_in_box2d(a, b, d)) ||
+               (o3 == 0 && is_in_box2d(c, d, a)) || (o4 == 0 && is_in_box2d(c, d, b));
+    }
+
+    inline bool is_pnt_in_tr2d(const pnt2_t &a, const pnt2_t &b, const pnt2_t &c, const pnt2_t &p) {
+        int o1 = orient2d(a, b, p), o2 = orient2d(b, c, p), o3 = orient2d(c, a, p);
+
+        return (o1 >= 0 && o2 >= 0 && o3 >= 0) || (o1 <= 0 && o2 <= 0 && o3 <= 0);
+    }
+
+    inline bool is_seg_tr_intersected2d(const pnt2_t (&tr)[3], const pnt2_t &s1, const pnt2_t &s2) {
+        return segs_intersect2d(tr[0], tr[1], s1, s2) ||
+               segs_intersect2d(tr[1], tr[2], s1, s2) ||
+               segs_intersect2d(tr[2], tr[0], s1, s2) || is_pnt_in_tr2d(tr[0], tr[1], tr[2], s1);
+    }
+
+    inline orient_plane_t get_plane(const triangle_t &tr) {
+        return {tr.get_pnt(0), tr.get_pnt(1), tr.get_pnt(2)};
+    }
+
+    inline bool trs_intersect2d(const pnt2_t (&p)[3], const pnt2_t (&q)[3]) {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                if (segs_intersect2d(p[i], p[(i + 1) % 3], q[j], q[(j + 1) % 3])) return true;
+
+        return is_pnt_in_tr2d(p[0], p[1], p[2], q[0]) || is_pnt_in_tr2d(q[0], q[1], q[2], p[0]);
+    }
+
+    inline void project(const triangle_t &tr, int axis, pnt2_t (&pnts)[3]) {
+        for (int i = 0; i < 3; i++) pnts[i] = project(tr.get_pnt(i), axis);
+    }
+
+    // Axis to project a triangle along, with the triangle projected into pnts.
+    // The rounded normal of a thin triangle may pick an axis its projection is
+    // exactly flat along, then any axis it isn't flat along is taken instead.
+    inline int project(const triangle_t &tr, const orient_plane_t &pln, pnt2_t (&pnts)[3]) {
+        int axis = get_dominant_axis(pln);
+
+        project(tr, axis, pnts);
+        for (int i = 1; i < 3 && orient2d(pnts[0], pnts[1], pnts[2]) == 0; ++i) {
+            axis = (axis + 1) % 3;
+            project(tr, axis, pnts);
+        }
+        return axis;
+    }
+
+    inline bool coplanar_trs_intersect(const triangle_t &tr1, const triangle_t &tr2, const orient_plane_t &pln) {
+        pnt2_t p[3], q[3];
+        int axis = project(tr1, pln, p);
+
+        project(tr2, axis, q);
+        return trs_intersect2d(p, q);
+    }
+
+    // Both triangles cross the line of the two planes; p1 and p2 are the vertices
+    // alone on their side of the other plane, and the triangles are oriented so
+    // that the segments on the line overlap iff two orientations say so
+    // (Guigue, Devillers).
+    inline bool check_min_max(const point_t &p1, const point_t &q1, const point_t &r1,
+                              const point_t &p2, const point_t &q2, const point_t &r2) {
+        if (predicates::orient3d(q1, p2, p1, q2) > 0) return false;
+        return predicates::orient3d(p1, p2, r1, r2) <= 0;
+    }
+
+    // Puts the vertex of the second triangle that is alone on its side of the
+    // first plane in front; s_p2, s_q2 and s_r2 are the sides of p2, q2 and r2.
+    inline bool trs_intersect_canonical(const point_t &p1, const point_t &q1, const point_t &r1,
+                                        const point_t &p2, const point_t &q2, const point_t &r2,
+                                        int s_p2, int s_q2, int s_r2) {
+        if (s_p2 > 0) {
+            if (s_q2 > 0) return check_min_max(p1, r1, q1, r2, p2, q2);
+            if (s_r2 > 0) return check_min_max(p1, r1, q1, q2, r2, p2);
+            return check_min_max(p1, q1, r1, p2, q2, r2);
+        }
+        if (s_p2 < 0) {
+            if (s_q2 < 0) return check_min_max(p1, q1, r1, r2, p2, q2);
+            if (s_r2 < 0) return check_min_max(p1, q1, r1, q2, r2, p2);
+            return check_min_max(p1, r1, q1, p2, q2, r2);
+        }
+        if (s_q2 < 0) {
+            if (s_r2 >= 0) return check_min_max(p1, r1, q1, q2, r2, p2);
+            return check_min_max(p1, q1, r1, p2, q2, r2);
+        }
+        if (s_q2 > 0) {
+            if (s_r2 > 0) return check_min_max(p1, r1, q1, p2, q2, r2);
+            return check_min_max(p1, q1, r1, q2, r2, p2);
+        }
+        if (s_r2 > 0) return check_min_max(p1, q1, r1, r2, p2, q2);
+        return check_min_max(p1, r1, q1, r2, p2, q2);
+    }
+
+    // Decides a triangle pair whose sides already passed the same side test:
+    // sp are the sides of tr1's vertices against the plane of tr2, sq of tr2's
+    // against the plane of tr1.
+    inline bool trs_intersect(const triangle_t &tr1, const triangle_t &tr2, const orient_plane_t &pln1,
+                              const int (&sp)[3], const int (&sq)[3]) {
+        if (sp[0] == 0 && sp[1] == 0 && sp[2] == 0) return coplanar_trs_intersect(tr1, tr2, pln1);
+
+        const point_t &p1 = tr1.get_pnt(0), &q1 = tr1.get_pnt(1), &r1 = tr1.get_pnt(2),
+                      &p2 = tr2.get_pnt(0), &q2 = tr2.get_pnt(1), &r2 = tr2.get_pnt(2);
+
+        // Rotates tr1 so its lone vertex comes first; a mirrored tr2 flips the sides.
+        if (sp[0] > 0) {
+            if (sp[1] > 0) return trs_intersect_canonical(r1, p1, q1, p2, r2, q2, sq[0], sq[2], sq[1]);
+            if (sp[2] > 0) return trs_intersect_canonical(q1, r1, p1, p2, r2, q2, sq[0], sq[2], sq[1]);
+            return trs_intersect_canonical(p1, q1, r1, p2, q2, r2, sq[0], sq[1], sq[2]);
+        }
+        if (sp[0] < 0) {
+            if (sp[1] < 0) return trs_intersect_canonical(r1, p1, q1, p2, q2, r2, sq[0], sq[1], sq[2]);
+            if (sp[2] < 0) return trs_intersect_canonical(q1, r1, p1, p2, q2, r2, sq[0], sq[1], sq[2]);
+            return trs_intersect_canonical(p1, q1, r1, p2, r2, q2, sq[0], sq[2], sq[1]);
+        }
+        if (sp[1] < 0) {
+            if (sp[2] >= 0) return trs_intersect_canonical(q1, r1, p1, p2, r2, q2, sq[0], sq[2], sq[1]);
+            return trs_intersect_canonical(p1, q1, r1, p2, q2, r2, sq[0], sq[1], sq[2]);
+        }
+        if (sp[1] > 0) {
+            if (sp[2] > 0) return trs_intersect_canonical(p1, q1, r1, p2, r2, q2, sq[0], sq[2], sq[1]);
+            return trs_intersect_canonical(q1, r1, p1, p2, q2, r2, sq[0], sq[1], sq[2]);
+        }
+        if (sp[2] > 0) return trs_intersect_canonical(r1, p1, q1, p2, q2, r2, sq[0], sq[1], sq[2]);
+        return trs_intersect_canonical(r1, p1, q1, p2, r2, q2, sq[0], sq[2], sq[1]);
+    }
+
+    inline bool trs_intersect(const triangle_t &tr1, const triangle_t &tr2) {
+        orient_plane_t pln2 = get_plane(tr2);
+        int sp[3] = {pln2.get_side(tr1.get_pnt(0)), pln2.get_side(tr1.get_pnt(1)), pln2.get_side(tr1.get_pnt(2))};
+        if (is_same_side(sp[0], sp[1], sp[2])) return false;
+
+        orient_plane_t pln1 = get_plane(tr1);
+        int sq[3] = {pln1.get_side(tr2.get_pnt(0)), pln1.get_side(tr2.get_pnt(1)), pln1.get_side(tr2.get_pnt(2))};
+        if (is_same_side(sq[0], sq[1], sq[2])) return false;
+
+        return trs_intersect(tr1, tr2, pln1, sp, sq);
+    }
+
+    inline bool tr_pnt_intersect(const triangle_t &tr, const point_t &pnt) {
+        orient_plane_t pln = get_plane(tr);
+        if (pln.get_side(pnt) != 0) return false;
+
+        pnt2_t p[3];
+        int axis = project(tr, pln, p);
+        return is_pnt_in_tr2d(p[0], p[1], p[2], project(pnt, axis));
+    }
+
+    inline bool tr_seg_intersect(const triangle_t &tr, const point_t &s1, const point_t &s2) {
+        orient_plane_t pln = get_plane(tr);
+        int d1 = pln.get_side(s1), d2 = pln.get_side(s2);
+
+        if (d1 * d2 > 0) return false;
+
+        const point_t &a = tr.get_pnt(0), &b = tr.get_pnt(1), &c = tr.get_pnt(2);
+
+        if (d1 == 0 && d2 == 0) {
+            pnt2_t p[3];
+            int axis = project(tr, pln, p);
+
+            return is_seg_tr_intersected2d(p, project(s1, axis), project(s2, axis));
+        }
+
+        // The segment meets the plane once; the point lies in the triangle iff the
+        // line passes every edge on the same side.
+        int e1 = predicates::orient3d(s1, s2, a, b), e2 = predicates::orient3d(s1, s2, b, c),
+            e3 = predicates::orient3d(s1, s2, c, a);
+
+        return (e1 >= 0 && e2 >= 0 && e3 >= 0) || (e1 <= 0 && e2 <= 0 && e3 <= 0);
+    }
+
+    inline bool is_same_pnt(const point_t &pnt1, const point_t &pnt2) {
+        return pnt1.x_ == pnt2.x_ && pnt1.y_ == pnt2.y_ && pnt1.z_ == pnt2.z_;
+    }
+
+    // Segments, either possibly a single point, meet only in a common plane. A
+    // projection along an axis is one-to-one on that plane, or on the line if
+    // the figures are collinear, for at least one axis, and never separates
+    // figures that meet, so they meet iff they meet in all three projections.
+    // The projections go first: they turn most pairs down before the orient3d,
+    // which on the coplanar pairs of flat scenes always takes its exact path.
+    inline bool segs_intersect(const point_t &p1, const point_t &p2, const point_t &q1, const point_t &q2) {
+        for (int axis = 0; axis < 3; ++axis)
+            if (!segs_intersect2d(project(p1, axis), project(p2, axis), project(q1, axis), project(q2, axis)))
+                return false;
+
+        return is_same_pnt(p1, p2) || is_same_pnt(q1, q2) || predicates::orient3d(p1, p2, q1, q2) == 0;
+    }
+
+    using tr_types_t = triangle_t::tr_types_t;
+
+    const tr_types_t TRIAN = triangle_t::TRIAN, LINE = triangle_t::LINE, POINT = triangle_t::POINT;
+
+    // Type of a triangle for the given engine: the classic one decides flatness
+    // with EPS tests, the fast one exactly, so a thin triangle stays a triangle.
+    inline tr_types_t get_type(const triangle_t &tr, narrow_engine_t narrow) {
+        return narrow == FAST ? tr.get_exact_type() : tr.get_type();
+    }
+
+    // Records of the figures in the pair kernels: a triangle as it is, a LINE as
+    // the edge that holds it and a POINT as its vertex.
+    struct segment_t {
+        point_t pnt1;
+        point_t pnt2;
+    };
+
+    template <tr_types_t type>
+    using figure_t = std::conditional_t<type == TRIAN, triangle_t,
+                                        std::conditional_t<type == LINE, segment_t, point_t>>;
+
+    // Record of a triangle of the given type for the engine; a TRIAN is passed on
+    // by reference. The classic engine keeps a LINE as its longest edge.
+    template <tr_types_t type>
+    decltype(auto) get_figure(const triangle_t &tr, narrow_engine_t narrow) {
+        if constexpr (type == TRIAN) return (tr);
+        else if constexpr (type == LINE) {
+            if (narrow == FAST) return segment_t{tr.get_end_pnt1(), tr.get_end_pnt2()};
+            return segment_t{tr.get_longest_pnt1(), tr.get_longest_pnt2()};
+        }
+        else return tr.get_pnt(0);
+    }
+
+    // Sphere of the classic reject. A LINE is centered on its midpoint instead of
+    // the centroid of its vertices, the radius still covers it with room to spare.
+    inline point_t get_cntr(const triangle_t &tr) { return tr.get_cntr(); }
+
+    inline point_t get_cntr(const segment_t &seg) {
+        return {(seg.pnt1.x_ + seg.pnt2.x_) / 2, (seg.pnt1.y_ + seg.pnt2.y_) / 2, (seg.pnt1.z_ + seg.pnt2.z_) / 2};
+    }
+
+    inline point_t get_cntr(const point_t &pnt) { return pnt; }
+
+    inline double get_radius(const triangle_t &tr) { return tr.get_radius(); }
+
+    inline double get_radius(const segment_t &seg) { return vector_t{seg.pnt1, seg.pnt2}.len(); }
+
+    inline double get_radius(const point_t &) { return 0; }
+
+    // Test of a figure of type1 against a figure of type2, picked at compile time:
+    // classic runs the tests of triangle_t, fast the exact predicates. Pairs are
+    // specialized with the simpler figure second, the rest swap their figures.
+    template <tr_types_t type1, tr_types_t type2>
+    struct pair_kernel {
+        static bool classic(const figure_t<type1> &fig1, const figure_t<type2> &fig2) {
+            return pair_kernel<type2, type1>::classic(fig2, fig1);
+        }
+
+        static bool fast(const figure_t<type1> &fig1, const figure_t<type2> &fig2) {
+            return pair_kernel<type2, type1>::fast(fig2, fig1);
+        }
+    };
+
+    template <>
+    struct pair_kernel<TRIAN, TRIAN> {
+        static bool classic(const triangle_t &tr1, const triangle_t &tr2) { return tr1.trs_intersect(tr2); }
+
+        static bool fast(const triangle_t &tr1, const triangle_t &tr2) { return trs_intersect(tr1, tr2); }
+    };
+
+    template <>
+    struct pair_kernel<TRIAN, LINE> {
+        static bool classic(const triangle_t &tr, const segment_t &seg) {
+            return tr.tr_seg_intersect(seg.pnt1, seg.pnt2);
+        }
+
+        static bool fast(const triangle_t &tr, const segment_t &seg) {
+            return tr_seg_intersect(tr, seg.pnt1, seg.pnt2);
+        }
+    };
+
+    template <>
+    struct pair_kernel<TRIAN, POINT> {
+        static bool classic(const triangle_t &tr, const point_t &pnt) { return tr.tr_pnt_intersect(pnt); }
+
+        static bool fast(const triangle_t &tr, const point_t &pnt) { return tr_pnt_intersect(tr, pnt); }
+    };
+
+    template <>
+    struct pair_kernel<LINE, LINE> {
+        static bool classic(const segment_t &seg1, const segment_t &seg2) {
+            return triangle_t::segs_intersect(seg1.pnt1, seg1.pnt2, seg2.pnt1, seg2.pnt2);
+        }
+
+        static bool fast(const segment_t &seg1, const segment_t &seg2) {
+            return segs_intersect(seg1.pnt1, seg1.pnt2, seg2.pnt1, seg2.pnt2);
+        }
+    };
+
+    template <>
+    struct pair_kernel<LINE, POINT> {
+        static bool classic(const segment_t &seg, const point_t &pnt) {
+            return triangle_t::seg_pnt_intersect(seg.pnt1, seg.pnt2, pnt);
+        }
+
+        static bool fast(const segment_t &seg, const point_t &pnt) {
+            return segs_intersect(seg.pnt1, seg.pnt2, pnt, pnt);
+        }
+    };
+
+    template <>
+    struct pair_kernel<POINT, POINT> {
+        static bool classic(const point_t &pnt1, const point_t &pnt2) { return pnt1 == pnt2; }
+
+        static bool fast(const point_t &pnt1, const point_t &pnt2) { return is_same_pnt(pnt1, pnt2); }
+    };
+
+    // One pair through its kernel. The classic engine first rejects pairs whose
+    // spheres are apart, as triangle_t::is_intersected does.
+    template <narrow_engine_t narrow, tr_types_t type1, tr_types_t type2>
+    bool test_pair(const figure_t<type1> &fig1, const figure_t<type2> &fig2) {
+        if constexpr (narrow == CLASSIC) {
+            if (vector_t{get_cntr(fig1), get_cntr(fig2)}.len() > get_radius(fig1) + get_radius(fig2)) {
+                STATS_ADD(SPHERE_REJECTS, 1);
+                return false;
+            }
+        }
+
+        STATS_EXACT(type1, type2);
+
+        if constexpr (narrow == CLASSIC) return pair_kernel<type1, type2>::classic(fig1, fig2);
+        else return pair_kernel<type1, type2>::fast(fig1, fig2);
+    }
+
+    template <tr_types_t type1>
+    bool is_intersected(const triangle_t &tr1, const triangle_t &tr2) {
+        decltype(auto) fig1 = get_figure<type1>(tr1, FAST);
+
+        switch (tr2.get_exact_type()) {
+            case TRIAN: return test_pair<FAST, type1, TRIAN>(fig1, get_figure<TRIAN>(tr2, FAST));
+            case LINE:  return test_pair<FAST, type1, LINE>(fig1, get_figure<LINE>(tr2, FAST));
+            default:    return test_pair<FAST, type1, POINT>(fig1, get_figure<POINT>(tr2, FAST));
+        }
+    }
+
+    // Per-pair entry of the FAST engine, dispatching on the degenerate types.
+    inline bool is_intersected(const triangle_t &tr1, const triangle_t &tr2) {
+        switch (tr1.get_exact_type()) {
+            case TRIAN: return is_intersected<TRIAN>(tr1, tr2);
+            case LINE:  return is_intersected<LINE>(tr1, tr2);
+            default:    return is_intersected<POINT>(tr1, tr2);
+        }
+    }
+
+    // Decides one triangle against a block of triangle candidates. The filtered
+    // side tests of all pairs run first as straight-line arithmetic over
+    // structure-of-arrays copies of the candidates; only sides the filter can't
+    // settle go to the exact orient3d, and only pairs that straddle both planes
+    // reach the scalar code.
+    class pair_batch_t {
+        double qx_[3][BATCH_SIZE], qy_[3][BATCH_SIZE], qz_[3][BATCH_SIZE];
+        double dq_[3][BATCH_SIZE], err_[3][BATCH_SIZE];
+
+        const triangle_t *cands_[BATCH_SIZE];
+        uint32_t sz_ = 0;
+
+        public:
+            uint32_t size() const { return sz_; }
+
+            void clear() { sz_ = 0; }
+
+            void add(const triangle_t &tr) {
+                for (int k = 0; k < 3; k++) {
+                    qx_[k][sz_] = tr.get_pnt(k).x_;
+                    qy_[k][sz_] = tr.get_pnt(k).y_;
+                    qz_[k][sz_] = tr.get_pnt(k).z_;
+                }
+                cands_[sz_++] = &tr;
+            }
+
+            // hits[k] is set to whether tr intersects the k-th added candidate.
+            void run(const triangle_t &tr, bool *hits) {
+                orient_plane_t pln = get_plane(tr);
+                const double ax = pln.a.x_, ay = pln.a.y_, az = pln.a.z_;
+                const double nx = pln.nx, ny = pln.ny, nz = pln.nz, px = pln.px, py = pln.py, pz = pln.pz;
+
+                for (int v = 0; v < 3; v++)
+                    for (uint32_t k = 0; k < sz_; k++) {
+                        double wx = qx_[v][k] - ax, wy = qy_[v][k] - ay, wz = qz_[v][k] - az;
+
+                        dq_[v][k]  = wx * nx + wy * ny + wz * nz;
+                        err_[v][k] = predicates::O3D_ERR_BOUND *
+                                     (std::abs(wx) * px + std::abs(wy) * py + std::abs(wz) * pz);
+                    }
+
+                for (uint32_t k = 0; k < sz_; k++) {
+                    int sq[3];
+                    for (int v = 0; v < 3; v++) {
+                        double det = dq_[v][k], err = err_[v][k];
+
+                        sq[v] = std::abs(det) >= err ? predicates::get_sign(det) : pln.get_side(cands_[k]->get_pnt(v));
+                    }
+                    if (is_same_side(sq[0], sq[1], sq[2])) {
+                        STATS_ADD(PLANE_REJECTS, 1);
+                        hits[k] = false;
+                        continue;
+                    }
+
+                    // Counted past the plane reject, as the classic test is past the sphere one.
+                    STATS_EXACT(TRIAN, TRIAN);
+
+                    orient_plane_t cand_pln = get_plane(*cands_[k]);
+                    int sp[3] = {cand_pln.get_side(tr.get_pnt(0)), cand_pln.get_side(tr.get_pnt(1)),
+                                 cand_pln.get_side(tr.get_pnt(2))};
+
+                    hits[k] = !is_same_side(sp[0], sp[1], sp[2]) && trs_intersect(tr, *cands_[k], pln, sp, sq);
+                }
+            }
+    };
+
+    // Candidates of for_each_hit taken from their triangles, get_tr(k) returning
+    // the k-th one. A broad phase that keeps the records of its figures passes
+    // them with the same get_type and get instead.
+    template <typename get_tr_t>
+    struct tr_cands_t {
+        narrow_engine_t narrow;
+        get_tr_t get_tr;
+
+        tr_types_t get_type(uint32_t k) const { return narrow_phase::get_type(get_tr(k), narrow); }
+
+        template <tr_types_t type>
+        decltype(auto) get(uint32_t k) const { return get_figure<type>(get_tr(k), narrow); }
+    };
+
+    // Indices of a block of candidates, split by type in their order.
+    struct type_buckets_t {
+        uint32_t ks[3][BATCH_SIZE];
+        uint32_t sizes[3];
+    };
+
+    // Runs the kernel of the pair of types over sz candidates of type2, at most
+    // BATCH_SIZE, ks giving their indices.
+    template <narrow_engine_t narrow, tr_types_t type1, tr_types_t type2, typename cands_t, typename func_t>
+    void run_bucket(const figure_t<type1> &fig, const uint32_t *ks, uint32_t sz, const cands_t &cands,
+                    func_t &func) {
+        if constexpr (narrow == FAST && type1 == TRIAN && type2 == TRIAN) {
+            if (!sz) return;
+
+            pair_batch_t batch;
+            bool hits[BATCH_SIZE];
+
+            for (uint32_t i = 0; i < sz; ++i) batch.add(cands.template get<TRIAN>(ks[i]));
+            batch.run(fig, hits);
+
+            for (uint32_t i = 0; i < sz; ++i)
+                if (hits[i]) func(ks[i]);
+        }
+        else {
+            for (uint32_t i = 0; i < sz; ++i)
+                if (test_pair<narrow, type1, type2>(fig, cands.template get<type2>(ks[i]))) func(ks[i]);
+        }
+    }
+
+    template <narrow_engine_t narrow, tr_types_t type, typename cands_t, typename func_t>
+    void run_buckets(const triangle_t &tr, const type_buckets_t &buckets, const cands_t &cands, func_t &func) {
+        decltype(auto) fig = get_figure<type>(tr, narrow);
+
+        run_bucket<narrow, type, TRIAN>(fig, buckets.ks[TRIAN], buckets.sizes[TRIAN], cands, func);
+        run_bucket<narrow, type, LINE>(fig, buckets.ks[LINE], buckets.sizes[LINE], cands, func);
+        run_bucket<narrow, type, POINT>(fig, buckets.ks[POINT], buckets.sizes[POINT], cands, func);
+    }
+
+    template <narrow_engine_t narrow, tr_types_t type1, tr_types_t type2, typename cands_t, typename func_t>
+    void run_typed(const triangle_t &tr, const uint32_t *ks, uint32_t cnt, const cands_t &cands, func_t &func) {
+        decltype(auto) fig = get_figure<type1>(tr, narrow);
+
+        for (uint32_t first = 0; first < cnt; first += BATCH_SIZE)
+            run_bucket<narrow, type1, type2>(fig, ks + first, std::min(BATCH_SIZE, cnt - first), cands, func);
+    }
+
+    // Exact test of tr against cnt candidates, calling func(k) for every k-th
+    // candidate that intersects tr. Blocks of candidates are split by type and
+    // every bucket goes through the kernel of its pair of types, so the types are
+    // looked at once per block for tr and once per candidate, not per test.
+    template <typename cands_t, typename func_t>
+    void for_each_figure_hit(narrow_engine_t narrow, const triangle_t &tr, uint32_t cnt, const cands_t &cands,
+                             func_t func) {
+        using run_t = void (*)(const triangle_t &, const type_buckets_t &, const cands_t &, func_t &);
+
+        static constexpr run_t RUNS[2][3] = {
+            {run_buckets<CLASSIC, TRIAN, cands_t, func_t>, run_buckets<CLASSIC, LINE, cands_t, func_t>,
+             run_buckets<CLASSIC, POINT, cands_t, func_t>},
+            {run_buckets<FAST, TRIAN, cands_t, func_t>, run_buckets<FAST, LINE, cands_t, func_t>,
+             run_buckets<FAST, POINT, cands_t, func_t>}};
+
+        STATS_ADD(CANDIDATE_PAIRS, cnt);
+
+        run_t run = RUNS[narrow][get_type(tr, narrow)];
+        type_buckets_t buckets;
+
+        for (uint32_t first = 0; first < cnt; first += BATCH_SIZE) {
+            uint32_t last = std::min(first + BATCH_SIZE, cnt);
+
+            std::fill(buckets.sizes, buckets.sizes + 3, 0);
+            for (uint32_t k = first; k < last; ++k) {
+                tr_types_t type = cands.get_type(k);
+                buckets.ks[type][buckets.sizes[type]++] = k;
+            }
+            run(tr, buckets, cands, func);
+        }
+    }
+
+    // The same for cnt candidates all of type cand_type, ks giving their indices,
+    // as a broad phase that keeps its figures ordered by type finds them: the
+    // candidates go through one kernel with no type read per candidate.
+    template <typename cands_t, typename func_t>
+    void for_each_typed_hit(narrow_engine_t narrow, const triangle_t &tr, tr_types_t cand_type, const uint32_t *ks,
+                            uint32_t cnt, const cands_t &cands, func_t func) {
+        using run_t = void (*)(const triangle_t &, const uint32_t *, uint32_t, const cands_t &, func_t &);
+
+        static constexpr run_t RUNS[2][3][3] = {
+            {{run_typed<CLASSIC, TRIAN, TRIAN, cands_t, func_t>, run_typed<CLASSIC, TRIAN, LINE, cands_t, func_t>,
+              run_typed<CLASSIC, TRIAN, POINT, cands_t, func_t>},
+             {run_typed<CLASSIC, LINE, TRIAN, cands_t, func_t>, run_typed<CLASSIC, LINE, LINE, cands_t, func_t>,
+              run_typed<CLASSIC, LINE, POINT, cands_t, func_t>},
+             {run_typed<CLASSIC, POINT, TRIAN, cands_t, func_t>, run_typed<CLASSIC, POINT, LINE, cands_t, func_t>,
+              run_typed<CLASSIC, POINT, POINT, cands_t, func_t>}},
+            {{run_typed<FAST, TRIAN, TRIAN, cands_t, func_t>, run_typed<FAST, TRIAN, LINE, cands_t, func_t>,
+              run_typed<FAST, TRIAN, POINT, cands_t, func_t>},
+             {run_typed<FAST, LINE, TRIAN, cands_t, func_t>, run_typed<FAST, LINE, LINE, cands_t, func_t>,
+              run_typed<FAST, LINE, POINT, cands_t, func_t>},
+             {run_typed<FAST, POINT, TRIAN, cands_t, func_t>, run_typed<FAST, POINT, LINE, cands_t, func_t>,
+              run_typed<FAST, POINT, POINT, cands_t, func_t>}}};
+
+        STATS_ADD(CANDIDATE_PAIRS, cnt);
+        RUNS[narrow][get_type(tr, narrow)][cand_type](tr, ks, cnt, cands, func);
+    }
+
+    // The same with the k-th candidate given by get_tr(k).
+    template <typename get_tr_t, typename func_t>
+    void for_each_hit(narrow_engine_t narrow, const triangle_t &tr, uint32_t cnt, get_tr_t get_tr, func_t func) {
+        for_each_figure_hit(narrow, tr, cnt, tr_cands_t<get_tr_t>{narrow, get_tr}, func);
+    }
+}
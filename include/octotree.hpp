@@ -1,157 +1,937 @@
 #pragma once
 
-#include <list>
-#include <set>
+#include <algorithm>
+#include <array>
 #include <vector>
 #include <limits>
+#include <cstdint>
+#include <type_traits>
+#include <cstdio>
+#include <cstring>
 #include "triangles.hpp"
+#include "thread_pool.hpp"
+#include "box_filter.hpp"
+#include "narrow_phase.hpp"
+#include "hits.hpp"
+#include "broad_phase.hpp"
+#include "array_view.hpp"
+#include "radix_sort.hpp"
+#include "octree_index.hpp"
+#include "plane_groups.hpp"
 
 namespace octotrees {
 
     using namespace triangles;
+    using thread_pool::work_stealing_pool_t;
+    using box_filter::boxes_soa_t;
+    using box_filter::boxes_view_t;
+    using array_views::array_view_t;
+    using narrow_phase::narrow_engine_t;
+    using narrow_phase::tr_types_t;
+    using narrow_phase::segment_t;
+    using narrow_phase::TRIAN;
+    using narrow_phase::LINE;
+    using narrow_phase::POINT;
+    using answers::hits_t;
+    using broad_phase::max_min_crds_t;
+    using broad_phase::broad_phase_t;
 
     const char CHILD_NUM = 8;
     const int  MAX_TRS_NODE = 1000;
+    const int  MAX_DEPTH    = 32;
 
-    struct max_min_crds_t
-    {
-        double x_min = std::numeric_limits<double>::infinity();
-        double x_max = -x_min;
+    // Levels of the cell path in a build key: 3 bits per level and the depth in
+    // the low KEY_DEPTH_BITS take 62 bits.
+    const int KEY_LEVELS     = 19;
+    const int KEY_DEPTH_BITS = 5;
 
-        double y_min = std::numeric_limits<double>::infinity();
-        double y_max = -y_min;
+    // Figure tag of a position: the type in the top bits, the index of the
+    // LINE or POINT record in the rest.
+    const int      FIG_TYPE_SHIFT = 30;
+    const uint32_t FIG_INDEX_MASK = (1u << FIG_TYPE_SHIFT) - 1;
 
-        double z_min = std::numeric_limits<double>::infinity();
-        double z_max = -z_min;
+    const uint32_t PAIRS_PER_TASK = 1 << 14;
+    const uint32_t FILTER_CHUNK   = narrow_phase::BATCH_SIZE;
+    const uint32_t SUBTREE_SCAN   = narrow_phase::BATCH_SIZE;
 
-        void update(double x, double y, double z) {
-            if (x < x_min) x_min = x;
-            if (x > x_max) x_max = x;
-            if (y < y_min) y_min = y;
-            if (y > y_max) y_max = y;
-            if (z < z_min) z_min = z;
-            if (z > z_max) z_max = z;
-        }
+    // looseness 1 gives the classic octree: a triangle goes to a child only if it
+    // is strictly inside the child cube. With looseness k > 1 the child is picked
+    // by the triangle's box center and the triangle fits if it is inside the
+    // child cube scaled by k around the child center.
+    struct octree_params_t {
+        double   looseness = 1;
+        uint32_t leaf_size = MAX_TRS_NODE;
     };
 
-    class octotree_t {
+    const double MIN_LOOSENESS = 1.25;
+    const double MAX_LOOSENESS = 2;
 
-        struct id_trian_t {
-            int id;
-            triangle_t tr;
-            id_trian_t(int id_, triangle_t tr_) : id(id_), tr(tr_) {}
+    // Leaves of a loose tree hold LOOSE_LEAF_SCALE times the squared looseness.
+    const double   LOOSE_LEAF_SCALE    = 16;
+    const uint32_t MIN_LOOSE_LEAF_SIZE = LOOSE_LEAF_SCALE * MIN_LOOSENESS * MIN_LOOSENESS;
+
+    // Looseness grows with the spread of triangle sizes, taken as the ratio of the
+    // 90th percentile extent to the median one: with similar triangles a tighter
+    // tree wins, with a long tail of large ones a looser tree keeps them out of the
+    // upper levels. Leaves get larger together with the looseness, since looser
+    // leaves overlap more of their neighbours anyway.
+    inline octree_params_t get_loose_params(const std::vector<triangle_t> &trs) {
+        octree_params_t params;
+        if (trs.empty()) return params;
+
+        std::vector<double> extents(trs.size());
+        for (size_t i = 0; i < trs.size(); ++i) {
+            aabb_t box = trs[i].get_aabb();
+            extents[i] = std::max({box.x_max - box.x_min, box.y_max - box.y_min, box.z_max - box.z_min});
+        }
+
+        auto mid = extents.begin() + extents.size() / 2, top = extents.begin() + extents.size() * 9 / 10;
+
+        std::nth_element(extents.begin(), mid, extents.end());
+        double median = *mid;
+        std::nth_element(mid, top, extents.end());
+        double spread = median > 0 ? *top / median : 1;
+
+        params.looseness = std::clamp(1 + spread / 4, MIN_LOOSENESS, MAX_LOOSENESS);
+        params.leaf_size = LOOSE_LEAF_SCALE * params.looseness * params.looseness;
+        return params;
+    }
+
+    // scalar_t is the type of the boxes of the candidate reject. With float the
+    // reject runs on boxes rounded outwards, twice as many per vector, and its
+    // survivors are confirmed on the double boxes of the triangles, so the same
+    // pairs reach the narrow phase as with double.
+    template <typename scalar_t>
+    class basic_octotree_t : public broad_phase_t {
+
+        using node_id_t = uint32_t;
+
+        // Slice of tr_ids_ whose figures are all of one type.
+        struct range_t {
+            uint32_t   first;
+            uint32_t   last;
+            tr_types_t type;
         };
 
-        using ans_set_t = typename std::set<int>;
+        static constexpr node_id_t NO_NODE = std::numeric_limits<node_id_t>::max();
 
-        class octonode_t {
-            std::array<std::list<octonode_t>::pointer, 8> children_ = {nullptr};
-            std::list<id_trian_t> triangles_;
+        // Nodes live in one pool and refer to children by index. Every subtree owns
+        // a contiguous slice of tr_ids_: the node's own triangles [trs_begin_, trs_end_)
+        // come first, the slices of its children follow up to subtree_end_. The own
+        // triangles are ordered by type, TRIAN, LINE from lines_begin_, then POINT
+        // from pnts_begin_.
+        struct octonode_t {
+            std::array<node_id_t, CHILD_NUM> children_;
+
+            uint32_t trs_begin_   = 0;
+            uint32_t lines_begin_ = 0;
+            uint32_t pnts_begin_  = 0;
+            uint32_t trs_end_     = 0;
+            uint32_t subtree_end_ = 0;
 
             unsigned int active_nodes_ = 0;
             bool is_leaf_ = true;
 
-            const point_t center_;
-            const double  radius_;
+            // Bit 1 << type for every type in the subtree, a subtree of one type is
+            // scanned as one range.
+            unsigned char subtree_types_ = 0;
+
+            point_t center_;
+            double  radius_;
+
+            // Box of all triangles of the subtree, used to prune the scans of
+            // descendants and the sibling pairs of a loose tree.
+            aabb_t bounds_;
+
+            octonode_t(const point_t &center, double radius, uint32_t trs_begin, uint32_t trs_end) :
+                trs_begin_(trs_begin), trs_end_(trs_end), subtree_end_(trs_end),
+                center_(center), radius_(radius) { children_.fill(NO_NODE); }
+
+            uint32_t size() const { return trs_end_ - trs_begin_; }
+
+            unsigned char get_own_types() const {
+                return (trs_begin_ != lines_begin_) << TRIAN | (lines_begin_ != pnts_begin_) << LINE |
+                       (pnts_begin_ != trs_end_) << POINT;
+            }
+        };
+
+        static_assert(std::is_trivially_copyable_v<octonode_t> && std::is_trivially_copyable_v<triangle_t> &&
+                      std::is_trivially_copyable_v<segment_t>,
+                      "nodes and figures are written to index files as they are");
+
+        // Slot of a triangle during the split: CHILD_NUM means it stays in the parent.
+        struct bucketed_id_t {
+            int id;
+            int bucket;
+        };
+
+        // Storage of a tree built in this run, left empty by a tree taken from an
+        // index file. The rest of the code reads the views, which refer to either.
+        std::vector<octonode_t> node_store_;
+        std::vector<int>        id_store_;
+        std::vector<uint32_t>   fig_store_;
+        std::vector<segment_t>  seg_store_;
+        std::vector<point_t>    pnt_store_;
+        boxes_soa_t<scalar_t>   box_store_;
+
+        array_view_t<triangle_t> trs_;
+        array_view_t<octonode_t> nodes_;
+        array_view_t<int>        tr_ids_;
+
+        // Figure tags in tr_ids_ order and the records of the LINE and POINT
+        // figures in that order, so the narrow phase reads them from small arrays
+        // next to each other instead of from the triangles.
+        array_view_t<uint32_t>  figs_;
+        array_view_t<segment_t> segs_;
+        array_view_t<point_t>   pnts_;
+
+        // Plane families in tr_ids_ order, empty unless set_families was called.
+        std::vector<uint32_t> families_;
+
+        // Boxes in tr_ids_ order, so every node slice is a slice of the arrays too.
+        boxes_view_t<scalar_t> boxes_;
+        box_filter::filter_func_t<scalar_t> filter_ = box_filter::get_filter<scalar_t>();
+
+        static constexpr bool IS_DOUBLE = std::is_same_v<scalar_t, double>;
+
+        narrow_engine_t narrow_;
+        octree_params_t params_;
+
+        bool is_loose() const { return params_.looseness > 1; }
+
+        static point_t get_child_center(const point_t &center, double next_rad, int i) {
+            return {center.x_ + ((i & 1) ? next_rad : -next_rad),
+                    center.y_ + ((i & 2) ? next_rad : -next_rad),
+                    center.z_ + ((i & 4) ? next_rad : -next_rad)};
+        }
+
+        // Child of the cell that takes the triangle, CHILD_NUM if it stays in the cell.
+        int get_bucket(const point_t &center, double radius, const triangle_t &tr) const {
+            double next_rad = radius / 2;
 
-            public:
-                octonode_t(const point_t &center, double radius = NAN) :
-                center_(center), radius_(radius) {}
+            if (is_loose()) {
+                aabb_t box = tr.get_aabb();
+                int i = ((box.x_min + box.x_max) / 2 >= center.x_ ? 1 : 0) |
+                        ((box.y_min + box.y_max) / 2 >= center.y_ ? 2 : 0) |
+                        ((box.z_min + box.z_max) / 2 >= center.z_ ? 4 : 0);
 
-                void update_trs(std::list<octonode_t> &nodes) {
-                    if (triangles_.size() < MAX_TRS_NODE) return;
+                point_t child_cntr = get_child_center(center, next_rad, i);
+                return tr.is_in_cube(child_cntr, params_.looseness * next_rad) ? i : CHILD_NUM;
+            }
+
+            for (int i = 0; i < CHILD_NUM; ++i)
+                if (tr.is_in_cube(get_child_center(center, next_rad, i), next_rad)) return i;
+            return CHILD_NUM;
+        }
+
+        // Stable counting sort of the node slice into [own | child 0 | ... | child 7].
+        // Returns the first index of each bucket, the last entry is the slice end.
+        std::array<uint32_t, CHILD_NUM + 2> split_slice(const octonode_t &node,
+                                                        bucketed_id_t *scratch) {
+            std::array<uint32_t, CHILD_NUM + 2> starts = {0};
+            std::array<uint32_t, CHILD_NUM + 1> counts = {0};
+
+            uint32_t sz = node.size();
+
+            for (uint32_t i = 0; i < sz; ++i) {
+                int id = id_store_[node.trs_begin_ + i];
+                int bucket = get_bucket(node.center_, node.radius_, trs_[id]);
+
+                scratch[i] = {id, bucket};
+                counts[bucket]++;
+            }
+
+            starts[0] = node.trs_begin_;
+            starts[1] = starts[0] + counts[CHILD_NUM];
+            for (int i = 0; i < CHILD_NUM; ++i)
+                starts[i + 2] = starts[i + 1] + counts[i];
+
+            std::array<uint32_t, CHILD_NUM + 1> pos = {0};
+            pos[CHILD_NUM] = starts[0];
+            for (int i = 0; i < CHILD_NUM; ++i) pos[i] = starts[i + 1];
+
+            for (uint32_t i = 0; i < sz; ++i)
+                id_store_[pos[scratch[i].bucket]++] = scratch[i].id;
+
+            return starts;
+        }
+
+        // Splits the nodes of the level and their descendants level by level, with
+        // one scratch buffer per level.
+        void split_levels(std::vector<node_id_t> level, int depth) {
+            std::vector<node_id_t> next_level;
+
+            for (; depth < MAX_DEPTH && !level.empty(); ++depth) {
+                size_t level_sz = 0;
+                for (node_id_t node_id : level) level_sz += node_store_[node_id].size();
+
+                std::vector<bucketed_id_t> scratch(level_sz);
+                size_t offset = 0;
+
+                next_level.clear();
 
-                    double next_rad = radius_ / 2;
+                for (node_id_t node_id : level) {
+                    uint32_t sz = node_store_[node_id].size();
+                    auto starts = split_slice(node_store_[node_id], scratch.data() + offset);
+                    offset += sz;
+
+                    octonode_t &node = node_store_[node_id];
+                    node.trs_end_ = starts[1];
+                    if (node.size() != sz) node.is_leaf_ = false;
+
+                    double next_rad = node.radius_ / 2;
+                    point_t center  = node.center_;
 
                     for (int i = 0; i < CHILD_NUM; ++i) {
-                        double pnt_x = center_.x_ + ((i & 1) ? next_rad : -next_rad),
-                               pnt_y = center_.y_ + ((i & 2) ? next_rad : -next_rad),
-                               pnt_z = center_.z_ + ((i & 4) ? next_rad : -next_rad);
+                        if (starts[i + 1] == starts[i + 2]) continue;
+
+                        node_id_t child_id = node_store_.size();
+                        node_store_.emplace_back(get_child_center(center, next_rad, i), next_rad,
+                                                 starts[i + 1], starts[i + 2]);
 
-                        nodes.emplace_back(point_t{pnt_x, pnt_y, pnt_z}, next_rad);
-                        children_[i] = &nodes.back();
+                        node_store_[node_id].children_[i] = child_id;
+                        node_store_[node_id].active_nodes_ |= (1 << i);
+
+                        if (starts[i + 2] - starts[i + 1] >= params_.leaf_size)
+                            next_level.push_back(child_id);
                     }
+                }
+                level.swap(next_level);
+            }
+        }
+
+        static int get_digit_shift(int depth) { return KEY_DEPTH_BITS + 3 * (KEY_LEVELS - 1 - depth); }
+
+        // Build key of the triangle: the child indices down to the deepest cell that
+        // takes it, as get_bucket decides them level by level, and that depth. Sorted
+        // keys put the triangles in the order of the tree's slices: the own triangles
+        // of a cell first, then the subtrees of its children in child order.
+        uint64_t get_build_key(const triangle_t &tr, point_t center, double radius) const {
+            uint64_t key = 0;
+            int depth = 0;
+
+            for (; depth < KEY_LEVELS; ++depth) {
+                int i = get_bucket(center, radius, tr);
+                if (i == CHILD_NUM) break;
+
+                radius /= 2;
+                center = get_child_center(center, radius, i);
+                key |= uint64_t(i) << get_digit_shift(depth);
+            }
+            return key | depth;
+        }
+
+        // The tree split_levels builds from the root, taken from the triangles sorted
+        // by build key: keys are computed and radix sorted on the given threads, and
+        // the slices of a node's children are found by binary search on its run of
+        // keys. Nodes still over the leaf size at depth KEY_LEVELS are split further
+        // by split_levels.
+        void build_sorted(int threads) {
+            using radix_sorts::keyed_id_t;
+
+            size_t n = id_store_.size();
+            point_t root_center = node_store_[0].center_;
+            double root_radius  = node_store_[0].radius_;
+
+            std::vector<keyed_id_t> items(n);
+            int blocks_num = std::clamp<size_t>(n / radix_sorts::MIN_BLOCK, 1, std::max(threads, 1));
+
+            radix_sorts::for_each_block(n, blocks_num, [&](int, size_t first, size_t last) {
+                for (size_t i = first; i < last; ++i)
+                    items[i] = {get_build_key(trs_[i], root_center, root_radius), static_cast<uint32_t>(i)};
+            });
+            radix_sorts::radix_sort(items, KEY_DEPTH_BITS + 3 * KEY_LEVELS, threads);
 
-                    int sz_before = triangles_.size();
-                    auto it = triangles_.begin();
-
-                    while (it != triangles_.end()) {
-                        bool tr_remind = true;
-                        for (int i = 0; i < CHILD_NUM; i++)
-                            if (it->tr.is_in_cube(children_[i]->center_, children_[i]->radius_)) {
-                                children_[i]->triangles_.emplace_back(*it);
-                                triangles_.erase(it++);
-                                tr_remind = false;
-                                break;
-                            }
-                        if (tr_remind) it++;
+            // First position of the group each triangle ends up in: the own triangles
+            // of a split node or the whole slice of a node left as it is. Within a group
+            // the triangles go in id order, as the stable splits leave them.
+            std::vector<uint32_t> groups(n);
+            auto set_group = [&](uint32_t begin, uint32_t end) {
+                for (uint32_t pos = begin; pos < end; ++pos) groups[items[pos].id] = begin;
+            };
+            auto key_less = [](const keyed_id_t &item, uint64_t key) { return item.key < key; };
+
+            std::vector<node_id_t> level = {0}, next_level, deep_level;
+            std::vector<uint64_t>  paths = {0}, next_paths;
+
+            for (int depth = 0; !level.empty(); ++depth) {
+                next_level.clear();
+                next_paths.clear();
+
+                for (size_t k = 0; k < level.size(); ++k) {
+                    node_id_t node_id = level[k];
+                    uint32_t begin = node_store_[node_id].trs_begin_, end = node_store_[node_id].trs_end_;
+
+                    if (depth == KEY_LEVELS) {
+                        set_group(begin, end);
+                        deep_level.push_back(node_id);
+                        continue;
                     }
-                    if (sz_before - triangles_.size()) is_leaf_ = false;
 
-                    for (int i = 0; i < CHILD_NUM; i++) {
-                        if (!children_[i]->triangles_.empty()) {
-                            active_nodes_ |= (1 << i);
-                            children_[i]->update_trs(nodes);
+                    uint64_t path = paths[k];
+                    int shift = get_digit_shift(depth);
+
+                    std::array<uint32_t, CHILD_NUM + 2> starts;
+                    starts[0] = begin;
+                    starts[1] = std::lower_bound(items.begin() + begin, items.begin() + end, (path | depth) + 1,
+                                                 key_less) - items.begin();
+                    for (int i = 1; i < CHILD_NUM; ++i)
+                        starts[i + 1] = std::lower_bound(items.begin() + starts[i], items.begin() + end,
+                                                         path | (uint64_t(i) << shift), key_less) - items.begin();
+                    starts[CHILD_NUM + 1] = end;
+
+                    set_group(starts[0], starts[1]);
+
+                    octonode_t &node = node_store_[node_id];
+                    node.trs_end_ = starts[1];
+                    if (starts[1] != end) node.is_leaf_ = false;
+
+                    double next_rad = node.radius_ / 2;
+                    point_t center  = node.center_;
+
+                    for (int i = 0; i < CHILD_NUM; ++i) {
+                        if (starts[i + 1] == starts[i + 2]) continue;
+
+                        node_id_t child_id = node_store_.size();
+                        node_store_.emplace_back(get_child_center(center, next_rad, i), next_rad,
+                                                 starts[i + 1], starts[i + 2]);
+
+                        node_store_[node_id].children_[i] = child_id;
+                        node_store_[node_id].active_nodes_ |= (1 << i);
+
+                        if (starts[i + 2] - starts[i + 1] >= params_.leaf_size) {
+                            next_level.push_back(child_id);
+                            next_paths.push_back(path | (uint64_t(i) << shift));
                         }
+                        else set_group(starts[i + 1], starts[i + 2]);
                     }
                 }
+                level.swap(next_level);
+                paths.swap(next_paths);
+            }
+
+            std::vector<uint32_t> next_pos(n);
+            for (uint32_t pos = 0; pos < n; ++pos) next_pos[pos] = pos;
+            for (uint32_t id = 0; id < n; ++id) id_store_[next_pos[groups[id]]++] = id;
+
+            if (!deep_level.empty()) split_levels(std::move(deep_level), KEY_LEVELS);
+        }
 
-                void add_tr(int id, const triangle_t &tr) {
-                    triangles_.emplace_back(id, tr);
+        // Orders the own triangles of every node by type, keeping where the types
+        // start and which types every subtree holds, and makes the figure tags and
+        // records of the LINE and POINT figures.
+        void fill_figures() {
+            auto get_type = [this](int id) { return narrow_phase::get_type(trs_[id], narrow_); };
+
+            for (octonode_t &node : node_store_) {
+                auto begin = id_store_.begin() + node.trs_begin_, end = id_store_.begin() + node.trs_end_;
+
+                auto lines = std::stable_partition(begin, end, [&](int id) { return get_type(id) == TRIAN; });
+                auto pnts  = std::stable_partition(lines, end, [&](int id) { return get_type(id) == LINE; });
+
+                node.lines_begin_ = lines - id_store_.begin();
+                node.pnts_begin_  = pnts - id_store_.begin();
+            }
+
+            for (size_t node_id = node_store_.size(); node_id-- > 0;) {
+                octonode_t &node = node_store_[node_id];
+                node.subtree_types_ = node.get_own_types();
+
+                for (node_id_t child_id : node.children_)
+                    if (child_id != NO_NODE) node.subtree_types_ |= node_store_[child_id].subtree_types_;
+            }
+
+            fig_store_.resize(id_store_.size());
+
+            for (size_t pos = 0; pos < id_store_.size(); ++pos) {
+                const triangle_t &tr = trs_[id_store_[pos]];
+                tr_types_t type = narrow_phase::get_type(tr, narrow_);
+                uint32_t index = 0;
+
+                if (type == LINE) {
+                    index = seg_store_.size();
+                    seg_store_.push_back(narrow_phase::get_figure<LINE>(tr, narrow_));
+                }
+                else if (type == POINT) {
+                    index = pnt_store_.size();
+                    pnt_store_.push_back(tr.get_pnt(0));
                 }
+                fig_store_[pos] = uint32_t{type} << FIG_TYPE_SHIFT | index;
+            }
+        }
 
-                void get_intersections(ans_set_t &ans) {
-                    for (auto it = triangles_.begin(); it != triangles_.end(); it++) {
-                        for (auto jt = std::next(it); jt != triangles_.end(); jt++) {
-                            if (it->tr.is_intersected(jt->tr)) {
-                                ans.insert({it->id, jt->id});
-                            }
-                        }
+        // Candidates of the narrow phase at their positions, read from the records
+        // of the tree.
+        struct fig_cands_t {
+            const basic_octotree_t &tree;
+
+            template <tr_types_t type>
+            const narrow_phase::figure_t<type> &get(uint32_t pos) const {
+                if constexpr (type == TRIAN) return tree.trs_[tree.tr_ids_[pos]];
+                else if constexpr (type == LINE) return tree.segs_[tree.figs_[pos] & FIG_INDEX_MASK];
+                else return tree.pnts_[tree.figs_[pos] & FIG_INDEX_MASK];
+            }
+        };
+
+        // Hash of the arrays an index file holds, in file order.
+        uint64_t hash_body() const {
+            size_t box_len = (trs_.size() + box_filter::SOA_PADDING) * sizeof(scalar_t);
+
+            return octree_index::hash_arrays({{trs_.data(), trs_.size() * sizeof(triangle_t)},
+                                              {nodes_.data(), nodes_.size() * sizeof(octonode_t)},
+                                              {tr_ids_.data(), tr_ids_.size() * sizeof(int)},
+                                              {figs_.data(), figs_.size() * sizeof(uint32_t)},
+                                              {segs_.data(), segs_.size() * sizeof(segment_t)},
+                                              {pnts_.data(), pnts_.size() * sizeof(point_t)},
+                                              {boxes_.x_min, box_len}, {boxes_.y_min, box_len},
+                                              {boxes_.z_min, box_len}, {boxes_.x_max, box_len},
+                                              {boxes_.y_max, box_len}, {boxes_.z_max, box_len}});
+        }
+
+        // True if every index the query follows stays inside the arrays. Children
+        // come after their parent, as the build makes them, so the tree has no
+        // cycles, and are at most MAX_DEPTH levels deep; the slice of a child lies
+        // within the descendant slice of its parent, the own triangles are of the
+        // types their bounds say and the subtrees hold the types they say; ids
+        // refer to triangles and the figure tags to records.
+        bool has_valid_arrays() const {
+            std::vector<unsigned char> depths(nodes_.size(), 0);
+
+            for (node_id_t node_id = 0; node_id < nodes_.size(); ++node_id) {
+                const octonode_t &node = nodes_[node_id];
+
+                if (!(node.trs_begin_ <= node.lines_begin_ && node.lines_begin_ <= node.pnts_begin_ &&
+                      node.pnts_begin_ <= node.trs_end_ && node.trs_end_ <= node.subtree_end_ &&
+                      node.subtree_end_ <= trs_.size()) || node.active_nodes_ >> CHILD_NUM) return false;
+
+                for (uint32_t pos = node.trs_begin_; pos < node.trs_end_; ++pos) {
+                    uint32_t type = pos < node.lines_begin_ ? TRIAN : pos < node.pnts_begin_ ? LINE : POINT;
+                    if (figs_[pos] >> FIG_TYPE_SHIFT != type) return false;
+                }
+
+                for (int i = 0; i < CHILD_NUM; ++i) {
+                    node_id_t child_id = node.children_[i];
+
+                    if (child_id == NO_NODE) {
+                        if (node.active_nodes_ & (1 << i)) return false;
+                        continue;
                     }
-                    if (is_leaf_ || !active_nodes_) return;
+                    if (child_id <= node_id || child_id >= nodes_.size() || depths[node_id] >= MAX_DEPTH)
+                        return false;
+
+                    const octonode_t &child = nodes_[child_id];
+                    if (child.trs_begin_ < node.trs_end_ || child.subtree_end_ > node.subtree_end_) return false;
+
+                    depths[child_id] = std::max<unsigned char>(depths[child_id], depths[node_id] + 1);
+                }
+            }
+
+            for (node_id_t node_id = 0; node_id < nodes_.size(); ++node_id) {
+                const octonode_t &node = nodes_[node_id];
+                unsigned char types = node.get_own_types();
+
+                for (node_id_t child_id : node.children_)
+                    if (child_id != NO_NODE) types |= nodes_[child_id].subtree_types_;
+                if (types != node.subtree_types_) return false;
+            }
+
+            for (size_t pos = 0; pos < trs_.size(); ++pos) {
+                if (!trs_[pos].has_valid_fields()) return false;
+                if (tr_ids_[pos] < 0 || static_cast<size_t>(tr_ids_[pos]) >= trs_.size()) return false;
+
+                uint32_t type = figs_[pos] >> FIG_TYPE_SHIFT, index = figs_[pos] & FIG_INDEX_MASK;
+
+                if (type > POINT || (type == LINE && index >= segs_.size()) ||
+                    (type == POINT && index >= pnts_.size())) return false;
+            }
+            return true;
+        }
+
+        void get_intersections(const octonode_t &node, std::vector<std::vector<range_t>> &ranges,
+                               hits_t &ans) const {
+            get_intersections(node, node.trs_begin_, node.trs_end_, ranges[0], ans);
+
+            if (node.is_leaf_ || !node.active_nodes_) return;
+
+            for (uint32_t i = node.trs_begin_; i < node.trs_end_; ++i)
+                get_children_intersections(node, i, ranges[0], ans);
+
+            if (is_loose()) get_siblings_intersections(node, ranges, ans);
+        }
+
+        // Double box of the triangle at position pos.
+        aabb_t get_box(uint32_t pos) const {
+            if constexpr (IS_DOUBLE)
+                return {boxes_.x_min[pos], boxes_.y_min[pos], boxes_.z_min[pos],
+                        boxes_.x_max[pos], boxes_.y_max[pos], boxes_.z_max[pos]};
+            else
+                return trs_[tr_ids_[pos]].get_aabb();
+        }
+
+        // Box of the triangle at position pos grown by EPS, so the reject never
+        // drops a pair the exact test would count as touching.
+        aabb_t get_query_box(uint32_t pos) const {
+            aabb_t box = get_box(pos);
+
+            return {box.x_min - EPS, box.y_min - EPS, box.z_min - EPS,
+                    box.x_max + EPS, box.y_max + EPS, box.z_max + EPS};
+        }
+
+        // The same box for the reject, grown from the stored box: a float box
+        // already holds the triangle, and the triangle itself stays untouched
+        // until some candidate survives.
+        basic_aabb_t<scalar_t> get_filter_box(uint32_t pos) const {
+            return round_out<scalar_t>({boxes_.x_min[pos] - EPS, boxes_.y_min[pos] - EPS, boxes_.z_min[pos] - EPS,
+                                        boxes_.x_max[pos] + EPS, boxes_.y_max[pos] + EPS, boxes_.z_max[pos] + EPS});
+        }
 
-                    for (auto it = triangles_.begin(); it != triangles_.end(); it++) {
-                        get_children_intersections(*it, ans);
+        // Triangle scanned against slices of the tree: a stored one at position
+        // pos, or an external query with no id whose double box grown by EPS is
+        // given in query_box. filter_box is that box for the reject.
+        struct probe_t {
+            const triangle_t &tr;
+            basic_aabb_t<scalar_t> filter_box;
+            uint32_t id;
+            uint32_t pos;
+            aabb_t query_box;
+        };
+
+        static constexpr uint32_t NO_ID = std::numeric_limits<uint32_t>::max();
+        static constexpr uint32_t NO_FAMILY = plane_groups::NO_FAMILY;
+
+        probe_t get_probe(uint32_t pos) const {
+            return {trs_[tr_ids_[pos]], get_filter_box(pos), static_cast<uint32_t>(tr_ids_[pos]), pos, {}};
+        }
+
+        // Calls func for every position in the ranges whose triangle intersects
+        // the probe. Survivors of the box reject are gathered across ranges, one
+        // block per type, and every block is decided by the kernel of its type,
+        // so many short ranges cost no more than a long one. Pairs with
+        // both ids already marked in ans are skipped: they can't change it, and
+        // so are pairs of one plane family.
+        template <typename func_t>
+        void for_each_intersected(const probe_t &probe, const range_t *ranges, size_t ranges_num, const hits_t &ans,
+                                  func_t func) const {
+            basic_aabb_t<scalar_t> box = probe.filter_box;
+
+            uint32_t survivors[3][2 * FILTER_CHUNK];
+            uint32_t cnts[3] = {0, 0, 0};
+
+            auto flush = [&](tr_types_t type, uint32_t cnt) {
+                uint32_t *ks = survivors[type];
+
+                if constexpr (!IS_DOUBLE) {
+                    aabb_t query_box = probe.pos != NO_ID ? get_query_box(probe.pos) : probe.query_box;
+                    uint32_t confirmed = 0;
+
+                    for (uint32_t k = 0; k < cnt; ++k)
+                        if (query_box.is_overlapped(get_box(ks[k]))) ks[confirmed++] = ks[k];
+                    cnt = confirmed;
+                }
+
+                if (probe.id != NO_ID && ans.is_marked(probe.id)) {
+                    uint32_t unmarked = 0;
+                    for (uint32_t k = 0; k < cnt; ++k)
+                        if (!ans.is_marked(tr_ids_[ks[k]])) ks[unmarked++] = ks[k];
+                    cnt = unmarked;
+                }
+
+                uint32_t family = !families_.empty() && probe.pos != NO_ID ? families_[probe.pos] : NO_FAMILY;
+                if (family != NO_FAMILY) {
+                    uint32_t other = 0;
+                    for (uint32_t k = 0; k < cnt; ++k)
+                        if (families_[ks[k]] != family) ks[other++] = ks[k];
+                    cnt = other;
+                }
+
+                narrow_phase::for_each_typed_hit(narrow_, probe.tr, type, ks, cnt, fig_cands_t{*this}, func);
+            };
+
+            uint32_t found[FILTER_CHUNK];
+
+            for (size_t r = 0; r < ranges_num && !ans.is_stopped();) {
+                size_t last_r = r;
+                while (last_r + 1 < ranges_num && ranges[last_r + 1].first == ranges[last_r].last) ++last_r;
+
+                if (r == last_r) {
+                    tr_types_t type = ranges[r].type;
+                    uint32_t cnt = cnts[type], end = ranges[r].last;
+
+                    for (uint32_t chunk = ranges[r].first; chunk < end && !ans.is_stopped(); chunk += FILTER_CHUNK) {
+                        cnt += filter_(box, boxes_, chunk, std::min(chunk + FILTER_CHUNK, end), survivors[type] + cnt);
+                        if (cnt >= FILTER_CHUNK) {
+                            flush(type, cnt);
+                            cnt = 0;
+                        }
                     }
+                    cnts[type] = cnt;
+                    ++r;
+                    continue;
+                }
+
+                // Ranges that follow each other are filtered as one slice, their
+                // survivors go to the blocks of their types by the range ends.
+                uint32_t end = ranges[last_r].last;
 
-                    for (int i = 0; i < CHILD_NUM; i++) {
-                        if (!(active_nodes_ & (1 << i))) continue;
+                for (uint32_t chunk = ranges[r].first; chunk < end && !ans.is_stopped(); chunk += FILTER_CHUNK) {
+                    uint32_t found_num = filter_(box, boxes_, chunk, std::min(chunk + FILTER_CHUNK, end), found);
 
-                        children_[i]->get_intersections(ans);
+                    for (uint32_t k = 0; k < found_num; ++k) {
+                        while (found[k] >= ranges[r].last) ++r;
+                        survivors[ranges[r].type][cnts[ranges[r].type]++] = found[k];
                     }
+
+                    for (tr_types_t type : {TRIAN, LINE, POINT})
+                        if (cnts[type] >= FILTER_CHUNK) {
+                            flush(type, cnts[type]);
+                            cnts[type] = 0;
+                        }
                 }
+                r = last_r + 1;
+            }
 
-                void get_children_intersections(const id_trian_t& par_tr, ans_set_t &ans) {
-                    if (is_leaf_ || !active_nodes_) return;
+            for (tr_types_t type : {TRIAN, LINE, POINT})
+                if (cnts[type] && !ans.is_stopped()) flush(type, cnts[type]);
+        }
 
-                    bool par_tr_int = false;
+        template <typename func_t>
+        void for_each_intersected(uint32_t pos, const range_t *ranges, size_t ranges_num, const hits_t &ans,
+                                  func_t func) const {
+            for_each_intersected(get_probe(pos), ranges, ranges_num, ans, func);
+        }
 
-                    for (int i = 0; i < CHILD_NUM; i++) {
-                        if (!(active_nodes_ & (1 << i))) continue;
+        // Appends [first, last) of the given type, joined to the last range if it
+        // goes on from there with the same type.
+        static void add_range(uint32_t first, uint32_t last, tr_types_t type, std::vector<range_t> &ranges) {
+            if (first >= last) return;
 
-                        //if (!par_tr.tr.is_part_in_cube(children_[i]->center_, children_[i]->radius_)) continue;
+            if (!ranges.empty() && ranges.back().last == first && ranges.back().type == type) ranges.back().last = last;
+            else ranges.push_back({first, last, type});
+        }
 
-                        for (auto it = children_[i]->triangles_.begin(); it != children_[i]->triangles_.end(); it++) {
-                            if (par_tr.tr.is_intersected(it->tr)) {
-                                ans.emplace(it->id);
-                                par_tr_int = true;
-                            }
-                        }
-                        children_[i]->get_children_intersections(par_tr, ans);
+        // Appends the own triangles of the node from position from on, one range per type.
+        static void add_own_ranges(const octonode_t &node, uint32_t from, std::vector<range_t> &ranges) {
+            add_range(std::max(from, node.trs_begin_), node.lines_begin_, TRIAN, ranges);
+            add_range(std::max(from, node.lines_begin_), node.pnts_begin_, LINE, ranges);
+            add_range(std::max(from, node.pnts_begin_), node.trs_end_, POINT, ranges);
+        }
+
+        // Appends the own triangles of every node of the subtree of node_id, in
+        // slice order, but for subtrees whose bounds are farther than EPS from box.
+        // A subtree of one type is taken whole.
+        void add_subtree_ranges(node_id_t node_id, const aabb_t &box, std::vector<range_t> &ranges) const {
+            const octonode_t &node = nodes_[node_id];
+            if (!node.bounds_.is_overlapped(box, EPS)) return;
+
+            unsigned char types = node.subtree_types_;
+            if (types && !(types & (types - 1))) {
+                add_range(node.trs_begin_, node.subtree_end_, static_cast<tr_types_t>(__builtin_ctz(types)), ranges);
+                return;
+            }
+
+            add_own_ranges(node, node.trs_begin_, ranges);
+
+            for (node_id_t child_id : node.children_)
+                if (child_id != NO_NODE) add_subtree_ranges(child_id, box, ranges);
+        }
+
+        // Pairs inside the node's own slice whose first triangle is in [row_begin, row_end).
+        // The ranges of the slice are made once, every row cuts off their front.
+        void get_intersections(const octonode_t &node, uint32_t row_begin, uint32_t row_end,
+                               std::vector<range_t> &ranges, hits_t &ans) const {
+            ranges.clear();
+            add_own_ranges(node, row_begin + 1, ranges);
+
+            size_t r = 0;
+            for (uint32_t i = row_begin; i < row_end; ++i) {
+                while (r < ranges.size() && ranges[r].last <= i + 1) ++r;
+                if (r == ranges.size()) return;
+
+                ranges[r].first = std::max(ranges[r].first, i + 1);
+                for_each_intersected(i, ranges.data() + r, ranges.size() - r, ans, [&](uint32_t j) {
+                    ans.add(tr_ids_[i], tr_ids_[j]);
+                });
+            }
+        }
+
+        // Appends the slices of the subtree of node_id the triangle may reach.
+        // Subtrees whose bounds the triangle misses are skipped whole, subtrees
+        // of at most SUBTREE_SCAN triangles are scanned whole.
+        void get_subtree_ranges(node_id_t node_id, const triangle_t &tr, std::vector<range_t> &ranges) const {
+            const octonode_t &node = nodes_[node_id];
+
+            aabb_t bounds{node.bounds_.x_min - EPS, node.bounds_.y_min - EPS, node.bounds_.z_min - EPS,
+                          node.bounds_.x_max + EPS, node.bounds_.y_max + EPS, node.bounds_.z_max + EPS};
+            if (!tr.is_box_overlapped(bounds)) return;
+
+            if (node.subtree_end_ - node.trs_begin_ <= SUBTREE_SCAN || !node.active_nodes_) {
+                add_subtree_ranges(node_id, tr.get_aabb(), ranges);
+                return;
+            }
+
+            add_own_ranges(node, node.trs_begin_, ranges);
+
+            for (node_id_t child_id : node.children_)
+                if (child_id != NO_NODE) get_subtree_ranges(child_id, tr, ranges);
+        }
+
+        // Parent triangle at par_pos against all descendants of the node. ranges
+        // is scratch space of the calling thread, kept between parents.
+        void get_children_intersections(const octonode_t &node, uint32_t par_pos, std::vector<range_t> &ranges,
+                                        hits_t &ans) const {
+            ranges.clear();
+            for (node_id_t child_id : node.children_)
+                if (child_id != NO_NODE) get_subtree_ranges(child_id, trs_[tr_ids_[par_pos]], ranges);
+
+            for_each_intersected(par_pos, ranges.data(), ranges.size(), ans, [&](uint32_t i) {
+                ans.add(tr_ids_[i], tr_ids_[par_pos]);
+            });
+        }
+
+        // Pairs between the disjoint subtrees of id1 and id2. A loose tree needs them
+        // since sibling cubes overlap: own triangles of each node go against the
+        // other whole subtree, the rest is split between pairs of children.
+        // With a pool, pairs of large subtrees are passed on as separate tasks.
+        // Every worker has its scratch ranges in ranges[worker].
+        void get_cross_intersections(node_id_t id1, node_id_t id2, std::vector<std::vector<range_t>> &ranges,
+                                     hits_t &ans, work_stealing_pool_t *pool = nullptr, int worker = 0) const {
+            const octonode_t &node1 = nodes_[id1], &node2 = nodes_[id2];
+            std::vector<range_t> &cross = ranges[worker];
+
+            if (ans.is_stopped() || !node1.bounds_.is_overlapped(node2.bounds_, EPS)) return;
+
+            cross.clear();
+            if (node1.size()) add_subtree_ranges(id2, node1.bounds_, cross);
+
+            for (uint32_t i = node1.trs_begin_; i < node1.trs_end_; ++i)
+                for_each_intersected(i, cross.data(), cross.size(), ans, [&](uint32_t j) {
+                    ans.add(tr_ids_[i], tr_ids_[j]);
+                });
+
+            cross.clear();
+            if (node2.size())
+                for (node_id_t child_id : node1.children_)
+                    if (child_id != NO_NODE) add_subtree_ranges(child_id, node2.bounds_, cross);
+
+            for (uint32_t i = node2.trs_begin_; i < node2.trs_end_; ++i)
+                for_each_intersected(i, cross.data(), cross.size(), ans, [&](uint32_t j) {
+                    ans.add(tr_ids_[i], tr_ids_[j]);
+                });
+
+            uint64_t pairs = uint64_t{node1.subtree_end_ - node1.trs_begin_} * (node2.subtree_end_ - node2.trs_begin_);
+
+            for (node_id_t child1 : node1.children_) {
+                if (child1 == NO_NODE) continue;
+
+                for (node_id_t child2 : node2.children_) {
+                    if (child2 == NO_NODE) continue;
+
+                    if (!pool || pairs < PAIRS_PER_TASK) {
+                        get_cross_intersections(child1, child2, ranges, ans, pool, worker);
+                        continue;
                     }
 
-                    if (par_tr_int) ans.emplace(par_tr.id);
+                    pool->submit(worker, [this, child1, child2, &ranges, &ans](work_stealing_pool_t &pool,
+                                                                               int worker) {
+                        get_cross_intersections(child1, child2, ranges, ans, &pool, worker);
+                    });
                 }
-        };
+            }
+        }
+
+        void get_siblings_intersections(const octonode_t &node, std::vector<std::vector<range_t>> &ranges,
+                                        hits_t &ans) const {
+            for (int i = 0; i < CHILD_NUM; ++i)
+                for (int j = i + 1; j < CHILD_NUM; ++j)
+                    if (node.children_[i] != NO_NODE && node.children_[j] != NO_NODE)
+                        get_cross_intersections(node.children_[i], node.children_[j], ranges, ans);
+        }
+
+        // Subtree bounds bottom-up: children are always created after their parent.
+        void fill_bounds() {
+            for (size_t node_id = node_store_.size(); node_id-- > 0;) {
+                octonode_t &node = node_store_[node_id];
+                double inf = std::numeric_limits<double>::infinity();
+
+                node.bounds_ = {inf, inf, inf, -inf, -inf, -inf};
 
-        std::list<octonode_t>::pointer root_ = nullptr;
+                for (uint32_t i = node.trs_begin_; i < node.trs_end_; ++i) {
+                    aabb_t box = get_box(i);
+                    node.bounds_.extend(point_t{box.x_min, box.y_min, box.z_min});
+                    node.bounds_.extend(point_t{box.x_max, box.y_max, box.z_max});
+                }
+
+                for (node_id_t child_id : node.children_) {
+                    if (child_id == NO_NODE) continue;
+
+                    const aabb_t &child = node_store_[child_id].bounds_;
+                    node.bounds_.extend(point_t{child.x_min, child.y_min, child.z_min});
+                    node.bounds_.extend(point_t{child.x_max, child.y_max, child.z_max});
+                }
+            }
+        }
+
+        // Schedules the node's own work in chunks of roughly PAIRS_PER_TASK pair tests
+        // and every active child as a separate task, so idle workers can steal subtrees
+        // as well as parts of one large scan. Workers share the bitmap of answers,
+        // and every worker has its scratch ranges in ranges[worker].
+        void submit_subtree(work_stealing_pool_t &pool, int worker, node_id_t node_id,
+                            std::vector<std::vector<range_t>> &ranges, hits_t &ans) const {
+            const octonode_t &node = nodes_[node_id];
+
+            if (ans.is_stopped()) return;
+
+            for (int i = 0; i < CHILD_NUM; ++i) {
+                if (!(node.active_nodes_ & (1 << i))) continue;
+
+                node_id_t child_id = node.children_[i];
+                pool.submit(worker, [this, child_id, &ranges, &ans](work_stealing_pool_t &pool, int worker) {
+                    submit_subtree(pool, worker, child_id, ranges, ans);
+                });
+            }
+
+            uint32_t own_rows = std::max<uint32_t>(1, PAIRS_PER_TASK / std::max<uint32_t>(1, node.size()));
+
+            for (uint32_t row = node.trs_begin_; row < node.trs_end_; row += own_rows) {
+                uint32_t row_end = std::min(row + own_rows, node.trs_end_);
+
+                pool.submit(worker, [this, node_id, row, row_end, &ranges, &ans](work_stealing_pool_t &, int worker) {
+                    get_intersections(nodes_[node_id], row, row_end, ranges[worker], ans);
+                });
+            }
+
+            if (node.is_leaf_ || !node.active_nodes_) return;
+
+            uint32_t desc_sz = node.subtree_end_ - node.trs_end_;
+            uint32_t par_rows = std::max<uint32_t>(1, PAIRS_PER_TASK / std::max<uint32_t>(1, desc_sz));
 
-        std::list<octonode_t> nodes_;
+            for (uint32_t row = node.trs_begin_; row < node.trs_end_; row += par_rows) {
+                uint32_t row_end = std::min(row + par_rows, node.trs_end_);
 
-        ans_set_t intersections_;
+                pool.submit(worker, [this, node_id, row, row_end, &ranges, &ans](work_stealing_pool_t &, int worker) {
+                    for (uint32_t i = row; i < row_end; ++i)
+                        get_children_intersections(nodes_[node_id], i, ranges[worker], ans);
+                });
+            }
+
+            if (!is_loose()) return;
+
+            for (int i = 0; i < CHILD_NUM; ++i)
+                for (int j = i + 1; j < CHILD_NUM; ++j) {
+                    node_id_t child1 = node.children_[i], child2 = node.children_[j];
+                    if (child1 == NO_NODE || child2 == NO_NODE) continue;
+
+                    pool.submit(worker, [this, child1, child2, &ranges, &ans](work_stealing_pool_t &pool, int worker) {
+                        get_cross_intersections(child1, child2, ranges, ans, &pool, worker);
+                    });
+                }
+        }
 
         public:
-            octotree_t(const std::vector<triangle_t> &trs, const max_min_crds_t &crds) {
+            basic_octotree_t(const std::vector<triangle_t> &trs, const max_min_crds_t &crds,
+                             narrow_engine_t narrow = narrow_phase::CLASSIC, const octree_params_t &params = {},
+                             int threads = 1) :
+                trs_(trs), narrow_(narrow), params_(params) {
                 double radius1 = std::abs((crds.x_max - crds.x_min) / 2),
                        radius2 = std::abs((crds.y_max - crds.y_min) / 2),
                        radius3 = std::abs((crds.z_max - crds.z_min) / 2);
@@ -159,26 +939,212 @@ namespace octotrees {
                 if (radius2 > radius1) radius1 = radius2;
                 if (radius3 > radius1) radius1 = radius3;
 
-                nodes_.emplace_back(point_t{(crds.x_max + crds.x_min) / 2,
-                                            (crds.y_max + crds.y_min) / 2,
-                                            (crds.z_max + crds.z_min) / 2}, radius1);
+                id_store_.resize(trs.size());
+                for (size_t i = 0; i < trs.size(); i++) id_store_[i] = i;
+
+                node_store_.emplace_back(point_t{(crds.x_max + crds.x_min) / 2,
+                                                 (crds.y_max + crds.y_min) / 2,
+                                                 (crds.z_max + crds.z_min) / 2},
+                                         radius1, 0, id_store_.size());
+
+                if (id_store_.size() >= params_.leaf_size) build_sorted(threads);
+                fill_figures();
+
+                box_store_.resize(id_store_.size());
+                for (size_t i = 0; i < id_store_.size(); i++)
+                    box_store_.set(i, round_out<scalar_t>(trs[id_store_[i]].get_aabb()));
+
+                tr_ids_ = id_store_;
+                figs_   = fig_store_;
+                segs_   = seg_store_;
+                pnts_   = pnt_store_;
+                boxes_  = box_store_.view();
+
+                fill_bounds();
+                nodes_ = node_store_;
+            }
+
+            // Tree of an index file that octree_index::check_index accepted, used
+            // in place: the mapping must outlive the tree. check_index makes one of
+            // a file whose arrays are not checked yet, to check them.
+            basic_octotree_t(const char *index, narrow_engine_t narrow = narrow_phase::CLASSIC) : narrow_(narrow) {
+                octree_index::index_header_t header;
+                std::memcpy(&header, index, sizeof(header));
+
+                params_ = {header.looseness, static_cast<uint32_t>(header.leaf_size)};
+
+                trs_    = {reinterpret_cast<const triangle_t *>(index + header.trs_offset), header.trs_num};
+                nodes_  = {reinterpret_cast<const octonode_t *>(index + header.nodes_offset), header.nodes_num};
+                tr_ids_ = {reinterpret_cast<const int *>(index + header.ids_offset), header.trs_num};
+                figs_   = {reinterpret_cast<const uint32_t *>(index + header.figs_offset), header.trs_num};
+                segs_   = {reinterpret_cast<const segment_t *>(index + header.segs_offset), header.segs_num};
+                pnts_   = {reinterpret_cast<const point_t *>(index + header.pnts_offset), header.pnts_num};
+
+                const scalar_t *boxes = reinterpret_cast<const scalar_t *>(index + header.boxes_offset);
+                size_t stride = header.trs_num + box_filter::SOA_PADDING;
+
+                boxes_ = {boxes, boxes + stride, boxes + 2 * stride,
+                          boxes + 3 * stride, boxes + 4 * stride, boxes + 5 * stride};
+            }
+
+            size_t size() const { return trs_.size(); }
+
+            // Peak bytes a tree built in this run takes per triangle, the triangle not
+            // counted: its id, the larger of the radix sort keys of the build and the
+            // figure tag, largest figure record and box made after it, and the nodes,
+            // about CHILD_NUM for every leaf_size triangles.
+            static constexpr size_t get_tr_bytes(uint32_t leaf_size) {
+                return sizeof(int) + std::max(2 * sizeof(radix_sorts::keyed_id_t),
+                                              sizeof(uint32_t) + sizeof(segment_t) + 6 * sizeof(scalar_t)) +
+                       (CHILD_NUM * sizeof(octonode_t) + leaf_size - 1) / leaf_size;
+            }
+
+            // Leaves out of the query the pairs of triangles of one plane family,
+            // which never need the 3D test; families gives the family of every id.
+            void set_families(const uint32_t *families) {
+                families_.resize(tr_ids_.size());
+                for (size_t i = 0; i < tr_ids_.size(); ++i) families_[i] = families[tr_ids_[i]];
+            }
+
+            static octree_index::index_key_t get_index_key(uint64_t input_hash, uint64_t input_size,
+                                                           narrow_engine_t narrow, bool is_loose) {
+                return {input_hash, input_size, sizeof(scalar_t), narrow, is_loose};
+            }
+
+            // True if the file holds an index for the key with the body it was written
+            // with, and every index the query follows stays inside the arrays, so a
+            // damaged file is rebuilt instead of read out of bounds.
+            static bool check_index(const char *begin, const char *end, const octree_index::index_key_t &key) {
+                if (!octree_index::check_index(begin, end, key, sizeof(triangle_t), sizeof(octonode_t),
+                                               sizeof(segment_t), sizeof(point_t), box_filter::SOA_PADDING))
+                    return false;
+
+                octree_index::index_header_t header;
+                std::memcpy(&header, begin, sizeof(header));
+
+                basic_octotree_t tree{begin};
+                return tree.hash_body() == header.body_hash && tree.has_valid_arrays();
+            }
+
+            // Writes the tree with its triangles as an index file for the input of
+            // the given hash and size.
+            bool save(FILE *out, uint64_t input_hash, uint64_t input_size) const {
+                octree_index::index_header_t header{};
+                size_t trs_len = trs_.size() * sizeof(triangle_t), nodes_len = nodes_.size() * sizeof(octonode_t);
+                size_t ids_len = tr_ids_.size() * sizeof(int), figs_len = figs_.size() * sizeof(uint32_t);
+                size_t segs_len = segs_.size() * sizeof(segment_t), pnts_len = pnts_.size() * sizeof(point_t);
+                size_t box_len = (trs_.size() + box_filter::SOA_PADDING) * sizeof(scalar_t);
+
+                std::memcpy(header.magic, octree_index::INDEX_MAGIC, sizeof(octree_index::INDEX_MAGIC));
+                header.version     = octree_index::INDEX_VERSION;
+                header.scalar_size = sizeof(scalar_t);
+                header.input_hash  = input_hash;
+                header.input_size  = input_size;
+                header.tr_size     = sizeof(triangle_t);
+                header.node_size   = sizeof(octonode_t);
+                header.narrow      = narrow_;
+                header.trs_num     = trs_.size();
+                header.nodes_num   = nodes_.size();
+                header.segs_num    = segs_.size();
+                header.pnts_num    = pnts_.size();
+                header.looseness   = params_.looseness;
+                header.leaf_size   = params_.leaf_size;
+                header.body_hash   = hash_body();
+
+                header.trs_offset   = octree_index::align_offset(sizeof(header));
+                header.nodes_offset = octree_index::align_offset(header.trs_offset + trs_len);
+                header.ids_offset   = octree_index::align_offset(header.nodes_offset + nodes_len);
+                header.figs_offset  = octree_index::align_offset(header.ids_offset + ids_len);
+                header.segs_offset  = octree_index::align_offset(header.figs_offset + figs_len);
+                header.pnts_offset  = octree_index::align_offset(header.segs_offset + segs_len);
+                header.boxes_offset = octree_index::align_offset(header.pnts_offset + pnts_len);
+                header.file_size    = header.boxes_offset + 6 * box_len;
+
+                const scalar_t *box_arrays[6] = {boxes_.x_min, boxes_.y_min, boxes_.z_min,
+                                                 boxes_.x_max, boxes_.y_max, boxes_.z_max};
+                uint64_t pos = 0;
+
+                using octree_index::write_at;
 
-                root_ = &nodes_.back();
+                bool is_ok = write_at(out, pos, 0, &header, sizeof(header)) &&
+                             write_at(out, pos, header.trs_offset, trs_.data(), trs_len) &&
+                             write_at(out, pos, header.nodes_offset, nodes_.data(), nodes_len) &&
+                             write_at(out, pos, header.ids_offset, tr_ids_.data(), ids_len) &&
+                             write_at(out, pos, header.figs_offset, figs_.data(), figs_len) &&
+                             write_at(out, pos, header.segs_offset, segs_.data(), segs_len) &&
+                             write_at(out, pos, header.pnts_offset, pnts_.data(), pnts_len);
 
-                for (int i = 0; i < trs.capacity(); i++)
-                    root_->add_tr(i, trs[i]);
-                root_->update_trs(nodes_);
+                for (int i = 0; i < 6 && is_ok; ++i)
+                    is_ok = write_at(out, pos, header.boxes_offset + i * box_len, box_arrays[i], box_len);
+                return is_ok;
             }
 
-            ~octotree_t()                               = default;
-            octotree_t(const octotree_t& tr)            = delete;
-            octotree_t(octotree_t&& tr)                 = delete;
-            octotree_t& operator=(const octotree_t& tr) = delete;
-            octotree_t& operator=(octotree_t&& tr)      = delete;
+            ~basic_octotree_t() override                            = default;
+            basic_octotree_t(const basic_octotree_t& tr)            = delete;
+            basic_octotree_t(basic_octotree_t&& tr)                 = delete;
+            basic_octotree_t& operator=(const basic_octotree_t& tr) = delete;
+            basic_octotree_t& operator=(basic_octotree_t&& tr)      = delete;
 
-            ans_set_t get_intersections() {
-                root_->get_intersections(intersections_);
-                return intersections_;
+            // Passes to ans every pair of intersecting triangles.
+            void get_intersections(hits_t &ans, int threads = 1) const override {
+                if (threads <= 1) {
+                    std::vector<std::vector<range_t>> ranges(1);
+
+                    for (size_t i = 0; i < nodes_.size() && !ans.is_stopped(); ++i)
+                        get_intersections(nodes_[i], ranges, ans);
+                    return;
+                }
+
+                work_stealing_pool_t pool{threads};
+                std::vector<std::vector<range_t>> ranges(pool.size());
+
+                pool.submit(0, [this, &ranges, &ans](work_stealing_pool_t &pool, int worker) {
+                    submit_subtree(pool, worker, 0, ranges, ans);
+                });
+                pool.run();
+            }
+
+            using ranges_t = std::vector<range_t>;
+
+            // Calls func with the id of every indexed triangle intersecting tr, which
+            // need not be one of them. ranges is scratch space the caller keeps
+            // between queries; distinct queries may run on distinct threads.
+            template <typename func_t>
+            void for_each_intersected(const triangle_t &tr, ranges_t &ranges, func_t func) const {
+                static const hits_t no_hits{answers::COUNT, 0};
+
+                aabb_t box = tr.get_aabb();
+                aabb_t query_box{box.x_min - EPS, box.y_min - EPS, box.z_min - EPS,
+                                 box.x_max + EPS, box.y_max + EPS, box.z_max + EPS};
+
+                ranges.clear();
+                get_subtree_ranges(0, tr, ranges);
+
+                for_each_intersected(probe_t{tr, round_out<scalar_t>(query_box), NO_ID, NO_ID, query_box},
+                                     ranges.data(), ranges.size(), no_hits,
+                                     [&](uint32_t pos) { func(static_cast<uint32_t>(tr_ids_[pos])); });
+            }
+
+            // Own triangles of every node; triangles of nodes with children are
+            // the ones tested against whole subtrees.
+            stats::shape_stats_t get_shape_stats() const override {
+                stats::shape_stats_t shape;
+                std::vector<std::pair<node_id_t, uint32_t>> stack = {{0, 0}};
+
+                while (!stack.empty()) {
+                    auto [node_id, depth] = stack.back();
+                    stack.pop_back();
+
+                    const octonode_t &node = nodes_[node_id];
+                    shape.add_node(depth, node.size(), node.active_nodes_ != 0);
+
+                    for (node_id_t child_id : node.children_)
+                        if (child_id != NO_NODE) stack.push_back({child_id, depth + 1});
+                }
+                return shape;
             }
     };
+
+    using octotree_t       = basic_octotree_t<double>;
+    using float_octotree_t = basic_octotree_t<float>;
 }
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+
+// File format of a built octree. The header is followed by the triangles with
+// their precomputed type, longest edge and radius, the nodes, the triangle
+// order, the figure tags, the segment and point records of the degenerate
+// figures and the boxes of the reject, each at an offset from the start of the
+// file aligned to INDEX_ALIGN. Nodes refer to children and triangles by index,
+// so the file is used in place wherever it is mapped.
+namespace octree_index {
+
+    const char     INDEX_MAGIC[8] = {'T', 'R', 'I', 'N', 'D', 'E', 'X', '\0'};
+    const uint32_t INDEX_VERSION  = 5;
+    const uint64_t INDEX_ALIGN    = 64;
+
+    struct index_header_t {
+        char     magic[8];
+        uint32_t version;
+        uint32_t scalar_size;
+
+        // The input the tree was built from, so a stale index is noticed, and the
+        // arrays that follow, so a damaged one is.
+        uint64_t input_hash;
+        uint64_t input_size;
+        uint64_t body_hash;
+
+        // Record sizes guard against a file written by a build with another layout.
+        uint32_t tr_size;
+        uint32_t node_size;
+
+        // Narrow engine the figure types and records were picked for, and padding.
+        uint32_t narrow;
+        uint32_t reserved;
+
+        uint64_t trs_num;
+        uint64_t nodes_num;
+        uint64_t segs_num;
+        uint64_t pnts_num;
+
+        double   looseness;
+        uint64_t leaf_size;
+
+        uint64_t trs_offset;
+        uint64_t nodes_offset;
+        uint64_t ids_offset;
+        uint64_t figs_offset;
+        uint64_t segs_offset;
+        uint64_t pnts_offset;
+        uint64_t boxes_offset;
+        uint64_t file_size;
+    };
+
+    static_assert(sizeof(index_header_t) == 168, "index header layout is part of the file format");
+
+    // What a run expects of an index to use it instead of building the tree.
+    struct index_key_t {
+        uint64_t input_hash;
+        uint64_t input_size;
+        uint32_t scalar_size;
+        uint32_t narrow;
+        bool     is_loose;
+    };
+
+    inline uint64_t align_offset(uint64_t offset) { return (offset + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN; }
+
+    // 64-bit multiply-xorshift hash of the input bytes, eight at a time. Tells
+    // inputs apart, it is no defence against crafted collisions.
+    inline uint64_t hash_bytes(const char *begin, const char *end) {
+        const uint64_t MUL = 0x9e3779b97f4a7c15ull;
+        uint64_t hash = 0xcbf29ce484222325ull ^ static_cast<uint64_t>(end - begin);
+
+        auto mix = [&](uint64_t word) {
+            hash = (hash ^ word) * MUL;
+            hash ^= hash >> 32;
+        };
+
+        for (; end - begin >= 8; begin += 8) {
+            uint64_t word;
+            std::memcpy(&word, begin, sizeof(word));
+            mix(word);
+        }
+
+        uint64_t tail = 0;
+        std::memcpy(&tail, begin, end - begin);
+        mix(tail);
+
+        return hash;
+    }
+
+    // Hash of the arrays given by their start and length in bytes, in order.
+    inline uint64_t hash_arrays(std::initializer_list<std::pair<const void *, uint64_t>> arrays) {
+        const uint64_t MUL = 0x9e3779b97f4a7c15ull;
+        uint64_t hash = arrays.size();
+
+        for (auto [data, len] : arrays) {
+            // An empty array may have no data pointer at all.
+            const char *begin = static_cast<const char *>(data);
+            hash = (hash ^ (len ? hash_bytes(begin, begin + len) : 0)) * MUL;
+        }
+        return hash;
+    }
+
+    // True if the mapped bytes hold an index of this layout for the expected
+    // input, with every array inside the file.
+    inline bool check_index(const char *begin, const char *end, const index_key_t &key, uint32_t tr_size,
+                            uint32_t node_size, uint32_t seg_size, uint32_t pnt_size, uint64_t soa_padding) {
+        uint64_t sz = end - begin;
+        if (sz < sizeof(index_header_t)) return false;
+
+        index_header_t header;
+        std::memcpy(&header, begin, sizeof(header));
+
+        if (std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) || header.version != INDEX_VERSION)
+            return false;
+        if (header.tr_size != tr_size || header.node_size != node_size || header.file_size != sz) return false;
+        if (header.scalar_size != key.scalar_size || header.input_hash != key.input_hash ||
+            header.input_size != key.input_size || header.narrow != key.narrow ||
+            (header.looseness > 1) != key.is_loose) return false;
+
+        if (header.trs_num > UINT32_MAX || !header.nodes_num || header.nodes_num > UINT32_MAX) return false;
+        if (header.segs_num > header.trs_num || header.pnts_num > header.trs_num - header.segs_num) return false;
+
+        auto is_inside = [&](uint64_t offset, uint64_t len) {
+            return offset % INDEX_ALIGN == 0 && offset <= sz && len <= sz - offset;
+        };
+
+        return is_inside(header.trs_offset, header.trs_num * tr_size) &&
+               is_inside(header.nodes_offset, header.nodes_num * node_size) &&
+               is_inside(header.ids_offset, header.trs_num * sizeof(int)) &&
+               is_inside(header.figs_offset, header.trs_num * sizeof(uint32_t)) &&
+               is_inside(header.segs_offset, header.segs_num * seg_size) &&
+               is_inside(header.pnts_offset, header.pnts_num * pnt_size) &&
+               is_inside(header.boxes_offset, 6 * (header.trs_num + soa_padding) * header.scalar_size);
+    }
+
+    // Writes len bytes at offset, filling the gap from pos with zeros.
+    inline bool write_at(FILE *out, uint64_t &pos, uint64_t offset, const void *data, uint64_t len) {
+        static const char zeros[INDEX_ALIGN] = {};
+
+        if (offset < pos || offset - pos > INDEX_ALIGN) return false;
+        if (std::fwrite(zeros, 1, offset - pos, out) != offset - pos) return false;
+        if (len && std::fwrite(data, 1, len, out) != len) return false;
+
+        pos = offset + len;
+        return true;
+    }
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "array_view.hpp"
+#include "hits.hpp"
+#include "narrow_phase.hpp"
+#include "radix_sort.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+// Coplanar pre-pass of the fast narrow phase. Triangles are bucketed by their
+// quantized unit normal, and a bucket keeps the triangles exactly parallel to
+// its first one as a family. A family is split into groups of exactly coplanar
+// triangles, whose pairs are decided in 2D by a sweep-line. Triangles of one
+// family in distinct groups lie in distinct parallel planes and never meet, so
+// the broad phase only has to test the pairs across families.
+namespace plane_groups {
+
+    using namespace narrow_phase;
+    using answers::hits_t;
+    using array_views::array_view_t;
+    using radix_sorts::keyed_id_t;
+    using thread_pool::work_stealing_pool_t;
+
+    const uint32_t NO_FAMILY = std::numeric_limits<uint32_t>::max();
+
+    // Bits per normal component of the family key, the unit normal is rounded
+    // to steps of 1 / NORMAL_SCALE.
+    const int    NORMAL_BITS  = 21;
+    const double NORMAL_SCALE = 1 << (NORMAL_BITS - 2);
+    const uint64_t NO_KEY     = std::numeric_limits<uint64_t>::max();
+
+    // Triangles per pool task of the 2D pass.
+    const uint32_t TRS_PER_TASK = 1 << 12;
+
+    class plane_groups_t {
+
+        // Member of a family: dist is the plain orient3d of its first vertex against
+        // the first triangle of the family, err the bound of its rounding error.
+        struct member_t {
+            double dist;
+            double err;
+            uint32_t id;
+            uint32_t group;
+        };
+
+        // Triangle of a group projected along the group axis with its 2D box.
+        struct flat_tr_t {
+            pnt2_t pnts[3];
+            double u_min, u_max, v_min, v_max;
+            uint32_t id;
+        };
+
+        array_view_t<triangle_t> trs_;
+
+        std::vector<uint32_t> families_;
+        uint32_t families_num_ = 0;
+
+        // Ids of the groups of two triangles or more one after another: group g
+        // is [group_begins_[g], group_begins_[g + 1]) and is projected along
+        // group_axes_[g].
+        std::vector<uint32_t> group_ids_;
+        std::vector<uint32_t> group_begins_ = {0};
+        std::vector<int>      group_axes_;
+
+        // Unit normal rounded and signed so its first nonzero component is
+        // positive, NO_KEY if the normal is too short to normalize.
+        static uint64_t get_family_key(const triangle_t &tr) {
+            orient_plane_t pln = get_plane(tr);
+            double len = std::sqrt(pln.nx * pln.nx + pln.ny * pln.ny + pln.nz * pln.nz);
+
+            if (!(len > 0) || !std::isfinite(len)) return NO_KEY;
+
+            int64_t q[3] = {std::llround(pln.nx / len * NORMAL_SCALE), std::llround(pln.ny / len * NORMAL_SCALE),
+                            std::llround(pln.nz / len * NORMAL_SCALE)};
+
+            if (q[0] < 0 || (q[0] == 0 && (q[1] < 0 || (q[1] == 0 && q[2] < 0))))
+                for (int64_t &comp : q) comp = -comp;
+
+            uint64_t key = 0;
+            for (int i = 0; i < 3; ++i)
+                key |= static_cast<uint64_t>(q[i] + static_cast<int64_t>(NORMAL_SCALE)) << (NORMAL_BITS * i);
+            return key;
+        }
+
+        // Keeps the triangles of a bucket that are exactly parallel to its first
+        // one and project to proper triangles along its dominant axis, and splits
+        // them into planes: sorted by distance, a triangle joins the first earlier
+        // group whose plane holds it exactly. Distances of one plane differ by no
+        // more than twice the largest error, so older groups needn't be looked at.
+        void add_family(const keyed_id_t *items, size_t items_num, std::vector<member_t> &members) {
+            const triangle_t &ref = trs_[items[0].id];
+            orient_plane_t pln = get_plane(ref);
+            pnt2_t ref_flat[3];
+            int axis = project(ref, pln, ref_flat);
+
+            members.clear();
+            double max_err = 0;
+
+            for (size_t i = 0; i < items_num; ++i) {
+                const triangle_t &tr = trs_[items[i].id];
+                const point_t &pnt = tr.get_pnt(0);
+
+                if (pln.get_dir_side(pnt, tr.get_pnt(1)) != 0 || pln.get_dir_side(pnt, tr.get_pnt(2)) != 0) continue;
+
+                pnt2_t flat[3];
+                project(tr, axis, flat);
+                if (orient2d(flat[0], flat[1], flat[2]) == 0) continue;
+
+                double err, dist = pln.get_det(pnt, ref.get_pnt(0), err);
+                members.push_back({dist, err, items[i].id, 0});
+                max_err = std::max(max_err, err);
+            }
+
+            if (members.size() < 2) return;
+
+            std::sort(members.begin(), members.end(), [](const member_t &m1, const member_t &m2) {
+                return m1.dist < m2.dist;
+            });
+
+            std::vector<uint32_t> group_firsts;
+
+            for (uint32_t i = 0; i < members.size(); ++i) {
+                const point_t &pnt = trs_[members[i].id].get_pnt(0);
+                uint32_t group = group_firsts.size();
+
+                for (uint32_t k = group_firsts.size(); k-- > 0;) {
+                    const member_t &first = members[group_firsts[k]];
+                    if (first.dist + 2 * max_err < members[i].dist) break;
+
+                    if (pln.get_dir_side(trs_[first.id].get_pnt(0), pnt) == 0) {
+                        group = k;
+                        break;
+                    }
+                }
+
+                if (group == group_firsts.size()) group_firsts.push_back(i);
+                members[i].group = group;
+            }
+
+            std::stable_sort(members.begin(), members.end(), [](const member_t &m1, const member_t &m2) {
+                return m1.group < m2.group;
+            });
+
+            uint32_t family = families_num_++;
+
+            for (size_t begin = 0, end; begin < members.size(); begin = end) {
+                for (end = begin + 1; end < members.size() && members[end].group == members[begin].group; ++end) {}
+
+                for (size_t i = begin; i < end; ++i) families_[members[i].id] = family;
+                if (end - begin < 2) continue;
+
+                for (size_t i = begin; i < end; ++i) group_ids_.push_back(members[i].id);
+                group_begins_.push_back(group_ids_.size());
+                group_axes_.push_back(axis);
+            }
+        }
+
+        // Sweeps the group along u: sorted by the start of their u intervals, a
+        // triangle is tested against the next ones that start before it ends and
+        // whose v interval overlaps its own.
+        void get_intersections(uint32_t group, hits_t &ans, std::vector<flat_tr_t> &flats) const {
+            int axis = group_axes_[group];
+
+            flats.resize(group_begins_[group + 1] - group_begins_[group]);
+            for (uint32_t i = 0; i < flats.size(); ++i) {
+                flat_tr_t &flat = flats[i];
+
+                flat.id = group_ids_[group_begins_[group] + i];
+                project(trs_[flat.id], axis, flat.pnts);
+
+                flat.u_min = flat.u_max = flat.pnts[0].u;
+                flat.v_min = flat.v_max = flat.pnts[0].v;
+                for (const pnt2_t &pnt : flat.pnts) {
+                    flat.u_min = std::min(flat.u_min, pnt.u); flat.u_max = std::max(flat.u_max, pnt.u);
+                    flat.v_min = std::min(flat.v_min, pnt.v); flat.v_max = std::max(flat.v_max, pnt.v);
+                }
+            }
+
+            std::sort(flats.begin(), flats.end(), [](const flat_tr_t &tr1, const flat_tr_t &tr2) {
+                return tr1.u_min < tr2.u_min;
+            });
+
+            for (uint32_t i = 0; i < flats.size() && !ans.is_stopped(); ++i) {
+                const flat_tr_t &flat = flats[i];
+                bool is_marked = ans.is_marked(flat.id);
+
+                for (uint32_t j = i + 1; j < flats.size() && flats[j].u_min <= flat.u_max; ++j) {
+                    const flat_tr_t &other = flats[j];
+
+                    if (other.v_max < flat.v_min || flat.v_max < other.v_min) continue;
+                    if (is_marked && ans.is_marked(other.id)) continue;
+
+                    STATS_ADD(CANDIDATE_PAIRS, 1);
+                    STATS_EXACT(TRIAN, TRIAN);
+
+                    if (trs_intersect2d(flat.pnts, other.pnts)) ans.add(flat.id, other.id);
+                }
+            }
+        }
+
+        void get_intersections(uint32_t groups_begin, uint32_t groups_end, hits_t &ans) const {
+            std::vector<flat_tr_t> flats;
+
+            for (uint32_t group = groups_begin; group < groups_end && !ans.is_stopped(); ++group)
+                get_intersections(group, ans, flats);
+        }
+
+        public:
+            // Groups the triangles, which must outlive the groups.
+            explicit plane_groups_t(array_view_t<triangle_t> trs, int threads = 1) :
+                trs_(trs), families_(trs.size(), NO_FAMILY) {
+                std::vector<keyed_id_t> items;
+
+                for (uint32_t id = 0; id < trs_.size(); ++id) {
+                    if (trs_[id].get_exact_type() != TRIAN) continue;
+
+                    uint64_t key = get_family_key(trs_[id]);
+                    if (key != NO_KEY) items.push_back({key, id});
+                }
+
+                radix_sorts::radix_sort(items, 3 * NORMAL_BITS, threads);
+
+                std::vector<member_t> members;
+
+                for (size_t begin = 0, end; begin < items.size(); begin = end) {
+                    for (end = begin + 1; end < items.size() && items[end].key == items[begin].key; ++end) {}
+                    if (end - begin > 1) add_family(&items[begin], end - begin, members);
+                }
+            }
+
+            plane_groups_t(const plane_groups_t& groups)            = delete;
+            plane_groups_t& operator=(const plane_groups_t& groups) = delete;
+
+            // Family of every id, NO_FAMILY for the triangles the pre-pass leaves
+            // to the broad phase whole.
+            const uint32_t *families() const { return families_.data(); }
+
+            uint32_t families_num() const { return families_num_; }
+
+            size_t groups_num() const { return group_axes_.size(); }
+
+            // Passes to ans every pair of intersecting triangles of one group.
+            void get_intersections(hits_t &ans, int threads = 1) const {
+                if (threads <= 1) {
+                    get_intersections(0, groups_num(), ans);
+                    return;
+                }
+
+                work_stealing_pool_t pool{threads};
+                int worker = 0;
+
+                for (uint32_t begin = 0, end; begin < groups_num(); begin = end) {
+                    end = begin + 1;
+                    while (end < groups_num() && group_begins_[end] - group_begins_[begin] < TRS_PER_TASK) ++end;
+
+                    pool.submit(worker, [this, begin, end, &ans](work_stealing_pool_t &, int) {
+                        get_intersections(begin, end, ans);
+                    });
+                    worker = (worker + 1) % pool.size();
+                }
+                pool.run();
+            }
+    };
+}
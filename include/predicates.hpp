@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include "geometry.hpp"
+
+// Orientation predicates with a floating-point filter (Shewchuk). The plain
+// determinant decides whenever it is larger than its forward error bound, the
+// rest is recomputed exactly on expansions, so the signs never depend on an
+// epsilon or on the scale of the coordinates.
+namespace predicates {
+
+    using geometry::point_t;
+
+    // Unit roundoff of double arithmetic, half an ulp of 1.
+    const double ROUNDOFF = DBL_EPSILON / 2;
+
+    const double O2D_ERR_BOUND = (3 + 16 * ROUNDOFF) * ROUNDOFF;
+    const double O3D_ERR_BOUND = (7 + 56 * ROUNDOFF) * ROUNDOFF;
+
+    // Longest expansion needed: a 3x3 determinant of exact coordinate differences.
+    const int EXPANSION_CAPACITY = 192;
+
+    inline int get_sign(double val) { return (val > 0) - (val < 0); }
+
+    // Exact value as a sum of nonoverlapping doubles of increasing magnitude.
+    // Zero components are never stored, so exact differences and products of
+    // short numbers stay short and the last component gives the sign.
+    struct expansion_t {
+        double comps[EXPANSION_CAPACITY];
+        int len = 0;
+
+        int get_sign() const { return len ? predicates::get_sign(comps[len - 1]) : 0; }
+
+        void negate() {
+            for (int i = 0; i < len; ++i) comps[i] = -comps[i];
+        }
+
+        // Adds one double in place (grow_expansion).
+        void add(double val) {
+            int new_len = 0;
+
+            for (int i = 0; i < len; ++i) {
+                double sum = val + comps[i], b_virt = sum - val, a_virt = sum - b_virt;
+                double err = (val - a_virt) + (comps[i] - b_virt);
+
+                if (err != 0) comps[new_len++] = err;
+                val = sum;
+            }
+            if (val != 0) comps[new_len++] = val;
+            len = new_len;
+        }
+
+        // this = exp1 + exp2, merging the components by magnitude
+        // (fast_expansion_sum); exp1 and exp2 must not be this.
+        void set_sum(const expansion_t &exp1, const expansion_t &exp2) {
+            int i = 0, j = 0;
+            double acc = 0;
+
+            len = 0;
+            while (i < exp1.len || j < exp2.len) {
+                double val;
+                if (j == exp2.len || (i < exp1.len && std::abs(exp1.comps[i]) < std::abs(exp2.comps[j])))
+                    val = exp1.comps[i++];
+                else
+                    val = exp2.comps[j++];
+
+                double sum = acc + val, b_virt = sum - acc, a_virt = sum - b_virt;
+                double err = (acc - a_virt) + (val - b_virt);
+
+                if (err != 0) comps[len++] = err;
+                acc = sum;
+            }
+            if (acc != 0) comps[len++] = acc;
+        }
+
+        void add(const expansion_t &exp) {
+            expansion_t sum;
+
+            sum.set_sum(*this, exp);
+            std::copy(sum.comps, sum.comps + sum.len, comps);
+            len = sum.len;
+        }
+
+        // this = exp * val (scale_expansion).
+        void set_scaled(const expansion_t &exp, double val) {
+            len = 0;
+            if (!exp.len) return;
+
+            double acc = exp.comps[0] * val, err = std::fma(exp.comps[0], val, -acc);
+            if (err != 0) comps[len++] = err;
+
+            for (int i = 1; i < exp.len; ++i) {
+                double prod = exp.comps[i] * val, prod_err = std::fma(exp.comps[i], val, -prod);
+
+                double sum = acc + prod_err, b_virt = sum - acc, a_virt = sum - b_virt;
+                err = (acc - a_virt) + (prod_err - b_virt);
+                if (err != 0) comps[len++] = err;
+
+                acc = prod + sum;
+                err = sum - (acc - prod);
+                if (err != 0) comps[len++] = err;
+            }
+            if (acc != 0) comps[len++] = acc;
+        }
+
+        // this = exp1 * exp2, exp1 and exp2 must not be this.
+        void set_product(const expansion_t &exp1, const expansion_t &exp2) {
+            expansion_t part;
+
+            len = 0;
+            for (int i = 0; i < exp2.len; ++i) {
+                part.set_scaled(exp1, exp2.comps[i]);
+                add(part);
+            }
+        }
+
+        // this = a - b, exactly.
+        void set_diff(double a, double b) {
+            len = 0;
+            add(a);
+            add(-b);
+        }
+    };
+
+    // Rounding errors of the given rounded a - b, a * b and a + b (Two_Diff,
+    // Two_Product, Two_Sum): zero iff the operation was exact.
+    inline double get_diff_err(double a, double b, double diff) {
+        double b_virt = a - diff, a_virt = diff + b_virt;
+        return (a - a_virt) + (b_virt - b);
+    }
+
+    inline double get_prod_err(double a, double b, double prod) { return std::fma(a, b, -prod); }
+
+    inline double get_sum_err(double a, double b, double sum) {
+        double b_virt = sum - a, a_virt = sum - b_virt;
+        return (a - a_virt) + (b - b_virt);
+    }
+
+    // Sign of (b - a) x (c - a), computed exactly. Kept out of line: the expansions
+    // take kilobytes of stack the filtered callers shouldn't pay for.
+    [[gnu::noinline]] inline int orient2d_exact(double ax, double ay, double bx, double by, double cx, double cy) {
+        expansion_t bax, bay, cax, cay, det, right;
+
+        bax.set_diff(bx, ax); bay.set_diff(by, ay);
+        cax.set_diff(cx, ax); cay.set_diff(cy, ay);
+
+        det.set_product(bax, cay);
+        right.set_product(bay, cax);
+        right.negate();
+        det.add(right);
+
+        return det.get_sign();
+    }
+
+    // Whether the plain (b - a) x (c - a) was evaluated without rounding, as on
+    // integer coordinates: then its sign is exact without the expansions.
+    inline bool is_exact_orient2d(double ax, double ay, double bx, double by, double cx, double cy, double det) {
+        double bax = bx - ax, cay = cy - ay, bay = by - ay, cax = cx - ax;
+        double left = bax * cay, right = bay * cax;
+
+        return get_diff_err(bx, ax, bax) == 0 && get_diff_err(cy, ay, cay) == 0 &&
+               get_diff_err(by, ay, bay) == 0 && get_diff_err(cx, ax, cax) == 0 &&
+               get_prod_err(bax, cay, left) == 0 && get_prod_err(bay, cax, right) == 0 &&
+               get_diff_err(left, right, det) == 0;
+    }
+
+    // Sign of (b - a) x (c - a) in the plane: positive if a, b, c turn counterclockwise.
+    inline int orient2d(double ax, double ay, double bx, double by, double cx, double cy) {
+        double left = (bx - ax) * (cy - ay), right = (by - ay) * (cx - ax), det = left - right;
+        double bound = O2D_ERR_BOUND * (std::abs(left) + std::abs(right));
+
+        if (std::abs(det) >= bound || is_exact_orient2d(ax, ay, bx, by, cx, cy, det)) return get_sign(det);
+
+        return orient2d_exact(ax, ay, bx, by, cx, cy);
+    }
+
+    // Sign of ((b - a) x (c - a)) . (d - o), computed exactly, out of line as well.
+    [[gnu::noinline]] inline int orient3d_exact(const point_t &a, const point_t &b, const point_t &c,
+                                                const point_t &d, const point_t &o) {
+        expansion_t u[3], v[3], w[3];
+
+        u[0].set_diff(b.x_, a.x_); u[1].set_diff(b.y_, a.y_); u[2].set_diff(b.z_, a.z_);
+        v[0].set_diff(c.x_, a.x_); v[1].set_diff(c.y_, a.y_); v[2].set_diff(c.z_, a.z_);
+        w[0].set_diff(d.x_, o.x_); w[1].set_diff(d.y_, o.y_); w[2].set_diff(d.z_, o.z_);
+
+        expansion_t det, minor, prod, term;
+
+        for (int i = 0; i < 3; ++i) {
+            int j = (i + 1) % 3, k = (i + 2) % 3;
+
+            minor.set_product(u[j], v[k]);
+            prod.set_product(u[k], v[j]);
+            prod.negate();
+            minor.add(prod);
+
+            term.set_product(w[i], minor);
+            det.add(term);
+        }
+
+        return det.get_sign();
+    }
+
+    inline int orient3d_exact(const point_t &a, const point_t &b, const point_t &c, const point_t &d) {
+        return orient3d_exact(a, b, c, d, a);
+    }
+
+    // Plane through a, b and c prepared for orient3d against many points: the
+    // normal (b - a) x (c - a) and, per component, the sum of the magnitudes of
+    // its two products, which bounds the rounding error of the plain evaluation.
+    // Refers to the points, which must outlive it.
+    struct orient_plane_t {
+        const point_t &a, &b, &c;
+        double nx, ny, nz;
+        double px, py, pz;
+
+        orient_plane_t(const point_t &pa, const point_t &pb, const point_t &pc) : a(pa), b(pb), c(pc) {
+            double ux = b.x_ - a.x_, uy = b.y_ - a.y_, uz = b.z_ - a.z_,
+                   vx = c.x_ - a.x_, vy = c.y_ - a.y_, vz = c.z_ - a.z_;
+
+            nx = uy * vz - uz * vy; px = std::abs(uy * vz) + std::abs(uz * vy);
+            ny = uz * vx - ux * vz; py = std::abs(uz * vx) + std::abs(ux * vz);
+            nz = ux * vy - uy * vx; pz = std::abs(ux * vy) + std::abs(uy * vx);
+        }
+
+        static bool is_exact_minor(double a1, double b1, double a2, double b2, double minor) {
+            double prod1 = a1 * b1, prod2 = a2 * b2;
+
+            return get_prod_err(a1, b1, prod1) == 0 && get_prod_err(a2, b2, prod2) == 0 &&
+                   get_diff_err(prod1, prod2, minor) == 0;
+        }
+
+        // Whether the normal was computed without rounding, as on integer coordinates.
+        bool is_exact_normal() const {
+            double ux = b.x_ - a.x_, uy = b.y_ - a.y_, uz = b.z_ - a.z_,
+                   vx = c.x_ - a.x_, vy = c.y_ - a.y_, vz = c.z_ - a.z_;
+
+            return get_diff_err(b.x_, a.x_, ux) == 0 && get_diff_err(b.y_, a.y_, uy) == 0 &&
+                   get_diff_err(b.z_, a.z_, uz) == 0 && get_diff_err(c.x_, a.x_, vx) == 0 &&
+                   get_diff_err(c.y_, a.y_, vy) == 0 && get_diff_err(c.z_, a.z_, vz) == 0 &&
+                   is_exact_minor(uy, vz, uz, vy, nx) && is_exact_minor(uz, vx, ux, vz, ny) &&
+                   is_exact_minor(ux, vy, uy, vx, nz);
+        }
+
+        // Plain n . (d - o) with the bound of its rounding error.
+        double get_det(const point_t &d, const point_t &o, double &bound) const {
+            double wx = d.x_ - o.x_, wy = d.y_ - o.y_, wz = d.z_ - o.z_;
+
+            bound = O3D_ERR_BOUND * (std::abs(wx) * px + std::abs(wy) * py + std::abs(wz) * pz);
+            return wx * nx + wy * ny + wz * nz;
+        }
+
+        // Whether the plain n . (d - o) was evaluated without rounding: then its
+        // sign is exact without the expansions. Coplanar points of flat scenes
+        // always miss the filter, and this settles them on simple coordinates.
+        bool is_exact_det(const point_t &d, const point_t &o) const {
+            double wx = d.x_ - o.x_, wy = d.y_ - o.y_, wz = d.z_ - o.z_;
+            double tx = wx * nx, ty = wy * ny, tz = wz * nz, sum = tx + ty;
+
+            return get_diff_err(d.x_, o.x_, wx) == 0 && get_diff_err(d.y_, o.y_, wy) == 0 &&
+                   get_diff_err(d.z_, o.z_, wz) == 0 && get_prod_err(wx, nx, tx) == 0 &&
+                   get_prod_err(wy, ny, ty) == 0 && get_prod_err(wz, nz, tz) == 0 &&
+                   get_sum_err(tx, ty, sum) == 0 && get_sum_err(sum, tz, sum + tz) == 0 && is_exact_normal();
+        }
+
+        // Sign of n . (d - o): filtered, then exact.
+        int get_sign(const point_t &d, const point_t &o) const {
+            double bound, det = get_det(d, o, bound);
+
+            if (std::abs(det) >= bound || is_exact_det(d, o)) return predicates::get_sign(det);
+            return orient3d_exact(a, b, c, d, o);
+        }
+
+        // Side of d: positive if d is on the side the normal points to, 0 on the plane.
+        int get_side(const point_t &d) const { return get_sign(d, a); }
+
+        // Side the direction from p to q points to, 0 if it is parallel to the plane.
+        int get_dir_side(const point_t &p, const point_t &q) const { return get_sign(q, p); }
+    };
+
+    inline int orient3d(const point_t &a, const point_t &b, const point_t &c, const point_t &d) {
+        return orient_plane_t{a, b, c}.get_side(d);
+    }
+}
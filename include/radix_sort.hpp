@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+#include "thread_pool.hpp"
+
+namespace radix_sorts {
+
+    const int    DIGIT_BITS = 8;
+    const int    DIGITS_NUM = 1 << DIGIT_BITS;
+    const size_t MIN_BLOCK  = 1 << 15;
+
+    struct keyed_id_t {
+        uint64_t key;
+        uint32_t id;
+    };
+
+    // Calls func(block, first, last) for blocks_num equal blocks of [0, n), one
+    // pool task per block when there are several.
+    template <typename func_t>
+    void for_each_block(size_t n, int blocks_num, func_t func) {
+        auto run_block = [&](int block) { func(block, n * block / blocks_num, n * (block + 1) / blocks_num); };
+
+        if (blocks_num <= 1) {
+            run_block(0);
+            return;
+        }
+
+        thread_pool::work_stealing_pool_t pool{blocks_num};
+
+        for (int block = 0; block < blocks_num; ++block)
+            pool.submit(block, [&run_block, block](thread_pool::work_stealing_pool_t &, int) { run_block(block); });
+        pool.run();
+    }
+
+    // Stable LSD radix sort by the low key_bits bits of the keys. Every pass splits
+    // the items into one block per thread: the blocks count their digits in
+    // parallel, a prefix sum over (digit, block) gives each block its place in the
+    // output and the blocks scatter in parallel. A pass whose digit is the same for
+    // all items is skipped.
+    inline void radix_sort(std::vector<keyed_id_t> &items, int key_bits, int threads = 1) {
+        size_t n = items.size();
+        int blocks_num = std::clamp<size_t>(n / MIN_BLOCK, 1, std::max(threads, 1));
+
+        std::vector<keyed_id_t> sorted(n);
+        std::vector<std::array<size_t, DIGITS_NUM>> counts(blocks_num);
+
+        for (int shift = 0; shift < key_bits; shift += DIGIT_BITS) {
+            for_each_block(n, blocks_num, [&](int block, size_t first, size_t last) {
+                counts[block].fill(0);
+                for (size_t i = first; i < last; ++i) counts[block][(items[i].key >> shift) & (DIGITS_NUM - 1)]++;
+            });
+
+            bool is_single = false;
+            size_t pos = 0;
+
+            for (int digit = 0; digit < DIGITS_NUM; ++digit) {
+                size_t digit_begin = pos;
+
+                for (int block = 0; block < blocks_num; ++block) {
+                    size_t cnt = counts[block][digit];
+                    counts[block][digit] = pos;
+                    pos += cnt;
+                }
+                if (pos - digit_begin == n) is_single = true;
+            }
+
+            if (is_single) continue;
+
+            for_each_block(n, blocks_num, [&](int block, size_t first, size_t last) {
+                std::array<size_t, DIGITS_NUM> &next = counts[block];
+
+                for (size_t i = first; i < last; ++i)
+                    sorted[next[(items[i].key >> shift) & (DIGITS_NUM - 1)]++] = items[i];
+            });
+
+            items.swap(sorted);
+        }
+    }
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "broad_phase.hpp"
+
+// Fixed-seed synthetic scenes for benchmarks. The extent of a scene grows with
+// the amount of triangles, so every distribution keeps about the same number of
+// hits per triangle at any size.
+namespace scene_gens {
+
+    using broad_phase::max_min_crds_t;
+
+    enum distribution_t {UNIFORM, CLUSTERED, COPLANAR, DEGENERATE, MIXED};
+
+    const char *const DISTRIBUTION_NAMES[] = {"uniform", "clustered", "coplanar", "degenerate", "mixed"};
+    const int DISTRIBUTIONS_NUM = 5;
+
+    const int    CLUSTER_TRS   = 20000;
+    const double BACKGROUND    = 0.1;
+    const int    PLANE_GAP     = 4;
+    const double MIN_MIXED_RAD = 0.1;
+    const double MAX_MIXED_RAD = 10;
+
+    // Scene as 9 coordinates per triangle with its bounds, the input of
+    // scene_reader::write_binary_scene.
+    struct scene_t {
+        std::vector<double> crds;
+        max_min_crds_t bounds;
+
+        size_t size() const { return crds.size() / 9; }
+
+        void add(const double (&c)[9]) {
+            crds.insert(crds.end(), c, c + 9);
+
+            bounds.update(c[0], c[1], c[2]);
+            bounds.update(c[3], c[4], c[5]);
+            bounds.update(c[6], c[7], c[8]);
+        }
+    };
+
+    class scene_generator_t {
+        std::mt19937_64 rng_;
+        std::uniform_real_distribution<double> unit_{0, 1};
+
+        double get_real(double lo, double hi) { return lo + (hi - lo) * unit_(rng_); }
+
+        int64_t get_int(int64_t lo, int64_t hi) { return std::uniform_int_distribution<int64_t>{lo, hi}(rng_); }
+
+        // Triangle with vertices in the cube of the given radius around the center.
+        void add_around(scene_t &scene, const double (&cntr)[3], double radius) {
+            double c[9];
+            for (int i = 0; i < 9; ++i) c[i] = cntr[i % 3] + get_real(-radius, radius);
+            scene.add(c);
+        }
+
+        void add_uniform(scene_t &scene, size_t n, double side) {
+            for (size_t i = 0; i < n; ++i) {
+                double cntr[3] = {get_real(0, side), get_real(0, side), get_real(0, side)};
+                add_around(scene, cntr, 1);
+            }
+        }
+
+        // Gaussian clusters of CLUSTER_TRS triangles on average, packed several
+        // times denser than the uniform scene, over a uniform background.
+        void add_clustered(scene_t &scene, size_t n, double side) {
+            size_t background = n * BACKGROUND, clusters_num = std::max<size_t>(1, n / CLUSTER_TRS);
+            std::vector<std::array<double, 3>> centers(clusters_num);
+
+            for (auto &cntr : centers)
+                for (double &crd : cntr) crd = get_real(side / 4, side * 3 / 4);
+
+            double sigma = side / 8 / std::cbrt(clusters_num);
+            std::normal_distribution<double> offset{0, sigma};
+
+            for (size_t i = background; i < n; ++i) {
+                const auto &center = centers[get_int(0, clusters_num - 1)];
+                double cntr[3] = {center[0] + offset(rng_), center[1] + offset(rng_), center[2] + offset(rng_)};
+                add_around(scene, cntr, 1);
+            }
+            add_uniform(scene, background, side);
+        }
+
+        // Stacks of planes x + y + z = PLANE_GAP * k with integer vertices, so the
+        // triangles of a plane are exactly coplanar.
+        void add_coplanar(scene_t &scene, size_t n) {
+            int64_t planes = std::max<int64_t>(1, std::cbrt(n));
+            int64_t side   = std::max<int64_t>(4, 3 * std::sqrt(n / planes));
+
+            for (size_t i = 0; i < n; ++i) {
+                int64_t level = PLANE_GAP * get_int(0, planes - 1);
+                int64_t x = get_int(0, side), y = get_int(0, side);
+                double c[9];
+
+                for (int v = 0; v < 3; ++v) {
+                    int64_t vx = x + get_int(-2, 2), vy = y + get_int(-2, 2);
+
+                    c[3 * v]     = vx;
+                    c[3 * v + 1] = vy;
+                    c[3 * v + 2] = level - vx - vy;
+                }
+                scene.add(c);
+            }
+        }
+
+        // Triangles, segments and points in turn, on a coarse grid so that some of
+        // the degenerate figures land exactly on others.
+        void add_degenerate(scene_t &scene, size_t n, double side) {
+            for (size_t i = 0; i < n; ++i) {
+                double p[3], q[3], r[3];
+
+                for (int k = 0; k < 3; ++k) {
+                    p[k] = std::round(get_real(0, side) * 4) / 4;
+                    q[k] = p[k] + std::round(get_real(-1, 1) * 4) / 4;
+                    r[k] = p[k] + std::round(get_real(-1, 1) * 4) / 4;
+                }
+
+                if (i % 3 != 0) std::copy(p, p + 3, r);
+                if (i % 3 == 2) std::copy(p, p + 3, q);
+
+                double c[9] = {p[0], p[1], p[2], q[0], q[1], q[2], r[0], r[1], r[2]};
+                scene.add(c);
+            }
+        }
+
+        // Radii spread log-uniformly over two decades around the uniform one.
+        void add_mixed(scene_t &scene, size_t n, double side) {
+            for (size_t i = 0; i < n; ++i) {
+                double cntr[3] = {get_real(0, side), get_real(0, side), get_real(0, side)};
+                add_around(scene, cntr, std::exp(get_real(std::log(MIN_MIXED_RAD), std::log(MAX_MIXED_RAD))));
+            }
+        }
+
+        public:
+            explicit scene_generator_t(uint64_t seed) : rng_(seed) {}
+
+            scene_t generate(distribution_t dist, size_t n) {
+                scene_t scene;
+                double side = 4 * std::cbrt(n);
+
+                scene.crds.reserve(9 * n);
+
+                switch (dist) {
+                    case UNIFORM:    add_uniform(scene, n, side);    break;
+                    case CLUSTERED:  add_clustered(scene, n, side);  break;
+                    case COPLANAR:   add_coplanar(scene, n);         break;
+                    case DEGENERATE: add_degenerate(scene, n, side); break;
+                    case MIXED:      add_mixed(scene, n, side);      break;
+                }
+                return scene;
+            }
+    };
+
+    // Distribution by name, false if there is none.
+    inline bool find_distribution(const char *name, distribution_t &dist) {
+        for (int i = 0; i < DISTRIBUTIONS_NUM; ++i)
+            if (!std::strcmp(name, DISTRIBUTION_NAMES[i])) {
+                dist = static_cast<distribution_t>(i);
+                return true;
+            }
+        return false;
+    }
+}
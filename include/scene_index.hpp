@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "octotree.hpp"
+#include "scene_reader.hpp"
+#include "thread_pool.hpp"
+
+// Index over a static scene, built once and then asked batch after batch which
+// scene triangles each of many external query triangles intersects.
+namespace scene_index {
+
+    using namespace octotrees;
+
+    // Queries answered by one task of a batch.
+    const size_t QUERIES_PER_TASK = 64;
+
+    // Answer to a batch in one flat array: query i hits the scene triangles
+    // ids[offsets[i]] ... ids[offsets[i + 1] - 1], in ascending order. Passing the
+    // same object to every batch reuses its memory.
+    struct batch_hits_t {
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> ids;
+
+        // Hits gathered by every task of the last batch before they are joined.
+        std::vector<std::vector<uint32_t>> task_ids;
+
+        size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    };
+
+    class scene_index_t {
+        std::vector<triangle_t> trs_;
+        octotree_t tree_;
+
+        void run_task(const std::vector<triangle_t> &queries, size_t task, octotree_t::ranges_t &ranges,
+                      batch_hits_t &res) const {
+            std::vector<uint32_t> &ids = res.task_ids[task];
+            size_t first = task * QUERIES_PER_TASK, last = std::min(first + QUERIES_PER_TASK, queries.size());
+
+            ids.clear();
+
+            for (size_t i = first; i < last; ++i) {
+                size_t begin = ids.size();
+
+                tree_.for_each_intersected(queries[i], ranges, [&ids](uint32_t id) { ids.push_back(id); });
+                std::sort(ids.begin() + begin, ids.end());
+
+                res.offsets[i + 1] = ids.size() - begin;
+            }
+        }
+
+        public:
+            // The index keeps the triangles, ids are their positions in trs.
+            explicit scene_index_t(std::vector<triangle_t> trs, narrow_engine_t narrow = narrow_phase::CLASSIC,
+                                   const octree_params_t &params = {}) :
+                trs_(std::move(trs)), tree_(trs_, scene_reader::get_bounds(trs_), narrow, params) {}
+
+            scene_index_t(const scene_index_t& index)            = delete;
+            scene_index_t& operator=(const scene_index_t& index) = delete;
+
+            size_t size() const { return trs_.size(); }
+
+            const triangle_t &get_triangle(uint32_t id) const { return trs_[id]; }
+
+            // Answers the batch on the given amount of threads, overwriting res.
+            // Queries are split into tasks of QUERIES_PER_TASK, each worker keeps
+            // its scratch, and the hits of the tasks are joined in query order.
+            void query(const std::vector<triangle_t> &queries, batch_hits_t &res, int threads = 1) const {
+                size_t tasks = (queries.size() + QUERIES_PER_TASK - 1) / QUERIES_PER_TASK;
+
+                res.offsets.assign(queries.size() + 1, 0);
+                if (res.task_ids.size() < tasks) res.task_ids.resize(tasks);
+
+                if (threads <= 1 || tasks <= 1) {
+                    octotree_t::ranges_t ranges;
+                    for (size_t task = 0; task < tasks; ++task) run_task(queries, task, ranges, res);
+                }
+                else {
+                    thread_pool::work_stealing_pool_t pool{threads};
+                    std::vector<octotree_t::ranges_t> ranges(pool.size());
+
+                    for (size_t task = 0; task < tasks; ++task)
+                        pool.submit(task % pool.size(), [&, task](thread_pool::work_stealing_pool_t &, int worker) {
+                            run_task(queries, task, ranges[worker], res);
+                        });
+                    pool.run();
+                }
+
+                for (size_t i = 0; i < queries.size(); ++i) res.offsets[i + 1] += res.offsets[i];
+
+                res.ids.resize(res.offsets.back());
+                for (size_t task = 0; task < tasks; ++task)
+                    std::copy(res.task_ids[task].begin(), res.task_ids[task].end(),
+                              res.ids.begin() + res.offsets[task * QUERIES_PER_TASK]);
+            }
+    };
+}
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "octotree.hpp"
+
+namespace scene_reader {
+
+    using namespace octotrees;
+
+    const size_t READ_BLOCK = 1 << 20;
+
+    // Triangles scanned between releases of the pages of a mapped scene.
+    const int RELEASE_TRS = 1 << 12;
+
+    enum read_status_t {READ_OK, BAD_AMOUNT, BAD_COORDS, BAD_BINARY};
+
+    const char     SCENE_MAGIC[8] = {'T', 'R', 'S', 'C', 'E', 'N', 'E', '\0'};
+    const uint32_t SCENE_VERSION  = 1;
+
+    // Binary scene: this header, then count packed triangles of 9 coordinates each,
+    // stored as float64 or float32 according to scalar_size.
+    struct scene_header_t {
+        char     magic[8];
+        uint32_t version;
+        uint32_t scalar_size;
+        uint64_t count;
+        max_min_crds_t bounds;
+    };
+
+    static_assert(sizeof(scene_header_t) == 72, "scene header layout is part of the file format");
+
+    // Whole input as one byte range: a read-only mapping of a file,
+    // or stdin read in large blocks when no file is given.
+    class scene_source_t {
+        const char *begin_ = nullptr;
+        const char *end_   = nullptr;
+
+        void  *map_    = MAP_FAILED;
+        size_t map_sz_ = 0;
+
+        std::vector<char> buf_;
+
+        public:
+            scene_source_t() = default;
+
+            scene_source_t(const scene_source_t& src)            = delete;
+            scene_source_t& operator=(const scene_source_t& src) = delete;
+
+            ~scene_source_t() {
+                if (map_ != MAP_FAILED) munmap(map_, map_sz_);
+            }
+
+            bool open_file(const char *path) {
+                int fd = open(path, O_RDONLY);
+                if (fd < 0) return false;
+
+                struct stat st;
+                if (fstat(fd, &st) < 0) {
+                    close(fd);
+                    return false;
+                }
+
+                map_sz_ = st.st_size;
+                if (map_sz_) map_ = mmap(nullptr, map_sz_, PROT_READ, MAP_PRIVATE, fd, 0);
+                close(fd);
+
+                if (map_sz_ && map_ == MAP_FAILED) return false;
+                if (map_sz_) madvise(map_, map_sz_, MADV_SEQUENTIAL);
+
+                begin_ = static_cast<const char *>(map_sz_ ? map_ : nullptr);
+                end_   = begin_ + map_sz_;
+                return true;
+            }
+
+            bool read_stream(FILE *stream) {
+                size_t sz = 0;
+
+                while (true) {
+                    buf_.resize(sz + READ_BLOCK);
+
+                    size_t got = std::fread(buf_.data() + sz, 1, READ_BLOCK, stream);
+                    sz += got;
+
+                    if (got < READ_BLOCK) break;
+                }
+                buf_.resize(sz);
+
+                begin_ = buf_.data();
+                end_   = begin_ + sz;
+                return !std::ferror(stream);
+            }
+
+            const char *begin() const { return begin_; }
+            const char *end()   const { return end_; }
+
+            // Drops the whole mapped pages of [from, to) from memory, so a scan that
+            // won't come back to them keeps the resident size flat. Touching them
+            // again reads the file anew; buffered stdin is kept as it is.
+            void release(const char *from, const char *to) const {
+                if (map_ == MAP_FAILED) return;
+
+                uintptr_t page  = sysconf(_SC_PAGESIZE),
+                          first = (reinterpret_cast<uintptr_t>(from) + page - 1) / page * page,
+                          last  = reinterpret_cast<uintptr_t>(to) / page * page;
+
+                if (first < last) madvise(reinterpret_cast<void *>(first), last - first, MADV_DONTNEED);
+            }
+    };
+
+    // Reads whitespace separated numbers straight from the character range.
+    class number_scanner_t {
+        const char *cur_;
+        const char *end_;
+
+        void skip_spaces() {
+            while (cur_ != end_ && (*cur_ == ' ' || *cur_ == '\n' || *cur_ == '\t' ||
+                                    *cur_ == '\r' || *cur_ == '\v' || *cur_ == '\f')) cur_++;
+
+            if (cur_ != end_ && *cur_ == '+') cur_++;
+        }
+
+        public:
+            number_scanner_t(const char *begin, const char *end) : cur_(begin), end_(end) {}
+
+            const char *pos() const { return cur_; }
+
+            template <typename num_t>
+            bool next(num_t &num) {
+                skip_spaces();
+
+                auto res = std::from_chars(cur_, end_, num);
+                if (res.ec != std::errc{}) return false;
+
+                cur_ = res.ptr;
+                return true;
+            }
+    };
+
+    // Calls on_amount with the triangles amount of a text scene, then on_triangle
+    // with the 9 coordinates of every triangle. Parsed pages are released.
+    template <typename amount_func_t, typename tr_func_t>
+    read_status_t scan_text_triangles(const scene_source_t &src, amount_func_t on_amount, tr_func_t on_triangle) {
+        number_scanner_t scanner{src.begin(), src.end()};
+        const char *released = src.begin();
+        int tr_num = 0;
+
+        if (!scanner.next(tr_num) || tr_num < 0) return BAD_AMOUNT;
+
+        on_amount(tr_num);
+
+        for (int i = 0; i < tr_num; i++) {
+            double c[9];
+
+            for (int j = 0; j < 9; j++)
+                if (!scanner.next(c[j])) return BAD_COORDS;
+
+            on_triangle(c);
+
+            if (i % RELEASE_TRS == RELEASE_TRS - 1) {
+                src.release(released, scanner.pos());
+                released = scanner.pos();
+            }
+        }
+        return READ_OK;
+    }
+
+    // A text scene has no bounds, they are taken by get_bounds.
+    inline read_status_t read_text_triangles(const scene_source_t &src, std::vector<triangle_t> &trs) {
+        auto on_amount = [&](int tr_num) { trs.reserve(tr_num); };
+
+        return scan_text_triangles(src, on_amount, [&](const double (&c)[9]) {
+            trs.emplace_back(point_t{c[0], c[1], c[2]}, point_t{c[3], c[4], c[5]}, point_t{c[6], c[7], c[8]});
+        });
+    }
+
+    // Writes a binary scene of the triangles given as 9 coordinates each.
+    template <typename scalar_t>
+    bool write_binary_scene(FILE *out, const std::vector<double> &crds, const max_min_crds_t &bounds) {
+        scene_header_t header;
+
+        std::memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+        header.version     = SCENE_VERSION;
+        header.scalar_size = sizeof(scalar_t);
+        header.count       = crds.size() / 9;
+        header.bounds      = bounds;
+
+        if (std::fwrite(&header, sizeof(header), 1, out) != 1) return false;
+
+        std::vector<scalar_t> data(crds.begin(), crds.end());
+        return std::fwrite(data.data(), sizeof(scalar_t), data.size(), out) == data.size();
+    }
+
+    inline bool is_binary_scene(const scene_source_t &src) {
+        return src.end() - src.begin() >= static_cast<long>(sizeof(SCENE_MAGIC)) &&
+               !std::memcmp(src.begin(), SCENE_MAGIC, sizeof(SCENE_MAGIC));
+    }
+
+    template <typename scalar_t>
+    void load_binary_triangles(const scalar_t *c, uint64_t count, std::vector<triangle_t> &trs) {
+        trs.reserve(count);
+
+        for (uint64_t i = 0; i < count; i++, c += 9)
+            trs.emplace_back(point_t{c[0], c[1], c[2]}, point_t{c[3], c[4], c[5]}, point_t{c[6], c[7], c[8]});
+    }
+
+    inline read_status_t read_scene_header(const scene_source_t &src, scene_header_t &header) {
+        size_t sz = src.end() - src.begin();
+        if (sz < sizeof(scene_header_t)) return BAD_BINARY;
+
+        std::memcpy(&header, src.begin(), sizeof(header));
+
+        if (header.version != SCENE_VERSION) return BAD_BINARY;
+        if (header.scalar_size != sizeof(double) && header.scalar_size != sizeof(float)) return BAD_BINARY;
+        if (header.count > (sz - sizeof(header)) / (9 * header.scalar_size)) return BAD_BINARY;
+
+        return READ_OK;
+    }
+
+    template <typename scalar_t, typename tr_func_t>
+    void scan_binary_coords(const scene_source_t &src, const scalar_t *c, uint64_t count, tr_func_t on_triangle) {
+        const char *released = src.begin();
+
+        for (uint64_t i = 0; i < count; i++, c += 9) {
+            double crds[9];
+
+            std::copy(c, c + 9, crds);
+            on_triangle(crds);
+
+            if (i % RELEASE_TRS == RELEASE_TRS - 1) {
+                src.release(released, reinterpret_cast<const char *>(c + 9));
+                released = reinterpret_cast<const char *>(c + 9);
+            }
+        }
+    }
+
+    // Same calls as scan_text_triangles for a binary scene, the amount is passed
+    // with the bounds from the header.
+    template <typename amount_func_t, typename tr_func_t>
+    read_status_t scan_binary_triangles(const scene_source_t &src, amount_func_t on_amount, tr_func_t on_triangle) {
+        scene_header_t header;
+        if (read_scene_header(src, header) != READ_OK) return BAD_BINARY;
+
+        on_amount(header.count, header.bounds);
+
+        const char *data = src.begin() + sizeof(header);
+
+        if (header.scalar_size == sizeof(double))
+            scan_binary_coords(src, reinterpret_cast<const double *>(data), header.count, on_triangle);
+        else
+            scan_binary_coords(src, reinterpret_cast<const float *>(data), header.count, on_triangle);
+
+        return READ_OK;
+    }
+
+    // Triangles are built straight from the mapped coordinates, the bounds come
+    // from the header.
+    inline read_status_t read_binary_triangles(const scene_source_t &src, std::vector<triangle_t> &trs,
+                                               max_min_crds_t &crds) {
+        scene_header_t header;
+        if (read_scene_header(src, header) != READ_OK) return BAD_BINARY;
+
+        crds = header.bounds;
+        const char *data = src.begin() + sizeof(header);
+
+        if (header.scalar_size == sizeof(double))
+            load_binary_triangles(reinterpret_cast<const double *>(data), header.count, trs);
+        else
+            load_binary_triangles(reinterpret_cast<const float *>(data), header.count, trs);
+
+        return READ_OK;
+    }
+
+    inline max_min_crds_t get_bounds(const std::vector<triangle_t> &trs) {
+        max_min_crds_t crds;
+
+        for (const triangle_t &tr : trs)
+            for (int i = 0; i < 3; i++) {
+                const point_t &pnt = tr.get_pnt(i);
+                crds.update(pnt.x_, pnt.y_, pnt.z_);
+            }
+        return crds;
+    }
+
+    // Bounds are filled from the header of a binary scene only.
+    inline read_status_t read_triangles(const scene_source_t &src, std::vector<triangle_t> &trs,
+                                        max_min_crds_t &crds) {
+        if (is_binary_scene(src)) return read_binary_triangles(src, trs, crds);
+
+        return read_text_triangles(src, trs);
+    }
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Hot-path counters are compiled in only with TRIANGLES_STATS defined, otherwise
+// STATS_ADD and STATS_EXACT expand to nothing. Phase timers and tree shape are
+// always available, they are taken once per run.
+#ifdef TRIANGLES_STATS
+    #define STATS_ADD(counter, num) ::stats::add(::stats::counter, num)
+    #define STATS_EXACT(type1, type2) ::stats::add_exact(type1, type2)
+#else
+    #define STATS_ADD(counter, num) do {} while (0)
+    #define STATS_EXACT(type1, type2) do {} while (0)
+#endif
+
+namespace stats {
+
+    const int TYPES_NUM = 3;
+
+    const char *const TYPE_NAMES[TYPES_NUM] = {"trian", "line", "point"};
+
+    enum counter_t {CANDIDATE_PAIRS, SPHERE_REJECTS, PLANE_REJECTS, EXACT_TESTS,
+                    COUNTERS_NUM = EXACT_TESTS + TYPES_NUM * TYPES_NUM};
+
+    enum phase_t {PARSE, BOUNDS, BUILD, QUERY, OUTPUT, PHASES_NUM};
+
+    const char *const PHASE_NAMES[PHASES_NUM] = {"parse", "bounds", "build", "query", "output"};
+
+    struct counters_t {
+        uint64_t vals[COUNTERS_NUM] = {};
+    };
+
+    // Every thread counts into its own block, blocks are summed once the query
+    // threads are joined.
+    class registry_t {
+        std::mutex mutex_;
+        std::deque<counters_t> blocks_;
+
+        public:
+            counters_t &get_block() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return blocks_.emplace_back();
+            }
+
+            counters_t get_totals() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                counters_t totals;
+
+                for (const counters_t &block : blocks_)
+                    for (int i = 0; i < COUNTERS_NUM; ++i) totals.vals[i] += block.vals[i];
+                return totals;
+            }
+    };
+
+    inline registry_t &get_registry() {
+        static registry_t registry;
+        return registry;
+    }
+
+    inline void add(counter_t counter, uint64_t num) {
+        thread_local counters_t &block = get_registry().get_block();
+        block.vals[counter] += num;
+    }
+
+    inline void add_exact(int type1, int type2) {
+        add(static_cast<counter_t>(EXACT_TESTS + type1 * TYPES_NUM + type2), 1);
+    }
+
+    // Wall time of the phases of one run, each stop() closes the current phase.
+    class phase_timer_t {
+        using timer_clock_t = std::chrono::steady_clock;
+
+        timer_clock_t::time_point start_ = timer_clock_t::now();
+        double secs_[PHASES_NUM] = {};
+
+        public:
+            void stop(phase_t phase) {
+                timer_clock_t::time_point now = timer_clock_t::now();
+
+                secs_[phase] += std::chrono::duration<double>(now - start_).count();
+                start_ = now;
+            }
+
+            double get(phase_t phase) const { return secs_[phase]; }
+    };
+
+    // Shape of a broad phase index. occupancy[0] counts nodes without own
+    // triangles, occupancy[k] nodes with [2^(k - 1), 2^k) of them; empty
+    // buckets are left out of the report.
+    struct shape_stats_t {
+        uint32_t depth = 0;
+        uint64_t nodes = 0;
+        uint64_t interior_trs = 0;
+        std::vector<uint64_t> occupancy;
+
+        void add_node(uint32_t node_depth, uint64_t trs_num, bool is_interior) {
+            size_t bucket = 0;
+            while (trs_num >> bucket) bucket++;
+
+            if (occupancy.size() <= bucket) occupancy.resize(bucket + 1);
+            occupancy[bucket]++;
+
+            nodes++;
+            if (node_depth > depth) depth = node_depth;
+            if (is_interior) interior_trs += trs_num;
+        }
+
+        // Sums the shapes of indices built one after another, as for the tiles of a tiled query.
+        void add(const shape_stats_t &shape) {
+            if (occupancy.size() < shape.occupancy.size()) occupancy.resize(shape.occupancy.size());
+            for (size_t k = 0; k < shape.occupancy.size(); ++k) occupancy[k] += shape.occupancy[k];
+
+            nodes        += shape.nodes;
+            interior_trs += shape.interior_trs;
+            depth         = std::max(depth, shape.depth);
+        }
+    };
+
+    inline void write_report(FILE *out, const char *engine, size_t trs_num, const phase_timer_t &timer,
+                             const shape_stats_t &shape) {
+        std::fprintf(out, "{\n  \"engine\": \"%s\",\n  \"triangles\": %zu,\n  \"phases_sec\": {", engine, trs_num);
+        for (int i = 0; i < PHASES_NUM; ++i)
+            std::fprintf(out, "%s\"%s\": %.6f", i ? ", " : "", PHASE_NAMES[i], timer.get(static_cast<phase_t>(i)));
+
+        std::fprintf(out, "},\n  \"tree\": {\"depth\": %u, \"nodes\": %llu, \"interior_triangles\": %llu, "
+                          "\"occupancy\": {", shape.depth, static_cast<unsigned long long>(shape.nodes),
+                     static_cast<unsigned long long>(shape.interior_trs));
+        const char *sep = "";
+        for (size_t k = 0; k < shape.occupancy.size(); ++k) {
+            if (!shape.occupancy[k]) continue;
+
+            unsigned long long lo = k ? 1ull << (k - 1) : 0, hi = k ? (1ull << k) - 1 : 0;
+
+            if (lo == hi) std::fprintf(out, "%s\"%llu\": ", sep, lo);
+            else          std::fprintf(out, "%s\"%llu-%llu\": ", sep, lo, hi);
+            std::fprintf(out, "%llu", static_cast<unsigned long long>(shape.occupancy[k]));
+            sep = ", ";
+        }
+        std::fprintf(out, "}},\n");
+
+    #ifdef TRIANGLES_STATS
+        counters_t totals = get_registry().get_totals();
+
+        std::fprintf(out, "  \"counters\": {\"candidate_pairs\": %llu, \"sphere_rejects\": %llu, "
+                          "\"plane_rejects\": %llu, \"exact_tests\": {",
+                     static_cast<unsigned long long>(totals.vals[CANDIDATE_PAIRS]),
+                     static_cast<unsigned long long>(totals.vals[SPHERE_REJECTS]),
+                     static_cast<unsigned long long>(totals.vals[PLANE_REJECTS]));
+        for (int i = 0; i < TYPES_NUM * TYPES_NUM; ++i)
+            std::fprintf(out, "%s\"%s-%s\": %llu", i ? ", " : "", TYPE_NAMES[i / TYPES_NUM],
+                         TYPE_NAMES[i % TYPES_NUM], static_cast<unsigned long long>(totals.vals[EXACT_TESTS + i]));
+        std::fprintf(out, "}}\n}\n");
+    #else
+        std::fprintf(out, "  \"counters\": null\n}\n");
+    #endif
+    }
+}
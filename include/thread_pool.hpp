@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace thread_pool {
+
+    // Run-to-completion pool: every worker owns a deque, pops its own tasks from the
+    // back and steals from the front of the others when it runs dry. Tasks may submit
+    // more tasks; run() returns once all of them have finished.
+    class work_stealing_pool_t {
+        public:
+            using task_t = std::function<void(work_stealing_pool_t &, int)>;
+
+        private:
+            struct queue_t {
+                std::mutex mtx_;
+                std::deque<task_t> tasks_;
+            };
+
+            std::vector<queue_t> queues_;
+            std::atomic<size_t> pending_{0};
+
+            bool pop(int worker, task_t &task) {
+                queue_t &queue = queues_[worker];
+                std::lock_guard<std::mutex> lock{queue.mtx_};
+
+                if (queue.tasks_.empty()) return false;
+
+                task = std::move(queue.tasks_.back());
+                queue.tasks_.pop_back();
+                return true;
+            }
+
+            bool steal(int thief, task_t &task) {
+                int sz = size();
+
+                for (int i = 1; i < sz; ++i) {
+                    queue_t &queue = queues_[(thief + i) % sz];
+                    std::lock_guard<std::mutex> lock{queue.mtx_};
+
+                    if (queue.tasks_.empty()) continue;
+
+                    task = std::move(queue.tasks_.front());
+                    queue.tasks_.pop_front();
+                    return true;
+                }
+                return false;
+            }
+
+            void work(int worker) {
+                task_t task;
+
+                while (pending_.load() != 0) {
+                    if (pop(worker, task) || steal(worker, task)) {
+                        task(*this, worker);
+                        pending_.fetch_sub(1);
+                    }
+                    else std::this_thread::yield();
+                }
+            }
+
+        public:
+            explicit work_stealing_pool_t(int threads) : queues_(threads < 1 ? 1 : threads) {}
+
+            work_stealing_pool_t(const work_stealing_pool_t& pool)            = delete;
+            work_stealing_pool_t& operator=(const work_stealing_pool_t& pool) = delete;
+
+            int size() const { return queues_.size(); }
+
+            void submit(int worker, task_t task) {
+                pending_.fetch_add(1);
+
+                queue_t &queue = queues_[worker];
+                std::lock_guard<std::mutex> lock{queue.mtx_};
+                queue.tasks_.push_back(std::move(task));
+            }
+
+            void run() {
+                std::vector<std::thread> threads;
+
+                for (int i = 1; i < size(); ++i)
+                    threads.emplace_back(&work_stealing_pool_t::work, this, i);
+
+                work(0);
+
+                for (auto &thread : threads) thread.join();
+            }
+    };
+}
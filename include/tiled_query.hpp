@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include "hits.hpp"
+#include "scene_reader.hpp"
+
+// Out-of-core query for scenes that don't fit in memory. One pass over the
+// input takes the amount and the bounds, a second one buckets the triangles
+// into spatial tiles kept in a temporary file, then the tiles are queried one
+// by one, each with its own index. Tiles that come out too large are split
+// in eight before they are loaded.
+namespace tiles {
+
+    using namespace scene_reader;
+
+    const uint64_t MAX_TILES       = 4096;
+    const uint64_t MIN_TILE_TRS    = 1024;
+    const int      MAX_SPLIT_DEPTH = 6;
+
+    // Bounds on the amount of records a tile buffers before writing them out.
+    const size_t MIN_CHUNK_RECORDS = 64;
+    const size_t MAX_CHUNK_RECORDS = 4096;
+
+    // A triangle as the tile file stores it.
+    struct tile_record_t {
+        uint64_t id;
+        double   crds[9];
+    };
+
+    struct chunk_t {
+        uint64_t offset;
+        uint32_t records;
+    };
+
+    inline aabb_t get_grown_box(const aabb_t &box) {
+        return {box.x_min - EPS, box.y_min - EPS, box.z_min - EPS, box.x_max + EPS, box.y_max + EPS, box.z_max + EPS};
+    }
+
+    inline aabb_t get_grown_box(const tile_record_t &rec) {
+        const double *c = rec.crds;
+
+        return get_grown_box(aabb_t{std::min({c[0], c[3], c[6]}), std::min({c[1], c[4], c[7]}),
+                              std::min({c[2], c[5], c[8]}), std::max({c[0], c[3], c[6]}),
+                              std::max({c[1], c[4], c[7]}), std::max({c[2], c[5], c[8]})});
+    }
+
+    // Half-open part [lo, hi) of space. The outer tiles reach to infinity, so
+    // tiles split space without gaps and every point lies in a single tile.
+    struct region_t {
+        double lo[3] = {-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+                        -std::numeric_limits<double>::infinity()};
+        double hi[3] = {std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+                        std::numeric_limits<double>::infinity()};
+
+        bool contains(double x, double y, double z) const {
+            return lo[0] <= x && x < hi[0] && lo[1] <= y && y < hi[1] && lo[2] <= z && z < hi[2];
+        }
+
+        // True if the box holds a point of the region.
+        bool is_overlapped(const aabb_t &box) const {
+            return box.x_min < hi[0] && box.y_min < hi[1] && box.z_min < hi[2] &&
+                   box.x_max >= lo[0] && box.y_max >= lo[1] && box.z_max >= lo[2];
+        }
+    };
+
+    // The tile which owns an intersecting pair is the one holding the lowest
+    // corner of the overlap of their grown boxes. Both triangles are bucketed
+    // into it, so it finds the pair, and no other tile holds that corner.
+    inline bool is_pair_owned(const region_t &region, const aabb_t &box1, const aabb_t &box2) {
+        return region.contains(std::max(box1.x_min, box2.x_min), std::max(box1.y_min, box2.y_min),
+                               std::max(box1.z_min, box2.z_min));
+    }
+
+    // Unlinked temporary file in $TMPDIR or /tmp, records of every tile are
+    // appended to it in chunks.
+    class spill_file_t {
+        FILE *file_ = nullptr;
+        uint64_t size_ = 0;
+        bool ok_ = true;
+
+        public:
+            spill_file_t() {
+                const char *dir = std::getenv("TMPDIR");
+                std::string path = std::string{dir && *dir ? dir : "/tmp"} + "/triangles_tiles_XXXXXX";
+
+                int fd = mkstemp(path.data());
+                if (fd < 0) {
+                    ok_ = false;
+                    return;
+                }
+                unlink(path.c_str());
+
+                file_ = fdopen(fd, "w+b");
+                if (!file_) {
+                    close(fd);
+                    ok_ = false;
+                }
+            }
+
+            ~spill_file_t() {
+                if (file_) std::fclose(file_);
+            }
+
+            spill_file_t(const spill_file_t& file)            = delete;
+            spill_file_t& operator=(const spill_file_t& file) = delete;
+
+            bool is_ok() const { return ok_; }
+
+            chunk_t write(const tile_record_t *recs, uint32_t num) {
+                chunk_t chunk{size_, num};
+
+                ok_ = ok_ && !fseeko(file_, size_, SEEK_SET) && std::fwrite(recs, sizeof(*recs), num, file_) == num;
+                size_ += uint64_t{num} * sizeof(*recs);
+                return chunk;
+            }
+
+            bool read(const chunk_t &chunk, tile_record_t *recs) {
+                ok_ = ok_ && !fseeko(file_, chunk.offset, SEEK_SET) &&
+                      std::fread(recs, sizeof(*recs), chunk.records, file_) == chunk.records;
+                return ok_;
+            }
+    };
+
+    // Records of a tile are in the file chunks, the ones not yet written in buf.
+    struct tile_t {
+        region_t region;
+        int depth = 0;
+
+        uint64_t records = 0;
+        max_min_crds_t bounds;
+
+        std::vector<chunk_t> chunks;
+        std::vector<tile_record_t> buf;
+    };
+
+    class tiled_query_t {
+        spill_file_t spill_;
+
+        size_t memory_limit_;
+        size_t tr_bytes_;
+
+        uint64_t trs_num_ = 0;
+        max_min_crds_t crds_;
+
+        uint64_t max_tile_trs_  = 0;
+        size_t   chunk_records_ = MIN_CHUNK_RECORDS;
+
+        // Top level grid; tiles_ is a stack of the tiles left to query.
+        int dims_[3] = {1, 1, 1};
+        double cell_[3] = {};
+        std::vector<tile_t> tiles_;
+
+        void flush(tile_t &tile) {
+            if (tile.buf.empty()) return;
+
+            tile.chunks.push_back(spill_.write(tile.buf.data(), tile.buf.size()));
+            tile.buf.clear();
+        }
+
+        void put(tile_t &tile, const tile_record_t &rec, const aabb_t &box) {
+            tile.buf.push_back(rec);
+            tile.records++;
+            tile.bounds.update(box.x_min, box.y_min, box.z_min);
+            tile.bounds.update(box.x_max, box.y_max, box.z_max);
+
+            if (tile.buf.size() >= chunk_records_) flush(tile);
+        }
+
+        // Range of grid cells along the axis a box from lo to hi may touch,
+        // widened by a cell as the regions, not this estimate, decide.
+        std::pair<int, int> get_cells(int axis, double lo, double hi, double min) const {
+            auto get_cell = [&](double val) {
+                double pos = (val - min) / cell_[axis];
+
+                if (!(pos >= 0)) return 0;
+                if (pos >= dims_[axis]) return dims_[axis] - 1;
+                return static_cast<int>(pos);
+            };
+
+            if (dims_[axis] == 1) return {0, 0};
+            return {std::max(get_cell(lo) - 1, 0), std::min(get_cell(hi) + 1, dims_[axis] - 1)};
+        }
+
+        void bucket_record(const tile_record_t &rec) {
+            aabb_t box = get_grown_box(rec);
+
+            auto [x_first, x_last] = get_cells(0, box.x_min, box.x_max, crds_.x_min);
+            auto [y_first, y_last] = get_cells(1, box.y_min, box.y_max, crds_.y_min);
+            auto [z_first, z_last] = get_cells(2, box.z_min, box.z_max, crds_.z_min);
+
+            for (int z = z_first; z <= z_last; ++z)
+                for (int y = y_first; y <= y_last; ++y)
+                    for (int x = x_first; x <= x_last; ++x) {
+                        tile_t &tile = tiles_[(z * dims_[1] + y) * dims_[0] + x];
+                        if (tile.region.is_overlapped(box)) put(tile, rec, box);
+                    }
+        }
+
+        // Splits the tile in two along every axis its records spread over. Gives
+        // up if some part would take all of the records anyway.
+        bool split(const tile_t &tile) {
+            double mids[3];
+            double los[3] = {tile.bounds.x_min, tile.bounds.y_min, tile.bounds.z_min},
+                   his[3] = {tile.bounds.x_max, tile.bounds.y_max, tile.bounds.z_max};
+
+            for (int a = 0; a < 3; ++a)
+                mids[a] = (std::max(tile.region.lo[a], los[a]) + std::min(tile.region.hi[a], his[a])) / 2;
+
+            std::vector<tile_t> parts(1);
+            parts[0].region = tile.region;
+
+            for (int a = 0; a < 3; ++a) {
+                if (!(tile.region.lo[a] < mids[a] && mids[a] < tile.region.hi[a])) continue;
+
+                size_t sz = parts.size();
+                for (size_t i = 0; i < sz; ++i) {
+                    parts.push_back(parts[i]);
+                    parts[i].region.hi[a] = mids[a];
+                    parts.back().region.lo[a] = mids[a];
+                }
+            }
+            if (parts.size() == 1) return false;
+
+            std::vector<tile_record_t> recs(chunk_records_);
+
+            for (const chunk_t &chunk : tile.chunks) {
+                if (!spill_.read(chunk, recs.data())) return false;
+
+                for (uint32_t i = 0; i < chunk.records; ++i) {
+                    aabb_t box = get_grown_box(recs[i]);
+
+                    for (tile_t &part : parts)
+                        if (part.region.is_overlapped(box)) put(part, recs[i], box);
+                }
+            }
+
+            uint64_t max_records = 0;
+            for (tile_t &part : parts) {
+                flush(part);
+                part.depth = tile.depth + 1;
+                max_records = std::max(max_records, part.records);
+            }
+            if (max_records == tile.records) return false;
+
+            for (tile_t &part : parts)
+                if (part.records) tiles_.push_back(std::move(part));
+            return true;
+        }
+
+        void load(const tile_t &tile, std::vector<triangle_t> &trs, std::vector<uint32_t> &ids,
+                  max_min_crds_t &crds) {
+            std::vector<tile_record_t> recs(chunk_records_);
+
+            trs.clear();
+            ids.clear();
+            trs.reserve(tile.records);
+            ids.reserve(tile.records);
+            crds = {};
+
+            for (const chunk_t &chunk : tile.chunks) {
+                if (!spill_.read(chunk, recs.data())) return;
+
+                for (uint32_t i = 0; i < chunk.records; ++i) {
+                    const double *c = recs[i].crds;
+
+                    trs.emplace_back(point_t{c[0], c[1], c[2]}, point_t{c[3], c[4], c[5]},
+                                     point_t{c[6], c[7], c[8]});
+                    ids.push_back(recs[i].id);
+
+                    for (int j = 0; j < 9; j += 3) crds.update(c[j], c[j + 1], c[j + 2]);
+                }
+            }
+        }
+
+        public:
+            // tr_bytes is the peak memory the index of the chosen engine takes per
+            // triangle with the triangle. The limit bounds the data of the query,
+            // the few MiB the program itself is resident with are not counted.
+            tiled_query_t(size_t memory_limit, size_t tr_bytes) : memory_limit_(memory_limit), tr_bytes_(tr_bytes) {}
+
+            tiled_query_t(const tiled_query_t& query)            = delete;
+            tiled_query_t& operator=(const tiled_query_t& query) = delete;
+
+            uint64_t size() const { return trs_num_; }
+
+            // The first pass. A binary scene has both in the header.
+            read_status_t scan_bounds(const scene_source_t &src) {
+                if (is_binary_scene(src)) {
+                    scene_header_t header;
+                    if (read_scene_header(src, header) != READ_OK) return BAD_BINARY;
+
+                    trs_num_ = header.count;
+                    crds_    = header.bounds;
+                }
+                else {
+                    read_status_t status = scan_text_triangles(src, [&](int tr_num) { trs_num_ = tr_num; },
+                                                               [&](const double (&c)[9]) {
+                        for (int j = 0; j < 9; j += 3) crds_.update(c[j], c[j + 1], c[j + 2]);
+                    });
+                    if (status != READ_OK) return status;
+                }
+
+                return trs_num_ > std::numeric_limits<uint32_t>::max() ? BAD_AMOUNT : READ_OK;
+            }
+
+            // Sizes the tiles so that each one with its index fits in what the
+            // limit leaves after the answer bitmap. False if that is too little
+            // for tiles of MIN_TILE_TRS triangles, or for the whole scene if it
+            // is smaller.
+            bool set_tiles() {
+                size_t fixed = trs_num_ / 8;
+                if (memory_limit_ <= fixed) return false;
+
+                size_t avail = memory_limit_ - fixed;
+
+                max_tile_trs_ = avail / (tr_bytes_ + sizeof(uint32_t));
+                if (max_tile_trs_ < std::min(MIN_TILE_TRS, trs_num_)) return false;
+
+                // Tiles are planned three quarters full, triangles crossing borders go to every tile they touch.
+                uint64_t tiles_num = std::clamp<uint64_t>((trs_num_ * 4 / 3 + max_tile_trs_ - 1) / max_tile_trs_,
+                                                          1, MAX_TILES);
+
+                double extents[3] = {crds_.x_max - crds_.x_min, crds_.y_max - crds_.y_min, crds_.z_max - crds_.z_min};
+
+                for (uint64_t num = 1; num < tiles_num;) {
+                    int axis = 0;
+                    for (int a = 1; a < 3; ++a)
+                        if (extents[a] / dims_[a] > extents[axis] / dims_[axis]) axis = a;
+
+                    if (!(extents[axis] > 0)) break;
+
+                    num = num / dims_[axis] * (dims_[axis] + 1);
+                    dims_[axis]++;
+                }
+
+                double mins[3] = {crds_.x_min, crds_.y_min, crds_.z_min};
+                for (int a = 0; a < 3; ++a) cell_[a] = extents[a] / dims_[a];
+
+                size_t tiles_sz = size_t{1} * dims_[0] * dims_[1] * dims_[2];
+                chunk_records_  = std::clamp(avail / 2 / tiles_sz / sizeof(tile_record_t),
+                                             MIN_CHUNK_RECORDS, MAX_CHUNK_RECORDS);
+
+                tiles_.resize(tiles_sz);
+                for (int z = 0; z < dims_[2]; ++z)
+                    for (int y = 0; y < dims_[1]; ++y)
+                        for (int x = 0; x < dims_[0]; ++x) {
+                            region_t &region = tiles_[(z * dims_[1] + y) * dims_[0] + x].region;
+                            int cells[3] = {x, y, z};
+
+                            for (int a = 0; a < 3; ++a) {
+                                if (cells[a] > 0)             region.lo[a] = mins[a] + cells[a] * cell_[a];
+                                if (cells[a] < dims_[a] - 1)  region.hi[a] = mins[a] + (cells[a] + 1) * cell_[a];
+                            }
+                        }
+                return true;
+            }
+
+            // The second pass, every triangle goes to each tile its grown box touches.
+            read_status_t bucket(const scene_source_t &src) {
+                uint64_t id = 0;
+
+                auto on_triangle = [&](const double (&c)[9]) {
+                    tile_record_t rec{id++, {}};
+
+                    std::copy(c, c + 9, rec.crds);
+                    bucket_record(rec);
+                };
+
+                read_status_t status = is_binary_scene(src) ?
+                    scan_binary_triangles(src, [](uint64_t, const max_min_crds_t &) {}, on_triangle) :
+                    scan_text_triangles(src, [](int) {}, on_triangle);
+
+                for (tile_t &tile : tiles_) {
+                    flush(tile);
+                    tile.buf.shrink_to_fit();
+                }
+
+                tiles_.erase(std::remove_if(tiles_.begin(), tiles_.end(),
+                                            [](const tile_t &tile) { return !tile.records; }), tiles_.end());
+                return status;
+            }
+
+            // Calls func with the triangles and the bounds of every tile, the hits
+            // it reports are taken to scene ids. False if the tile file failed.
+            template <typename func_t>
+            bool for_each_tile(hits_t &ans, func_t func) {
+                std::vector<triangle_t> trs;
+                std::vector<uint32_t> ids;
+                max_min_crds_t crds;
+
+                while (!tiles_.empty() && !ans.is_stopped() && spill_.is_ok()) {
+                    tile_t tile = std::move(tiles_.back());
+                    tiles_.pop_back();
+
+                    if (tile.records > max_tile_trs_ && tile.depth < MAX_SPLIT_DEPTH && split(tile)) continue;
+
+                    load(tile, trs, ids, crds);
+                    if (!spill_.is_ok()) break;
+
+                    ans.set_tile(ids.data(), [&trs, &region = tile.region](size_t id1, size_t id2) {
+                        return is_pair_owned(region, get_grown_box(trs[id1].get_aabb()),
+                                             get_grown_box(trs[id2].get_aabb()));
+                    });
+                    func(trs, crds);
+                    ans.clear_tile();
+                }
+                return spill_.is_ok();
+            }
+    };
+}
@@ -1,29 +1,42 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include "geometry.hpp"
 #include "double_funcs.hpp"
+#include "predicates.hpp"
+#include "stats.hpp"
 
 namespace triangles {
 
 using namespace geometry;
 using namespace double_funcs;
 
+// Compact record: the vertices plus what the broad phase needs. Segments, lines
+// and the plane are derived from the vertices inside the narrow phase only.
 class triangle_t {
-    enum tr_types_t {TRIAN, LINE, POINT};
+    public:
+        enum tr_types_t : unsigned char {TRIAN, LINE, POINT};
 
+    private:
     using PntArr = typename std::array<point_t, 3>;
     using SegArr = typename std::array<line_segment_t, 3>;
 
     PntArr pnts;
-    SegArr segs;
-    plane_t pln;
-    point_t cntr;
 
-    tr_types_t type;
+    double dist_radius;
+
+    // type and longest_seg_id are decided with the EPS tests of the classic
+    // engine, exact_type and end_seg_id with the exact predicates of the fast one.
+    tr_types_t type, exact_type;
+    unsigned char longest_seg_id, end_seg_id;
+
+    line_segment_t get_seg(int i) const { return {pnts[i], pnts[(i + 1) % 3]}; }
+
+    SegArr get_segs() const { return {get_seg(0), get_seg(1), get_seg(2)}; }
 
-    int longest_seg_id;
-    const double dist_radius;
+    plane_t get_pln() const { return {pnts[0], pnts[1], pnts[2]}; }
 
     bool is_not_inter_pln(const plane_t &pl) const {
             double pnt1_pos = pl.get_pnt_pos(pnts[0]),
@@ -35,24 +48,25 @@ class triangle_t {
                    (pnt1_pos < 0 && pnt2_pos < 0 && pnt3_pos < 0);
         }
 
-    bool is_intersected_on_same_pln(const triangle_t &tr) const {
+    bool is_intersected_on_same_pln(const triangle_t &tr, const plane_t &pln) const {
+        SegArr segs = get_segs(), tr_segs = tr.get_segs();
+
         for (int i = 0; i < 3; i++) {
             for (int j = 0; j < 3; j++) {
-                if (segs[i].is_ln_seg_intersected(tr.segs[j]))
+                if (segs[i].is_ln_seg_intersected(tr_segs[j]))
                     return true;
             }
         }
 
-        return is_pnt_inside_tr(tr.pnts[0]) || tr.is_pnt_inside_tr(pnts[0]);
+        return is_pnt_inside_tr(tr.pnts[0], segs, pln.norm_vec) ||
+               tr.is_pnt_inside_tr(pnts[0], tr_segs, tr.get_pln().norm_vec);
     }
 
-    bool is_pnt_inside_tr(const point_t &pnt) const {
+    bool is_pnt_inside_tr(const point_t &pnt, const SegArr &segs, const vector_t &norm_vec) const {
         vector_t pnt_vecs[3] = {{pnt, pnts[0]}, {pnt, pnts[1]}, {pnt, pnts[2]}};
 
         bool is_in_11 = true, is_in_12 = true;
 
-        vector_t norm_vec = pln.norm_vec;
-
         for (int i = 0; i < 3; i++) {
                 bool is_dir = (pnt_vecs[i] * segs[i].line.dir_vec).is_co_dir(norm_vec);
                 is_in_11 = is_in_11 &&  is_dir;
@@ -61,8 +75,8 @@ class triangle_t {
         return is_in_11 || is_in_12;
     }
 
-    bool is_intersected_on_inter_pln(const triangle_t &tr) const {
-        line_t inter_line = pln.get_intersection(tr.pln);
+    bool is_intersected_on_inter_pln(const triangle_t &tr, const plane_t &pln) const {
+        line_t inter_line = pln.get_intersection(tr.get_pln());
 
         line_segment_t inter_tr1 = get_line_intersection(inter_line),
                        inter_tr2 = tr.get_line_intersection(inter_line);
@@ -82,9 +96,9 @@ class triangle_t {
     }
 
     line_segment_t get_line_intersection(const line_t& ln) const {
-        line_segment_t inter_12 = segs[0].get_line_intersection(ln),
-                       inter_23 = segs[1].get_line_intersection(ln),
-                       inter_31 = segs[2].get_line_intersection(ln);
+        line_segment_t inter_12 = get_seg(0).get_line_intersection(ln),
+                       inter_23 = get_seg(1).get_line_intersection(ln),
+                       inter_31 = get_seg(2).get_line_intersection(ln);
 
         if (inter_12.is_valid() && !inter_12.is_zero_len())
             return inter_12;
@@ -103,21 +117,7 @@ class triangle_t {
         return {};
     }
 
-    bool trs_intersect(const triangle_t &tr) const {
-        if (tr.is_not_inter_pln(pln)) return false;
-
-        if (equal(pln.get_pnt_pos(tr.pnts[0]), 0) &&
-            equal(pln.get_pnt_pos(tr.pnts[1]), 0) &&
-            equal(pln.get_pnt_pos(tr.pnts[2]), 0))
-                return is_intersected_on_same_pln(tr);
-        return is_intersected_on_inter_pln(tr);
-    }
-
-    bool segs_intersect(const triangle_t &tr) const {
-        return segs[longest_seg_id].is_ln_seg_intersected(tr.segs[tr.longest_seg_id]);
-    }
-
-    int find_longest_seg() const {
+    static int find_longest_seg(const SegArr &segs) {
         int longest_i = 0;
         if (segs[1].len() > segs[longest_i].len()) longest_i = 1;
         if (segs[2].len() > segs[longest_i].len()) longest_i = 2;
@@ -125,83 +125,192 @@ class triangle_t {
         return longest_i;
     }
 
-    bool tr_pnt_intersect(const triangle_t &tr) const {
-        double pnt_pos = pln.get_pnt_pos(tr.pnts[0]);
-
-        if (!equal(pnt_pos, 0)) return false;
+    static double get_crd(const point_t &pnt, int axis) { return axis == 0 ? pnt.x_ : axis == 1 ? pnt.y_ : pnt.z_; }
 
-        return is_pnt_inside_tr(tr.pnts[0]);
+    bool is_same_pnt(int i, int j) const {
+        return pnts[i].x_ == pnts[j].x_ && pnts[i].y_ == pnts[j].y_ && pnts[i].z_ == pnts[j].z_;
     }
 
-    bool tr_seg_intersect(const triangle_t &tr) const {
-        line_segment_t seg = tr.segs[tr.longest_seg_id];
+    // A triangle is flat iff its normal is exactly zero, that is iff all three
+    // projections along the axes have exactly zero area.
+    tr_types_t find_exact_type() const {
+        if (is_same_pnt(0, 1) && is_same_pnt(1, 2)) return POINT;
 
-        double pnt1_pos = pln.get_pnt_pos(seg.pnt1),
-               pnt2_pos = pln.get_pnt_pos(seg.pnt2);
+        for (int axis = 0; axis < 3; axis++) {
+            int u = (axis + 1) % 3, v = (axis + 2) % 3;
+            double us[3] = {get_crd(pnts[0], u), get_crd(pnts[1], u), get_crd(pnts[2], u)},
+                   vs[3] = {get_crd(pnts[0], v), get_crd(pnts[1], v), get_crd(pnts[2], v)};
 
-        if ((pnt1_pos > 0 && pnt2_pos > 0) || (pnt1_pos < 0 && pnt2_pos < 0)) return false;
+            if (predicates::orient2d(us[0], vs[0], us[1], vs[1], us[2], vs[2]) != 0) return TRIAN;
+        }
+        return LINE;
+    }
 
-        if (equal(pnt1_pos, 0) && equal(pnt2_pos, 0))
-            return segs[0].is_ln_seg_intersected(seg) ||
-                   segs[1].is_ln_seg_intersected(seg) ||
-                   segs[2].is_ln_seg_intersected(seg) || is_pnt_inside_tr(seg.pnt1);
+    // Edge between the extreme vertices of an exactly collinear figure along the
+    // axis of its largest extent, which holds the third vertex whatever the
+    // rounding of the edge lengths.
+    int find_end_seg() const {
+        int axis = 0;
+        double extent = -1;
 
-        point_t inter_pnt = pln.get_intersection(seg.line);
+        for (int k = 0; k < 3; k++) {
+            double crds[3] = {get_crd(pnts[0], k), get_crd(pnts[1], k), get_crd(pnts[2], k)};
+            double len = std::max({crds[0], crds[1], crds[2]}) - std::min({crds[0], crds[1], crds[2]});
 
-        return is_pnt_inside_tr(inter_pnt);
-    }
+            if (len > extent) { axis = k; extent = len; }
+        }
 
-    bool seg_pnt_intersect(const triangle_t &tr) const {
-        line_segment_t seg = segs[longest_seg_id];
-        point_t pnt = tr.pnts[0];
+        int first = 0, last = 0;
+        for (int i = 1; i < 3; i++) {
+            if (get_crd(pnts[i], axis) < get_crd(pnts[first], axis)) first = i;
+            if (get_crd(pnts[i], axis) > get_crd(pnts[last], axis))  last = i;
+        }
 
-        if (seg.line.is_pnt_on_line(pnt))
-            return seg.is_line_pnt_on_ln_seg(pnt);
-        return false;
+        return last == (first + 1) % 3 ? first : last;
     }
 
     public:
         triangle_t(const point_t &pnt1, const point_t &pnt2, const point_t &pnt3) :
-            pnts({pnt1, pnt2, pnt3}),
-            segs({{{pnt1, pnt2}, {pnt2, pnt3}, {pnt3, pnt1}}}),
-            pln(pnt1, pnt2, pnt3),
-            cntr((pnt1.x_ + pnt2.x_ + pnt3.x_) / 3,
-                 (pnt1.y_ + pnt2.y_ + pnt3.y_) / 3,
-                 (pnt1.z_ + pnt2.z_ + pnt3.z_) / 3),
-            longest_seg_id(find_longest_seg()),
-            dist_radius(segs[longest_seg_id].len()) {
+            pnts({pnt1, pnt2, pnt3}) {
+                SegArr segs = get_segs();
+
+                longest_seg_id = find_longest_seg(segs);
+                dist_radius    = segs[longest_seg_id].len();
 
                 if (!segs[0].line.dir_vec.is_collinear(segs[1].line.dir_vec)) type = TRIAN;
                 else if (pnts[0] == pnts[1] && pnts[1] == pnts[2])            type = POINT;
                 else                                                          type = LINE;
+
+                exact_type = find_exact_type();
+                end_seg_id = exact_type == LINE ? find_end_seg() : longest_seg_id;
             }
 
         bool is_intersected(const triangle_t &tr) const {
             double dist_max_intersect = (dist_radius + tr.dist_radius);
 
-            if (vector_t{cntr, tr.cntr}.len() > dist_max_intersect) return false;
+            if (vector_t{get_cntr(), tr.get_cntr()}.len() > dist_max_intersect) {
+                STATS_ADD(SPHERE_REJECTS, 1);
+                return false;
+            }
+
+            STATS_EXACT(type, tr.type);
+
+            const point_t &seg1 = get_longest_pnt1(), &seg2 = get_longest_pnt2(),
+                          &tr_seg1 = tr.get_longest_pnt1(), &tr_seg2 = tr.get_longest_pnt2();
 
             if (type == TRIAN && tr.type == TRIAN) return trs_intersect(tr);
 
             if (type == POINT && tr.type == POINT) return pnts[0] == tr.pnts[0];
 
-            if (type == LINE && tr.type == LINE) return segs_intersect(tr);
+            if (type == LINE && tr.type == LINE) return segs_intersect(seg1, seg2, tr_seg1, tr_seg2);
 
-            if (type == TRIAN && tr.type == POINT) return tr_pnt_intersect(tr);
+            if (type == TRIAN && tr.type == POINT) return tr_pnt_intersect(tr.pnts[0]);
 
-            if (type == POINT && tr.type == TRIAN) return tr.tr_pnt_intersect(*this);
+            if (type == POINT && tr.type == TRIAN) return tr.tr_pnt_intersect(pnts[0]);
 
-            if (type == TRIAN && tr.type == LINE) return tr_seg_intersect(tr);
+            if (type == TRIAN && tr.type == LINE) return tr_seg_intersect(tr_seg1, tr_seg2);
 
-            if (type == LINE && tr.type == TRIAN) return tr.tr_seg_intersect(*this);
+            if (type == LINE && tr.type == TRIAN) return tr.tr_seg_intersect(seg1, seg2);
 
-            if (type == LINE && tr.type == POINT) return seg_pnt_intersect(tr);
+            if (type == LINE && tr.type == POINT) return seg_pnt_intersect(seg1, seg2, tr.pnts[0]);
 
-            if (type == POINT && tr.type == LINE) return tr.seg_pnt_intersect(*this);
+            if (type == POINT && tr.type == LINE) return seg_pnt_intersect(tr_seg1, tr_seg2, pnts[0]);
 
             return false;
         }
 
+        // The classic tests by type, for figures kept as the records of
+        // narrow_phase: a LINE as its longest edge, a POINT as its vertex.
+        bool trs_intersect(const triangle_t &tr) const {
+            plane_t pln = get_pln();
+
+            if (tr.is_not_inter_pln(pln)) return false;
+
+            if (equal(pln.get_pnt_pos(tr.pnts[0]), 0) &&
+                equal(pln.get_pnt_pos(tr.pnts[1]), 0) &&
+                equal(pln.get_pnt_pos(tr.pnts[2]), 0))
+                    return is_intersected_on_same_pln(tr, pln);
+            return is_intersected_on_inter_pln(tr, pln);
+        }
+
+        bool tr_pnt_intersect(const point_t &pnt) const {
+            plane_t pln = get_pln();
+            double pnt_pos = pln.get_pnt_pos(pnt);
+
+            if (!equal(pnt_pos, 0)) return false;
+
+            return is_pnt_inside_tr(pnt, get_segs(), pln.norm_vec);
+        }
+
+        bool tr_seg_intersect(const point_t &seg_pnt1, const point_t &seg_pnt2) const {
+            plane_t pln = get_pln();
+            line_segment_t seg{seg_pnt1, seg_pnt2};
+
+            double pnt1_pos = pln.get_pnt_pos(seg.pnt1),
+                   pnt2_pos = pln.get_pnt_pos(seg.pnt2);
+
+            if ((pnt1_pos > 0 && pnt2_pos > 0) || (pnt1_pos < 0 && pnt2_pos < 0)) return false;
+
+            SegArr segs = get_segs();
+
+            if (equal(pnt1_pos, 0) && equal(pnt2_pos, 0))
+                return segs[0].is_ln_seg_intersected(seg) ||
+                       segs[1].is_ln_seg_intersected(seg) ||
+                       segs[2].is_ln_seg_intersected(seg) || is_pnt_inside_tr(seg.pnt1, segs, pln.norm_vec);
+
+            point_t inter_pnt = pln.get_intersection(seg.line);
+
+            return is_pnt_inside_tr(inter_pnt, segs, pln.norm_vec);
+        }
+
+        static bool segs_intersect(const point_t &p1, const point_t &p2, const point_t &q1, const point_t &q2) {
+            return line_segment_t{p1, p2}.is_ln_seg_intersected({q1, q2});
+        }
+
+        static bool seg_pnt_intersect(const point_t &seg_pnt1, const point_t &seg_pnt2, const point_t &pnt) {
+            line_segment_t seg{seg_pnt1, seg_pnt2};
+
+            if (seg.line.is_pnt_on_line(pnt))
+                return seg.is_line_pnt_on_ln_seg(pnt);
+            return false;
+        }
+
+        // Sphere of the classic reject: the centroid and the longest edge as radius.
+        point_t get_cntr() const {
+            return {(pnts[0].x_ + pnts[1].x_ + pnts[2].x_) / 3,
+                    (pnts[0].y_ + pnts[1].y_ + pnts[2].y_) / 3,
+                    (pnts[0].z_ + pnts[1].z_ + pnts[2].z_) / 3};
+        }
+
+        double get_radius() const { return dist_radius; }
+
+        tr_types_t get_type() const { return type; }
+
+        tr_types_t get_exact_type() const { return exact_type; }
+
+        const point_t &get_pnt(int i) const { return pnts[i]; }
+
+        // True if the precomputed fields are in range, for a record read from a
+        // file instead of made by the constructor.
+        bool has_valid_fields() const {
+            return type <= POINT && exact_type <= POINT && longest_seg_id < 3 && end_seg_id < 3;
+        }
+
+        // Endpoints of the longest edge, which is the whole figure for LINE.
+        const point_t &get_longest_pnt1() const { return pnts[longest_seg_id]; }
+        const point_t &get_longest_pnt2() const { return pnts[(longest_seg_id + 1) % 3]; }
+
+        // Endpoints of the edge that holds a LINE of the exact type.
+        const point_t &get_end_pnt1() const { return pnts[end_seg_id]; }
+        const point_t &get_end_pnt2() const { return pnts[(end_seg_id + 1) % 3]; }
+
+        aabb_t get_aabb() const {
+            aabb_t box{pnts[0].x_, pnts[0].y_, pnts[0].z_, pnts[0].x_, pnts[0].y_, pnts[0].z_};
+            box.extend(pnts[1]);
+            box.extend(pnts[2]);
+            return box;
+        }
+
         bool is_in_cube(const point_t &cntr, double radius) const {
             return pnts[0].is_in_cube(cntr, radius) &&
                    pnts[1].is_in_cube(cntr, radius) &&
@@ -214,6 +323,53 @@ class triangle_t {
                    pnts[2].is_in_cube(cntr, radius);
         }
 
+        // Separating axis test against the box: the box axes, the triangle normal and
+        // the 9 cross products of edges and box axes. Zero axes of degenerate figures
+        // never separate, so LINE and POINT are tested conservatively.
+        bool is_box_overlapped(const aabb_t &box) const {
+            double cntr[3] = {(box.x_min + box.x_max) / 2, (box.y_min + box.y_max) / 2, (box.z_min + box.z_max) / 2};
+            double half[3] = {(box.x_max - box.x_min) / 2, (box.y_max - box.y_min) / 2, (box.z_max - box.z_min) / 2};
+
+            double v[3][3];
+            for (int i = 0; i < 3; i++) {
+                v[i][0] = pnts[i].x_ - cntr[0];
+                v[i][1] = pnts[i].y_ - cntr[1];
+                v[i][2] = pnts[i].z_ - cntr[2];
+            }
+
+            for (int k = 0; k < 3; k++)
+                if (std::min({v[0][k], v[1][k], v[2][k]}) > half[k] ||
+                    std::max({v[0][k], v[1][k], v[2][k]}) < -half[k]) return false;
+
+            double e[3][3];
+            for (int i = 0; i < 3; i++)
+                for (int k = 0; k < 3; k++) e[i][k] = v[(i + 1) % 3][k] - v[i][k];
+
+            auto is_separated = [&](const double (&axis)[3]) {
+                double p[3];
+                for (int i = 0; i < 3; i++) p[i] = axis[0] * v[i][0] + axis[1] * v[i][1] + axis[2] * v[i][2];
+
+                double r = half[0] * std::abs(axis[0]) + half[1] * std::abs(axis[1]) + half[2] * std::abs(axis[2]);
+                return std::min({p[0], p[1], p[2]}) > r || std::max({p[0], p[1], p[2]}) < -r;
+            };
+
+            double norm[3] = {e[0][1] * e[1][2] - e[0][2] * e[1][1],
+                              e[0][2] * e[1][0] - e[0][0] * e[1][2],
+                              e[0][0] * e[1][1] - e[0][1] * e[1][0]};
+            if (is_separated(norm)) return false;
+
+            for (int i = 0; i < 3; i++)
+                for (int k = 0; k < 3; k++) {
+                    // edge i times the unit vector of axis k
+                    double axis[3] = {0, 0, 0};
+                    axis[(k + 1) % 3] =  e[i][(k + 2) % 3];
+                    axis[(k + 2) % 3] = -e[i][(k + 1) % 3];
+
+                    if (is_separated(axis)) return false;
+                }
+            return true;
+        }
+
         void print() const {
             std::cout << "triangle:" << std::endl;
 
@@ -221,4 +377,6 @@ class triangle_t {
                 pnts.at(i).print();
         }
     };
+
+static_assert(sizeof(triangle_t) <= 96, "triangle_t must stay a compact record");
 }
@@ -0,0 +1,163 @@
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "triangles.hpp"
+#include "narrow_phase.hpp"
+
+using namespace triangles;
+
+// Times the narrow phase on its own: for every pair of triangle types and for
+// coplanar, crossing and disjoint placements a fixed-seed set of pairs is run
+// through the classic and the fast test until the time budget is spent.
+
+const unsigned SEED = 20240601;
+
+enum config_t {COPLANAR, CROSSING, DISJOINT};
+
+const char *TYPE_NAMES[]   = {"trian", "line", "point"};
+const char *CONFIG_NAMES[] = {"coplanar", "crossing", "disjoint"};
+
+using tr_types_t = triangle_t::tr_types_t;
+
+class pair_generator_t {
+    std::mt19937 rng_;
+    std::uniform_real_distribution<double> unit_{-1, 1};
+
+    point_t get_pnt(bool is_flat) {
+        return {unit_(rng_), unit_(rng_), is_flat ? 0 : unit_(rng_)};
+    }
+
+    static point_t shift(const point_t &pnt, const point_t &dir, double len) {
+        return {pnt.x_ + dir.x_ * len, pnt.y_ + dir.y_ * len, pnt.z_ + dir.z_ * len};
+    }
+
+    // A figure of the given type that contains pnt: a triangle with pnt at
+    // random barycentric coordinates, a segment from pnt or pnt itself. The
+    // segment repeats a vertex, so it is exactly flat for the fast engine too.
+    triangle_t get_figure(tr_types_t type, const point_t &pnt, bool is_flat) {
+        if (type == triangle_t::POINT) return {pnt, pnt, pnt};
+
+        point_t dir = get_pnt(is_flat);
+
+        if (type == triangle_t::LINE) {
+            double len = (unit_(rng_) + 3) / 2;
+            return {pnt, pnt, shift(pnt, dir, len)};
+        }
+
+        std::uniform_real_distribution<double> weight{0.1, 1};
+        double w0 = weight(rng_), w1 = weight(rng_), w2 = weight(rng_), sum = w0 + w1 + w2;
+        w0 /= sum; w1 /= sum; w2 /= sum;
+
+        point_t v1 = shift(pnt, dir, 1), v2 = shift(pnt, get_pnt(is_flat), 1);
+        point_t v0{(pnt.x_ - w1 * v1.x_ - w2 * v2.x_) / w0,
+                   (pnt.y_ - w1 * v1.y_ - w2 * v2.y_) / w0,
+                   (pnt.z_ - w1 * v1.z_ - w2 * v2.z_) / w0};
+
+        return {v0, v1, v2};
+    }
+
+    public:
+        explicit pair_generator_t(unsigned seed) : rng_(seed) {}
+
+        // Pairs of figures in the plane z = 0 placed around two nearby points, so
+        // some of them overlap; figures through one common point in general
+        // position; figures with boxes apart by 1 along z.
+        std::pair<triangle_t, triangle_t> get_pair(tr_types_t type1, tr_types_t type2, config_t config) {
+            if (config == COPLANAR) {
+                point_t pnt1 = get_pnt(true), pnt2 = get_pnt(true);
+                return {get_figure(type1, pnt1, true), get_figure(type2, pnt2, true)};
+            }
+
+            point_t pnt = get_pnt(false);
+            triangle_t tr1 = get_figure(type1, pnt, false);
+
+            if (config == CROSSING) return {tr1, get_figure(type2, pnt, false)};
+
+            triangle_t tr2 = get_figure(type2, get_pnt(false), false);
+            double lift = tr1.get_aabb().z_max - tr2.get_aabb().z_min + 1;
+            point_t up{0, 0, 1};
+
+            return {tr1, {shift(tr2.get_pnt(0), up, lift), shift(tr2.get_pnt(1), up, lift),
+                          shift(tr2.get_pnt(2), up, lift)}};
+        }
+};
+
+struct bench_result_t {
+    double   ns_per_pair;
+    uint64_t hits;
+};
+
+template <typename test_t>
+bench_result_t run_bench(const std::vector<std::pair<triangle_t, triangle_t>> &pairs, double min_time,
+                         test_t test) {
+    using bench_clock_t = std::chrono::steady_clock;
+
+    uint64_t hits = 0, tests = 0;
+    auto start = bench_clock_t::now();
+    double elapsed = 0;
+
+    do {
+        for (const auto &pr : pairs) hits += test(pr.first, pr.second);
+
+        tests += pairs.size();
+        elapsed = std::chrono::duration<double>(bench_clock_t::now() - start).count();
+    } while (elapsed < min_time);
+
+    return {elapsed * 1e9 / tests, hits * pairs.size() / tests};
+}
+
+void print_row(const std::string &name, const char *config, const char *narrow, const bench_result_t &res) {
+    std::printf("%-12s %-9s %-8s %7llu %10.1f %14.0f\n", name.c_str(), config, narrow,
+                static_cast<unsigned long long>(res.hits), res.ns_per_pair, 1e9 / res.ns_per_pair);
+}
+
+int main(int argc, char *argv[]) {
+    size_t pairs_num = 4096;
+    double min_time  = 0.2;
+
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "--pairs") && i + 1 < argc) {
+            pairs_num = std::stoul(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--time") && i + 1 < argc) {
+            min_time = std::stod(argv[++i]);
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--pairs N] [--time SECONDS]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::printf("%-12s %-9s %-8s %7s %10s %14s\n", "types", "config", "narrow", "hits", "ns/pair", "pairs/s");
+
+    const tr_types_t types[] = {triangle_t::TRIAN, triangle_t::LINE, triangle_t::POINT};
+
+    for (tr_types_t type1 : types)
+        for (tr_types_t type2 : types)
+            for (config_t config : {COPLANAR, CROSSING, DISJOINT}) {
+                pair_generator_t gen{SEED + 9 * type1 + 3 * type2 + config};
+                std::vector<std::pair<triangle_t, triangle_t>> pairs;
+
+                pairs.reserve(pairs_num);
+                for (size_t i = 0; i < pairs_num; ++i) pairs.push_back(gen.get_pair(type1, type2, config));
+
+                std::string name = std::string{TYPE_NAMES[type1]} + "-" + TYPE_NAMES[type2];
+
+                bench_result_t classic = run_bench(pairs, min_time, [](const triangle_t &tr1, const triangle_t &tr2) {
+                    return tr1.is_intersected(tr2);
+                });
+                bench_result_t fast = run_bench(pairs, min_time, [](const triangle_t &tr1, const triangle_t &tr2) {
+                    return narrow_phase::is_intersected(tr1, tr2);
+                });
+
+                print_row(name, CONFIG_NAMES[config], "classic", classic);
+                print_row(name, CONFIG_NAMES[config], "fast", fast);
+            }
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "scene_reader.hpp"
+
+using namespace scene_reader;
+
+// Converts a text scene (the tests/test_files/*.dat format) into the binary
+// scene format that triangles maps directly.
+
+int main(int argc, char *argv[]) {
+    bool is_float = argc == 4 && !std::strcmp(argv[1], "--float");
+
+    if (argc != 3 && !is_float) {
+        std::cerr << "Usage: " << argv[0] << " [--float] INPUT.dat OUTPUT.bin" << std::endl;
+        return 1;
+    }
+
+    const char *in_path  = argv[argc - 2];
+    const char *out_path = argv[argc - 1];
+
+    scene_source_t src;
+    if (!src.open_file(in_path)) {
+        std::cerr << "Can't read input" << std::endl;
+        return 1;
+    }
+
+    std::vector<double> crds;
+    max_min_crds_t bounds;
+
+    auto on_amount = [&](int tr_num) { crds.reserve(9 * static_cast<size_t>(tr_num)); };
+
+    read_status_t status = scan_text_triangles(src, on_amount, [&](const double (&c)[9]) {
+        bounds.update(c[0], c[1], c[2]);
+        bounds.update(c[3], c[4], c[5]);
+        bounds.update(c[6], c[7], c[8]);
+
+        crds.insert(crds.end(), c, c + 9);
+    });
+
+    if (status == BAD_AMOUNT) {
+        std::cerr << "Bad triangles amount" << std::endl;
+        return 1;
+    }
+    if (status == BAD_COORDS) {
+        std::cerr << "Bad coordinates" << std::endl;
+        return 1;
+    }
+
+    FILE *out = std::fopen(out_path, "wb");
+    if (!out) {
+        std::cerr << "Can't open output" << std::endl;
+        return 1;
+    }
+
+    bool is_written = is_float ? write_binary_scene<float>(out, crds, bounds) :
+                                 write_binary_scene<double>(out, crds, bounds);
+
+    if (std::fclose(out) != 0 || !is_written) {
+        std::cerr << "Can't write output" << std::endl;
+        return 1;
+    }
+    return 0;
+}
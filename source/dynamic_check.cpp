@@ -0,0 +1,175 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "octotree.hpp"
+#include "dynamic_octotree.hpp"
+#include "scene_gen.hpp"
+
+using namespace octotrees;
+using namespace scene_gens;
+
+// Applies a fixed-seed random sequence of inserts, erases and updates to the
+// dynamic octree. After every step its intersecting set is compared with the
+// one of a static octree built anew over the stored triangles, and the count
+// of every stored id with the pairs tested one by one. Updates move triangles
+// across the scene and now and then far out of it, so the root grows too.
+
+const uint32_t STATIC_LEAF_SIZE = 8;
+const double   FAR_SHIFT        = 1000;
+
+enum step_t {INSERT, ERASE, UPDATE};
+
+const char *STEP_NAMES[] = {"insert", "erase", "update"};
+
+class dynamic_check_t {
+    std::mt19937_64 rng_;
+    narrow_engine_t narrow_;
+
+    std::vector<triangle_t> pool_;
+    double side_ = 0;
+
+    dynamic_octotree_t tree_;
+    std::vector<triangle_t> trs_;
+    std::vector<bool> is_stored_;
+
+    size_t get_index(size_t sz) { return std::uniform_int_distribution<size_t>{0, sz - 1}(rng_); }
+
+    triangle_t get_tr() {
+        const triangle_t &tr = pool_[get_index(pool_.size())];
+        if (get_index(16)) return tr;
+
+        double shift = FAR_SHIFT * side_;
+        auto move = [&](const point_t &pnt) { return point_t{pnt.x_ + shift, pnt.y_ - shift, pnt.z_ + shift}; };
+
+        return {move(tr.get_pnt(0)), move(tr.get_pnt(1)), move(tr.get_pnt(2))};
+    }
+
+    bool is_pair_intersected(uint32_t id1, uint32_t id2) const {
+        const triangle_t &tr1 = trs_[std::min(id1, id2)], &tr2 = trs_[std::max(id1, id2)];
+
+        if (!tr1.get_aabb().is_overlapped(tr2.get_aabb())) return false;
+        if (narrow_ == narrow_phase::CLASSIC) return tr1.is_intersected(tr2);
+        return narrow_phase::is_intersected(tr1, tr2);
+    }
+
+    // The first stored id whose count or membership differs, -1 if none.
+    long long find_difference() const {
+        std::vector<uint32_t> ids;
+        std::vector<triangle_t> trs;
+        max_min_crds_t crds;
+
+        for (uint32_t id = 0; id < trs_.size(); ++id) {
+            if (is_stored_[id] != tree_.contains(id)) return id;
+            if (!is_stored_[id]) {
+                if (tree_.get_count(id)) return id;
+                continue;
+            }
+
+            ids.push_back(id);
+            trs.push_back(trs_[id]);
+            for (int i = 0; i < 3; ++i) {
+                const point_t &pnt = trs_[id].get_pnt(i);
+                crds.update(pnt.x_, pnt.y_, pnt.z_);
+            }
+        }
+        if (ids.size() != tree_.size()) return ids.size();
+
+        answers::hits_t static_ans{answers::IDS, trs.size()};
+        if (!trs.empty()) octotree_t{trs, crds, narrow_, {1, STATIC_LEAF_SIZE}}.get_intersections(static_ans);
+
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (static_ans.ids().test(i) != tree_.is_intersected(ids[i])) return ids[i];
+
+            uint32_t count = 0;
+            for (uint32_t other : ids)
+                if (other != ids[i] && is_pair_intersected(ids[i], other)) count++;
+
+            if (count != tree_.get_count(ids[i])) return ids[i];
+        }
+        return -1;
+    }
+
+    public:
+        dynamic_check_t(uint64_t seed, distribution_t dist, size_t ids_num, narrow_engine_t narrow) :
+            rng_(seed), narrow_(narrow), tree_({}, narrow), is_stored_(ids_num, false) {
+            scene_t scene = scene_generator_t{seed}.generate(dist, 4 * ids_num);
+            const std::vector<double> &c = scene.crds;
+
+            for (size_t i = 0; i < c.size(); i += 9)
+                pool_.emplace_back(point_t{c[i], c[i + 1], c[i + 2]}, point_t{c[i + 3], c[i + 4], c[i + 5]},
+                                   point_t{c[i + 6], c[i + 7], c[i + 8]});
+
+            side_ = std::max({scene.bounds.x_max - scene.bounds.x_min, scene.bounds.y_max - scene.bounds.y_min,
+                              scene.bounds.z_max - scene.bounds.z_min});
+            trs_.assign(ids_num, pool_[0]);
+        }
+
+        dynamic_check_t(const dynamic_check_t& check)            = delete;
+        dynamic_check_t& operator=(const dynamic_check_t& check) = delete;
+
+        // Runs the steps, false with a message at the first difference.
+        bool run(size_t steps) {
+            for (size_t i = 0; i < steps; ++i) {
+                uint32_t id = get_index(trs_.size());
+                step_t step = !is_stored_[id] ? INSERT : get_index(3) ? UPDATE : ERASE;
+
+                if (step == ERASE) {
+                    if (!tree_.erase(id)) {
+                        std::cerr << "Step " << i << ": erase of stored id " << id << " failed" << std::endl;
+                        return false;
+                    }
+                    is_stored_[id] = false;
+                }
+                else {
+                    trs_[id] = get_tr();
+                    is_stored_[id] = true;
+
+                    if (step == INSERT) tree_.insert(id, trs_[id]);
+                    else                tree_.update(id, trs_[id]);
+                }
+
+                long long diff_id = find_difference();
+                if (diff_id >= 0) {
+                    std::cerr << "Step " << i << " (" << STEP_NAMES[step] << " of id " << id
+                              << "): the tree differs from a fresh build at id " << diff_id << std::endl;
+                    return false;
+                }
+            }
+            return true;
+        }
+};
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = 1;
+    size_t steps  = 2000;
+    narrow_engine_t narrow = narrow_phase::CLASSIC;
+
+    int i = 1;
+    for (; i + 2 < argc; i++) {
+        if (!std::strcmp(argv[i], "--seed")) seed = std::strtoull(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--steps")) steps = std::strtoul(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--narrow") && !std::strcmp(argv[i + 1], "fast")) {
+            narrow = narrow_phase::FAST;
+            i++;
+        }
+        else if (!std::strcmp(argv[i], "--narrow") && !std::strcmp(argv[i + 1], "classic")) i++;
+        else break;
+    }
+
+    distribution_t dist;
+    size_t ids_num = 0;
+
+    if (i + 2 == argc) ids_num = std::strtoul(argv[i + 1], nullptr, 10);
+
+    if (i + 2 != argc || !find_distribution(argv[i], dist) || !ids_num) {
+        std::cerr << "Usage: " << argv[0] << " [--seed N] [--steps N] [--narrow classic|fast]"
+                  << " uniform|clustered|coplanar|degenerate|mixed IDS" << std::endl;
+        return 1;
+    }
+
+    return dynamic_check_t{seed, dist, ids_num, narrow}.run(steps) ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "scene_gen.hpp"
+#include "scene_reader.hpp"
+
+using namespace scene_gens;
+
+// Writes a synthetic scene of N triangles of the given distribution, as a
+// binary scene or with --text in the tests/test_files/*.dat format.
+
+bool write_text_scene(FILE *out, const scene_t &scene) {
+    if (std::fprintf(out, "%zu\n", scene.size()) < 0) return false;
+
+    for (size_t i = 0; i < scene.crds.size(); i += 3)
+        if (std::fprintf(out, "%.17g %.17g %.17g\n", scene.crds[i], scene.crds[i + 1], scene.crds[i + 2]) < 0)
+            return false;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = 1;
+    bool is_text  = false;
+
+    int i = 1;
+    for (; i + 3 < argc; i++) {
+        if (!std::strcmp(argv[i], "--seed")) seed = std::strtoull(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--text")) is_text = true;
+        else break;
+    }
+
+    distribution_t dist;
+    size_t n = 0;
+
+    if (i + 3 == argc) n = std::strtoul(argv[i + 1], nullptr, 10);
+
+    if (i + 3 != argc || !find_distribution(argv[i], dist) || !n) {
+        std::cerr << "Usage: " << argv[0] << " [--seed N] [--text]"
+                  << " uniform|clustered|coplanar|degenerate|mixed N OUTPUT" << std::endl;
+        return 1;
+    }
+
+    scene_t scene = scene_generator_t{seed}.generate(dist, n);
+
+    FILE *out = std::fopen(argv[i + 2], "wb");
+    if (!out) {
+        std::cerr << "Can't open output" << std::endl;
+        return 1;
+    }
+
+    bool is_written = is_text ? write_text_scene(out, scene) :
+                                scene_reader::write_binary_scene<double>(out, scene.crds, scene.bounds);
+
+    if (std::fclose(out) != 0 || !is_written) {
+        std::cerr << "Can't write output" << std::endl;
+        return 1;
+    }
+    return 0;
+}
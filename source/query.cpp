@@ -0,0 +1,101 @@
+#include <iostream>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "scene_index.hpp"
+
+using namespace scene_reader;
+using namespace scene_index;
+
+// Builds the index over SCENE once and answers the triangles of QUERIES against
+// it in batches: for every query a line with the ids of the scene triangles it
+// intersects, in ascending order.
+
+bool read_scene(const char *path, std::vector<triangle_t> &trs) {
+    scene_source_t src;
+    max_min_crds_t crds;
+
+    if (!src.open_file(path)) {
+        std::cerr << "Can't read " << path << std::endl;
+        return false;
+    }
+
+    read_status_t status = read_triangles(src, trs, crds);
+    if (status != READ_OK) {
+        std::cerr << "Bad scene " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool write_hits(const batch_hits_t &res) {
+    const size_t MAX_ID_LEN = 11;
+
+    std::vector<char> buf(res.ids.size() * MAX_ID_LEN + res.size());
+    char *pos = buf.data();
+
+    for (size_t i = 0; i < res.size(); ++i) {
+        for (uint32_t k = res.offsets[i]; k < res.offsets[i + 1]; ++k) {
+            if (k != res.offsets[i]) *pos++ = ' ';
+            pos = std::to_chars(pos, pos + MAX_ID_LEN, res.ids[k]).ptr;
+        }
+        *pos++ = '\n';
+    }
+
+    size_t len = pos - buf.data();
+    return std::fwrite(buf.data(), 1, len, stdout) == len;
+}
+
+int main(int argc, char *argv[]) {
+    int threads  = 1;
+    size_t batch = 4096;
+    narrow_phase::narrow_engine_t narrow = narrow_phase::CLASSIC;
+
+    int i = 1;
+    for (; i + 2 < argc; i++) {
+        if (!std::strcmp(argv[i], "--threads")) {
+            threads = std::atoi(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--batch")) {
+            batch = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (!std::strcmp(argv[i], "--narrow")) {
+            i++;
+            if      (!std::strcmp(argv[i], "classic")) narrow = narrow_phase::CLASSIC;
+            else if (!std::strcmp(argv[i], "fast"))    narrow = narrow_phase::FAST;
+            else break;
+        }
+        else break;
+    }
+
+    if (i + 2 != argc || threads < 1 || !batch) {
+        std::cerr << "Usage: " << argv[0] << " [--threads N] [--batch N] [--narrow classic|fast] SCENE QUERIES"
+                  << std::endl;
+        return 1;
+    }
+
+    std::vector<triangle_t> scene, queries;
+    if (!read_scene(argv[i], scene) || !read_scene(argv[i + 1], queries)) return 1;
+
+    scene_index_t index{std::move(scene), narrow};
+
+    std::vector<triangle_t> part;
+    batch_hits_t res;
+
+    for (size_t first = 0; first < queries.size(); first += batch) {
+        size_t last = std::min(first + batch, queries.size());
+
+        part.assign(queries.begin() + first, queries.begin() + last);
+        index.query(part, res, threads);
+
+        if (!write_hits(res)) {
+            std::cerr << "Can't write answer" << std::endl;
+            return 1;
+        }
+    }
+
+    return std::fflush(stdout) ? 1 : 0;
+}
@@ -0,0 +1,333 @@
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "narrow_phase.hpp"
+#include "scene_gen.hpp"
+#include "scene_reader.hpp"
+
+using namespace scene_gens;
+
+// Runs triangles over a sweep of generated scenes, sizes, engines and thread
+// counts, and prints one JSON line per run with its best wall time, throughput
+// and peak RSS. Small scenes are cross-checked against the O(n^2) answer of the
+// other narrow phase, and a baseline of earlier lines makes the run fail on slowdowns or memory growth
+// beyond the threshold.
+
+struct sweep_t {
+    std::vector<size_t> sizes = {1000, 10000, 100000, 1000000};
+    std::vector<distribution_t> dists = {UNIFORM, CLUSTERED, COPLANAR, DEGENERATE, MIXED};
+    std::vector<std::string> engines = {"octree"};
+    std::vector<int> threads = {1};
+
+    std::string bin;
+    const char *narrow = "classic";
+    const char *baseline = nullptr;
+
+    int repeat = 1;
+    uint64_t seed = 1;
+    size_t check_max = 4000;
+    double threshold = 0.2;
+};
+
+struct run_result_t {
+    double wall_sec = 0;
+    long peak_rss_kb = 0;
+    bool is_ok = false;
+};
+
+// Key of a run in the baseline.
+using run_key_t = std::tuple<std::string, std::string, size_t, int>;
+
+struct baseline_entry_t {
+    double trs_per_sec;
+    long peak_rss_kb;
+};
+
+std::vector<std::string> split_list(const char *list) {
+    std::vector<std::string> items;
+    std::string item;
+
+    for (const char *c = list;; ++c) {
+        if (*c == ',' || !*c) {
+            if (!item.empty()) items.push_back(item);
+            item.clear();
+            if (!*c) break;
+        }
+        else item += *c;
+    }
+    return items;
+}
+
+[[noreturn]] void exit_usage(const char *name) {
+    std::cerr << "Usage: " << name << " [--bin PATH] [--sizes N,...]"
+              << " [--dists uniform,clustered,coplanar,degenerate,mixed] [--engines NAME,...] [--threads N,...]"
+              << " [--narrow classic|fast] [--repeat N] [--seed N] [--check-max N]"
+              << " [--baseline FILE] [--threshold FRACTION]" << std::endl;
+    exit(1);
+}
+
+sweep_t parse_options(int argc, char *argv[]) {
+    sweep_t sweep;
+
+    std::string self = argv[0];
+    size_t slash = self.rfind('/');
+    sweep.bin = (slash == std::string::npos ? std::string{"."} : self.substr(0, slash)) + "/triangles";
+
+    unsigned hw = std::thread::hardware_concurrency();
+    if (hw > 1) sweep.threads.push_back(hw);
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 == argc) exit_usage(argv[0]);
+
+        const char *opt = argv[i], *arg = argv[++i];
+
+        if (!std::strcmp(opt, "--bin")) sweep.bin = arg;
+        else if (!std::strcmp(opt, "--sizes")) {
+            sweep.sizes.clear();
+            for (const std::string &item : split_list(arg)) sweep.sizes.push_back(std::stoul(item));
+        }
+        else if (!std::strcmp(opt, "--dists")) {
+            sweep.dists.clear();
+            for (const std::string &item : split_list(arg)) {
+                distribution_t dist;
+                if (!find_distribution(item.c_str(), dist)) exit_usage(argv[0]);
+                sweep.dists.push_back(dist);
+            }
+        }
+        else if (!std::strcmp(opt, "--engines")) sweep.engines = split_list(arg);
+        else if (!std::strcmp(opt, "--threads")) {
+            sweep.threads.clear();
+            for (const std::string &item : split_list(arg)) sweep.threads.push_back(std::stoi(item));
+        }
+        else if (!std::strcmp(opt, "--narrow"))    sweep.narrow    = arg;
+        else if (!std::strcmp(opt, "--repeat"))    sweep.repeat    = std::stoi(arg);
+        else if (!std::strcmp(opt, "--seed"))      sweep.seed      = std::stoull(arg);
+        else if (!std::strcmp(opt, "--check-max")) sweep.check_max = std::stoul(arg);
+        else if (!std::strcmp(opt, "--baseline"))  sweep.baseline  = arg;
+        else if (!std::strcmp(opt, "--threshold")) sweep.threshold = std::stod(arg);
+        else exit_usage(argv[0]);
+    }
+
+    if (sweep.repeat < 1 || sweep.threshold < 0) exit_usage(argv[0]);
+    return sweep;
+}
+
+// Runs the command with stdout sent to out_path and takes its wall time and
+// the peak RSS that wait4 reports for it.
+run_result_t run_command(const std::vector<std::string> &args, const std::string &out_path) {
+    using run_clock_t = std::chrono::steady_clock;
+
+    std::vector<char *> argv;
+    for (const std::string &arg : args) argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    run_result_t res;
+    auto start = run_clock_t::now();
+
+    pid_t pid = fork();
+    if (pid < 0) return res;
+
+    if (!pid) {
+        int fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) _exit(127);
+        close(fd);
+
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage;
+
+    if (wait4(pid, &status, 0, &usage) != pid) return res;
+
+    res.wall_sec    = std::chrono::duration<double>(run_clock_t::now() - start).count();
+    res.peak_rss_kb = usage.ru_maxrss;
+    res.is_ok       = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return res;
+}
+
+// Ids of the triangles intersecting any other one, every pair tested. The sweep
+// passes the narrow phase it doesn't run, so the check covers the exact tests
+// of the runs as well as their broad phase.
+std::vector<uint32_t> get_brute_force_ids(const scene_t &scene, narrow_phase::narrow_engine_t narrow) {
+    std::vector<triangles::triangle_t> trs;
+    const std::vector<double> &c = scene.crds;
+
+    for (size_t i = 0; i < c.size(); i += 9)
+        trs.emplace_back(triangles::point_t{c[i], c[i + 1], c[i + 2]}, triangles::point_t{c[i + 3], c[i + 4], c[i + 5]},
+                         triangles::point_t{c[i + 6], c[i + 7], c[i + 8]});
+
+    std::vector<bool> is_hit(trs.size());
+
+    for (uint32_t i = 0; i < trs.size(); ++i)
+        narrow_phase::for_each_hit(narrow, trs[i], trs.size() - i - 1,
+            [&](uint32_t k) -> const triangles::triangle_t & { return trs[i + 1 + k]; },
+            [&](uint32_t k) {
+                is_hit[i] = true;
+                is_hit[i + 1 + k] = true;
+            });
+
+    std::vector<uint32_t> ids;
+    for (uint32_t i = 0; i < trs.size(); ++i)
+        if (is_hit[i]) ids.push_back(i);
+    return ids;
+}
+
+std::vector<uint32_t> read_ids(const std::string &path) {
+    std::vector<uint32_t> ids;
+    std::ifstream in{path};
+
+    for (uint32_t id; in >> id;) ids.push_back(id);
+    return ids;
+}
+
+std::string get_field(const std::string &line, const std::string &key) {
+    std::string tag = "\"" + key + "\": ";
+    size_t pos = line.find(tag);
+    if (pos == std::string::npos) return "";
+
+    pos += tag.size();
+    if (line[pos] == '"') return line.substr(pos + 1, line.find('"', pos + 1) - pos - 1);
+    return line.substr(pos, line.find_first_of(",}", pos) - pos);
+}
+
+bool read_baseline(const char *path, std::map<run_key_t, baseline_entry_t> &baseline) {
+    std::ifstream in{path};
+    if (!in) return false;
+
+    for (std::string line; std::getline(in, line);) {
+        std::string engine = get_field(line, "engine"), dist = get_field(line, "distribution");
+        std::string trs = get_field(line, "triangles"), threads = get_field(line, "threads");
+        std::string speed = get_field(line, "trs_per_sec"), rss = get_field(line, "peak_rss_kb");
+
+        if (engine.empty() || dist.empty() || trs.empty() || threads.empty() || speed.empty() || rss.empty())
+            continue;
+
+        baseline[{engine, dist, std::stoul(trs), std::stoi(threads)}] = {std::stod(speed), std::stol(rss)};
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    sweep_t sweep = parse_options(argc, argv);
+
+    std::map<run_key_t, baseline_entry_t> baseline;
+    if (sweep.baseline && !read_baseline(sweep.baseline, baseline)) {
+        std::cerr << "Can't read baseline" << std::endl;
+        return 1;
+    }
+
+    bool is_fast = !std::strcmp(sweep.narrow, "fast");
+    narrow_phase::narrow_engine_t check_narrow = is_fast ? narrow_phase::CLASSIC : narrow_phase::FAST;
+    const char *check_name = is_fast ? "classic" : "fast";
+
+    const char *tmp_dir = std::getenv("TMPDIR");
+    std::string scene_path = std::string{tmp_dir && *tmp_dir ? tmp_dir : "/tmp"} + "/triangles_scale_XXXXXX";
+
+    int fd = mkstemp(scene_path.data());
+    if (fd < 0) {
+        std::cerr << "Can't create scene file" << std::endl;
+        return 1;
+    }
+    close(fd);
+
+    std::string out_path = scene_path + ".out";
+    bool is_failed = false;
+
+    for (distribution_t dist : sweep.dists)
+        for (size_t n : sweep.sizes) {
+            scene_t scene = scene_generator_t{sweep.seed}.generate(dist, n);
+
+            FILE *out = std::fopen(scene_path.c_str(), "wb");
+            bool is_written = out && scene_reader::write_binary_scene<double>(out, scene.crds, scene.bounds);
+
+            if (!out || std::fclose(out) != 0 || !is_written) {
+                std::cerr << "Can't write scene file" << std::endl;
+                is_failed = true;
+                break;
+            }
+
+            bool is_checked = n <= sweep.check_max;
+            std::vector<uint32_t> expected;
+            if (is_checked) expected = get_brute_force_ids(scene, check_narrow);
+
+            scene.crds = std::vector<double>{};
+
+            for (const std::string &engine : sweep.engines)
+                for (int threads : sweep.threads) {
+                    std::vector<std::string> args = {sweep.bin, "--input", scene_path, "--engine", engine,
+                                                     "--threads", std::to_string(threads), "--narrow", sweep.narrow};
+                    run_result_t best;
+
+                    for (int k = 0; k < sweep.repeat; ++k) {
+                        run_result_t res = run_command(args, out_path);
+
+                        if (!res.is_ok) {
+                            best = res;
+                            break;
+                        }
+                        if (!k || res.wall_sec < best.wall_sec) best.wall_sec = res.wall_sec;
+                        best.peak_rss_kb = std::max(best.peak_rss_kb, res.peak_rss_kb);
+                        best.is_ok = true;
+                    }
+
+                    const char *dist_name = DISTRIBUTION_NAMES[dist];
+                    std::string run_name = engine + "/" + dist_name + "/" + std::to_string(n) + "/" +
+                                           std::to_string(threads);
+
+                    if (!best.is_ok) {
+                        std::cerr << "Run failed: " << run_name << std::endl;
+                        is_failed = true;
+                        continue;
+                    }
+
+                    if (is_checked && read_ids(out_path) != expected) {
+                        std::cerr << "Answer differs from every pair tested by the " << check_name
+                                  << " narrow phase: " << run_name << std::endl;
+                        is_failed = true;
+                    }
+
+                    double trs_per_sec = n / best.wall_sec;
+
+                    std::printf("{\"engine\": \"%s\", \"distribution\": \"%s\", \"triangles\": %zu, \"threads\": %d, "
+                                "\"wall_sec\": %.6f, \"trs_per_sec\": %.0f, \"peak_rss_kb\": %ld, "
+                                "\"checked_with\": %s}\n",
+                                engine.c_str(), dist_name, n, threads, best.wall_sec, trs_per_sec, best.peak_rss_kb,
+                                is_checked ? (is_fast ? "\"classic\"" : "\"fast\"") : "null");
+                    std::fflush(stdout);
+
+                    auto base = baseline.find({engine, dist_name, n, threads});
+                    if (base == baseline.end()) continue;
+
+                    if (trs_per_sec < base->second.trs_per_sec * (1 - sweep.threshold)) {
+                        std::cerr << "Throughput regression: " << run_name << " " << trs_per_sec << " against "
+                                  << base->second.trs_per_sec << " triangles/s" << std::endl;
+                        is_failed = true;
+                    }
+                    if (best.peak_rss_kb > base->second.peak_rss_kb * (1 + sweep.threshold)) {
+                        std::cerr << "Peak RSS regression: " << run_name << " " << best.peak_rss_kb << " against "
+                                  << base->second.peak_rss_kb << " KiB" << std::endl;
+                        is_failed = true;
+                    }
+                }
+        }
+
+    std::remove(scene_path.c_str());
+    std::remove(out_path.c_str());
+
+    return is_failed ? 1 : 0;
+}
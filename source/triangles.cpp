@@ -1,59 +1,372 @@
 #include <iostream>
 
 #include "octotree.hpp"
+#include "scene_reader.hpp"
+#include "hash_grid.hpp"
+#include "bvh.hpp"
+#include "dynamic_octotree.hpp"
+#include "tiled_query.hpp"
+#include "coplanar_query.hpp"
 #include <vector>
-#include <set>
-#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
 
-//#define CHECK_TIME
 using namespace octotrees;
+using namespace scene_reader;
+using coplanar_queries::coplanar_query_t;
 
-int main() {
-    int tr_num = 0;
+struct options_t {
+    int threads = 1;
+    narrow_phase::narrow_engine_t narrow = narrow_phase::CLASSIC;
+    const char *input = nullptr;
+    broad_phase::broad_engine_t engine = broad_phase::OCTREE;
+    broad_phase::precision_t precision = broad_phase::DOUBLE_BOXES;
+    answers::query_mode_t mode = answers::IDS;
+    bool stats = false;
+    size_t memory_limit = 0;
+    const char *index = nullptr;
+    bool coplanar = false;
+};
 
-    if (!(std::cin >> tr_num)) {
+const char *ENGINE_NAMES[] = {"octree", "grid", "bvh", "dynamic", "loose"};
+
+options_t parse_options(int argc, char *argv[]) {
+    options_t opts;
+
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "--threads") && i + 1 < argc) {
+            try {
+                opts.threads = std::stoi(argv[++i]);
+            }
+            catch (...) {
+                opts.threads = 0;
+            }
+
+            if (opts.threads < 1) {
+                std::cerr << "Bad threads amount" << std::endl;
+                exit(1);
+            }
+        }
+        else if (!std::strcmp(argv[i], "--narrow") && i + 1 < argc) {
+            i++;
+            if      (!std::strcmp(argv[i], "classic")) opts.narrow = narrow_phase::CLASSIC;
+            else if (!std::strcmp(argv[i], "fast"))    opts.narrow = narrow_phase::FAST;
+            else {
+                std::cerr << "Bad narrow phase engine" << std::endl;
+                exit(1);
+            }
+        }
+        else if (!std::strcmp(argv[i], "--input") && i + 1 < argc) {
+            opts.input = argv[++i];
+        }
+        else if (!std::strcmp(argv[i], "--engine") && i + 1 < argc) {
+            i++;
+            if      (!std::strcmp(argv[i], "octree")) opts.engine = broad_phase::OCTREE;
+            else if (!std::strcmp(argv[i], "grid"))   opts.engine = broad_phase::GRID;
+            else if (!std::strcmp(argv[i], "bvh"))    opts.engine = broad_phase::BVH;
+            else if (!std::strcmp(argv[i], "dynamic")) opts.engine = broad_phase::DYNAMIC;
+            else if (!std::strcmp(argv[i], "loose"))   opts.engine = broad_phase::LOOSE;
+            else {
+                std::cerr << "Bad broad phase engine" << std::endl;
+                exit(1);
+            }
+        }
+        else if (!std::strcmp(argv[i], "--precision") && i + 1 < argc) {
+            i++;
+            if      (!std::strcmp(argv[i], "double")) opts.precision = broad_phase::DOUBLE_BOXES;
+            else if (!std::strcmp(argv[i], "float"))  opts.precision = broad_phase::FLOAT_BOXES;
+            else {
+                std::cerr << "Bad precision" << std::endl;
+                exit(1);
+            }
+        }
+        else if (!std::strcmp(argv[i], "--mode") && i + 1 < argc) {
+            i++;
+            if      (!std::strcmp(argv[i], "any"))   opts.mode = answers::ANY;
+            else if (!std::strcmp(argv[i], "count")) opts.mode = answers::COUNT;
+            else if (!std::strcmp(argv[i], "ids"))   opts.mode = answers::IDS;
+            else if (!std::strcmp(argv[i], "pairs")) opts.mode = answers::PAIRS;
+            else {
+                std::cerr << "Bad query mode" << std::endl;
+                exit(1);
+            }
+        }
+        else if (!std::strcmp(argv[i], "--stats")) {
+            opts.stats = true;
+        }
+        else if (!std::strcmp(argv[i], "--memory-limit") && i + 1 < argc) {
+            long long mbytes = 0;
+
+            try {
+                mbytes = std::stoll(argv[++i]);
+            }
+            catch (...) {}
+
+            if (mbytes < 1) {
+                std::cerr << "Bad memory limit" << std::endl;
+                exit(1);
+            }
+            opts.memory_limit = static_cast<size_t>(mbytes) << 20;
+        }
+        else if (!std::strcmp(argv[i], "--index") && i + 1 < argc) {
+            opts.index = argv[++i];
+        }
+        else if (!std::strcmp(argv[i], "--coplanar")) {
+            opts.coplanar = true;
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--threads N] [--narrow classic|fast] [--input FILE]"
+                      << " [--engine octree|grid|bvh|dynamic|loose] [--precision double|float]"
+                      << " [--mode any|count|ids|pairs] [--stats] [--memory-limit MB] [--index FILE]"
+                      << " [--coplanar]" << std::endl;
+            exit(1);
+        }
+    }
+
+    if (opts.index && opts.engine != broad_phase::OCTREE && opts.engine != broad_phase::LOOSE) {
+        std::cerr << "Index needs the octree or loose engine" << std::endl;
+        exit(1);
+    }
+    if (opts.index && opts.memory_limit) {
+        std::cerr << "Index can't be used with a memory limit" << std::endl;
+        exit(1);
+    }
+    if (opts.coplanar && opts.narrow != narrow_phase::FAST) {
+        std::cerr << "Coplanar pass needs the fast narrow phase" << std::endl;
+        exit(1);
+    }
+    if (opts.coplanar && opts.engine != broad_phase::OCTREE && opts.engine != broad_phase::LOOSE) {
+        std::cerr << "Coplanar pass needs the octree or loose engine" << std::endl;
+        exit(1);
+    }
+    if (opts.coplanar && opts.memory_limit) {
+        std::cerr << "Coplanar pass can't be used with a memory limit" << std::endl;
+        exit(1);
+    }
+    if (opts.coplanar && opts.index) {
+        std::cerr << "Coplanar pass can't be used with an index" << std::endl;
+        exit(1);
+    }
+    return opts;
+}
+
+std::unique_ptr<broad_phase::broad_phase_t> make_engine(const options_t &opts,
+                                                       const std::vector<triangle_t> &trs,
+                                                       const max_min_crds_t &crds) {
+    if (opts.engine == broad_phase::GRID)
+        return std::make_unique<hash_grids::hash_grid_t>(trs, crds, opts.narrow);
+    if (opts.engine == broad_phase::BVH)
+        return std::make_unique<bvhs::bvh_t>(trs, crds, opts.narrow, opts.threads);
+    if (opts.engine == broad_phase::DYNAMIC)
+        return std::make_unique<dynamic_octotree_t>(trs, crds, opts.narrow);
+
+    octree_params_t params = opts.engine == broad_phase::LOOSE ? get_loose_params(trs) : octree_params_t{};
+
+    if (opts.coplanar && opts.precision == broad_phase::FLOAT_BOXES)
+        return std::make_unique<coplanar_query_t<float_octotree_t>>(trs, crds, opts.narrow, params, opts.threads);
+    if (opts.coplanar)
+        return std::make_unique<coplanar_query_t<octotree_t>>(trs, crds, opts.narrow, params, opts.threads);
+
+    if (opts.precision == broad_phase::FLOAT_BOXES)
+        return std::make_unique<float_octotree_t>(trs, crds, opts.narrow, params, opts.threads);
+    return std::make_unique<octotree_t>(trs, crds, opts.narrow, params, opts.threads);
+}
+
+// Peak bytes per triangle of the engine with the triangles it indexes, from
+// the sizes of the records every engine keeps; sizes the tiles of a query run
+// under --memory-limit. The loose tree is taken with its smallest leaves.
+size_t get_tr_bytes(const options_t &opts) {
+    bool is_float = opts.precision == broad_phase::FLOAT_BOXES;
+    size_t engine_bytes = 0;
+
+    switch (opts.engine) {
+        case broad_phase::GRID:    engine_bytes = hash_grids::hash_grid_t::TR_BYTES; break;
+        case broad_phase::BVH:     engine_bytes = bvhs::bvh_t::TR_BYTES; break;
+        case broad_phase::DYNAMIC: engine_bytes = dynamic_octotree_t::TR_BYTES; break;
+        case broad_phase::LOOSE:
+            engine_bytes = is_float ? float_octotree_t::get_tr_bytes(MIN_LOOSE_LEAF_SIZE) :
+                                      octotree_t::get_tr_bytes(MIN_LOOSE_LEAF_SIZE);
+            break;
+        default:
+            engine_bytes = is_float ? float_octotree_t::get_tr_bytes(MAX_TRS_NODE) :
+                                      octotree_t::get_tr_bytes(MAX_TRS_NODE);
+    }
+    return sizeof(triangle_t) + engine_bytes;
+}
+
+void check_read_status(read_status_t status) {
+    if (status == BAD_AMOUNT) {
         std::cerr << "Bad triangles amount" << std::endl;
         exit(1);
     }
+    if (status == BAD_COORDS) {
+        std::cerr << "Bad coordinates" << std::endl;
+        exit(1);
+    }
+    if (status == BAD_BINARY) {
+        std::cerr << "Bad binary scene" << std::endl;
+        exit(1);
+    }
+}
+
+void write_answer(hits_t &ans) {
+    if (!ans.write()) {
+        std::cerr << "Can't write answer" << std::endl;
+        exit(1);
+    }
+}
+
+// Queries the scene tile by tile so that no more than about opts.memory_limit
+// bytes are resident; the first pass is timed as bounds, the bucketing as parse.
+void run_tiled(const options_t &opts, const scene_source_t &src, stats::phase_timer_t &timer) {
+    tiles::tiled_query_t query{opts.memory_limit, get_tr_bytes(opts)};
+
+    check_read_status(query.scan_bounds(src));
+    timer.stop(stats::BOUNDS);
+
+    if (!query.set_tiles()) {
+        std::cerr << "Memory limit is too small" << std::endl;
+        exit(1);
+    }
+
+    check_read_status(query.bucket(src));
+    timer.stop(stats::PARSE);
+
+    hits_t ans{opts.mode, query.size()};
+    stats::shape_stats_t shape;
+
+    bool is_ok = query.for_each_tile(ans, [&](const std::vector<triangle_t> &trs, const max_min_crds_t &crds) {
+        std::unique_ptr<broad_phase::broad_phase_t> engine = make_engine(opts, trs, crds);
+        timer.stop(stats::BUILD);
+
+        engine->get_intersections(ans, opts.threads);
+        timer.stop(stats::QUERY);
+
+        if (opts.stats) shape.add(engine->get_shape_stats());
+    });
+
+    if (!is_ok) {
+        std::cerr << "Can't use the tile file" << std::endl;
+        exit(1);
+    }
+
+    write_answer(ans);
+    timer.stop(stats::OUTPUT);
+
+    if (opts.stats) stats::write_report(stderr, ENGINE_NAMES[opts.engine], query.size(), timer, shape);
+}
+
+// Writes the tree to opts.index through a temporary file, so a run that fails
+// midway leaves the previous index in place.
+template <typename tree_t>
+void save_index(const options_t &opts, const tree_t &tree, uint64_t input_hash, uint64_t input_size) {
+    std::string tmp = std::string{opts.index} + ".tmp";
+    FILE *out = std::fopen(tmp.c_str(), "wb");
+
+    bool is_ok = out && tree.save(out, input_hash, input_size);
+    if (out && std::fclose(out)) is_ok = false;
+
+    if (!is_ok || std::rename(tmp.c_str(), opts.index)) {
+        std::remove(tmp.c_str());
+        std::cerr << "Can't write index" << std::endl;
+        exit(1);
+    }
+}
+
+// Queries the octree kept in opts.index when it was written for this very input
+// with the same engine and precision, mapping it instead of parsing the scene
+// and building the tree; otherwise builds the tree and saves it there. Hashing
+// the input is timed as parse, taking the tree from the file as build.
+template <typename tree_t>
+void run_indexed(const options_t &opts, const scene_source_t &src, stats::phase_timer_t &timer) {
+    uint64_t input_size = src.end() - src.begin();
+    uint64_t input_hash = octree_index::hash_bytes(src.begin(), src.end());
+    timer.stop(stats::PARSE);
+
+    octree_index::index_key_t key = tree_t::get_index_key(input_hash, input_size, opts.narrow,
+                                                          opts.engine == broad_phase::LOOSE);
+    scene_source_t index_src;
 
     std::vector<triangle_t> triangles;
-    max_min_crds_t max_min_crds;
-    triangles.reserve(tr_num);
+    std::unique_ptr<tree_t> tree;
 
-    for (int i = 0; i < tr_num; i++) {
-        double crds[9] = {};
+    if (index_src.open_file(opts.index) && tree_t::check_index(index_src.begin(), index_src.end(), key)) {
+        tree = std::make_unique<tree_t>(index_src.begin(), opts.narrow);
+        timer.stop(stats::BUILD);
+    }
+    else {
+        max_min_crds_t max_min_crds;
 
-        for (int j = 0; j < 9; j++) {
-            if (!(std::cin >> crds[j])) {
-                std::cerr << "Bad coordinates" << std::endl;
-                exit(1);
-            }
-        }
+        check_read_status(read_triangles(src, triangles, max_min_crds));
+        timer.stop(stats::PARSE);
+
+        if (!is_binary_scene(src)) max_min_crds = get_bounds(triangles);
+        timer.stop(stats::BOUNDS);
+
+        octree_params_t params = opts.engine == broad_phase::LOOSE ? get_loose_params(triangles) : octree_params_t{};
+
+        tree = std::make_unique<tree_t>(triangles, max_min_crds, opts.narrow, params, opts.threads);
+        save_index(opts, *tree, input_hash, input_size);
+        timer.stop(stats::BUILD);
+    }
+
+    hits_t ans{opts.mode, tree->size()};
+    tree->get_intersections(ans, opts.threads);
+    timer.stop(stats::QUERY);
 
-        max_min_crds.update(crds[0], crds[1], crds[2]);
-        max_min_crds.update(crds[3], crds[4], crds[5]);
-        max_min_crds.update(crds[6], crds[7], crds[7]);
+    write_answer(ans);
+    timer.stop(stats::OUTPUT);
 
-        triangles.push_back({{crds[0], crds[1], crds[2]},
-                             {crds[3], crds[4], crds[5]},
-                             {crds[6], crds[7], crds[8]}});
+    if (opts.stats)
+        stats::write_report(stderr, ENGINE_NAMES[opts.engine], tree->size(), timer, tree->get_shape_stats());
+}
+
+int main(int argc, char *argv[]) {
+    options_t opts = parse_options(argc, argv);
+
+    stats::phase_timer_t timer;
+    scene_source_t src;
+
+    bool is_read = opts.input ? src.open_file(opts.input) : src.read_stream(stdin);
+    if (!is_read) {
+        std::cerr << "Can't read input" << std::endl;
+        exit(1);
+    }
+
+    if (opts.memory_limit) {
+        run_tiled(opts, src, timer);
+        return 0;
     }
 
-    #ifdef CHECK_TIME
-    auto start = std::chrono::high_resolution_clock::now();
-    #endif
-    octotree_t octotree{triangles, max_min_crds};
+    if (opts.index) {
+        if (opts.precision == broad_phase::FLOAT_BOXES) run_indexed<float_octotree_t>(opts, src, timer);
+        else                                            run_indexed<octotree_t>(opts, src, timer);
+        return 0;
+    }
+
+    std::vector<triangle_t> triangles;
+    max_min_crds_t max_min_crds;
+
+    check_read_status(read_triangles(src, triangles, max_min_crds));
+    timer.stop(stats::PARSE);
+
+    if (!is_binary_scene(src)) max_min_crds = get_bounds(triangles);
+    timer.stop(stats::BOUNDS);
+
+    std::unique_ptr<broad_phase::broad_phase_t> engine = make_engine(opts, triangles, max_min_crds);
+    timer.stop(stats::BUILD);
 
-    std::set<int> ans = octotree.get_intersections();
+    hits_t ans{opts.mode, triangles.size()};
+    engine->get_intersections(ans, opts.threads);
+    timer.stop(stats::QUERY);
 
-    for (auto it = ans.begin(); it != ans.end(); it++)
-        std::cout << *it << std::endl;
+    write_answer(ans);
+    timer.stop(stats::OUTPUT);
 
-    #ifdef CHECK_TIME
-    const double tm = std::chrono::duration_cast<std::chrono::milliseconds>(
-                      std::chrono::high_resolution_clock::now() - start).count() / 1000.0;
-    std::cout << "time = " << tm << "s" << std::endl;
-   #endif
+    if (opts.stats)
+        stats::write_report(stderr, ENGINE_NAMES[opts.engine], triangles.size(), timer, engine->get_shape_stats());
 
     return 0;
 }
@@ -1,16 +1,166 @@
-obj="./build/triangles"
+build=${1:-"./build"}
+
+# With quick the slow parts are left out, for builds without optimization:
+# 20.dat, the clustered scene and the long dynamic octree runs.
+quick=$2
+
+obj="${build}/triangles"
+convert="${build}/triangles_convert"
+gen="${build}/triangles_gen"
+dynamic="${build}/triangles_dynamic_check"
 
 test_folder="./tests/test_files/"
 correct_folder="./tests/correct_files/"
 answer_folder="./tests/answer_files/"
 
-echo "TESTS:"
-echo
-for ((i = 1; i <= 26; i++)) do
-    echo $i.dat
-    ${obj} < ${test_folder}$i.dat > ${answer_folder}${i}ans.dat
+tmp_folder=$(mktemp -d)
+trap 'rm -rf ${tmp_folder}' EXIT
+
+failed=0
+
+# check CORRECT ANSWER: prints the diff of the two files, a difference fails the run.
+check() {
     echo diff:
-    diff ${correct_folder}${i}ans.dat ${answer_folder}${i}ans.dat
+    diff $1 $2 || failed=1
     echo
     echo
+}
+
+# check_that MESSAGE COMMAND...: fails the run with MESSAGE if the command fails.
+check_that() {
+    local message=$1
+    shift
+    "$@" || { echo "FAILED: ${message}"; failed=1; }
+}
+
+get_inode() {
+    stat -c %i $1 2>/dev/null
+}
+
+# Inputs 17, 25 and 26 are missing, their answers in correct_files are unused.
+tests=()
+for ((i = 1; i <= 27; i++)) do
+    [ -f ${test_folder}$i.dat ] || continue
+    [ -n "${quick}" ] && [ $i -eq 20 ] && continue
+    tests+=($i)
 done
+
+echo "TESTS:"
+echo
+for i in ${tests[@]}; do
+    for narrow in classic fast; do
+        echo $i.dat --narrow $narrow
+        ${obj} --narrow $narrow < ${test_folder}$i.dat > ${answer_folder}${i}ans.dat
+        check ${correct_folder}${i}ans.dat ${answer_folder}${i}ans.dat
+    done
+done
+
+echo "ENGINES AND OPTIONS:"
+echo
+for i in ${tests[@]}; do
+    runs=()
+    for engine in grid bvh dynamic loose; do
+        runs+=("--engine ${engine} --narrow classic" "--engine ${engine} --narrow fast")
+    done
+    runs+=("--precision float" "--engine loose --precision float --narrow fast"
+           "--threads 4" "--engine loose --threads 4 --narrow fast"
+           "--narrow fast --coplanar" "--engine loose --narrow fast --coplanar")
+
+    for run in "${runs[@]}"; do
+        echo $i.dat ${run}
+        ${obj} ${run} < ${test_folder}$i.dat > ${tmp_folder}/ans.dat
+        check ${correct_folder}${i}ans.dat ${tmp_folder}/ans.dat
+    done
+done
+
+# Every triangle of 20.dat spans the whole scene and lands in every tile, querying it tiled takes minutes.
+echo "MEMORY LIMIT:"
+echo
+for i in ${tests[@]}; do
+    [ $i -eq 20 ] && continue
+
+    ${convert} ${test_folder}$i.dat ${tmp_folder}/$i.bin > /dev/null
+
+    for engine in octree grid bvh dynamic loose; do
+        for input in ${test_folder}$i.dat ${tmp_folder}/$i.bin; do
+            echo $i.dat --engine ${engine} --input ${input} --memory-limit 1
+            ${obj} --engine ${engine} --input ${input} --memory-limit 1 > ${tmp_folder}/ans.dat
+            check ${correct_folder}${i}ans.dat ${tmp_folder}/ans.dat
+        done
+    done
+
+    echo $i.dat --memory-limit 1 from stdin
+    ${obj} --memory-limit 1 < ${test_folder}$i.dat > ${tmp_folder}/ans.dat
+    check ${correct_folder}${i}ans.dat ${tmp_folder}/ans.dat
+done
+
+# Clusters of this scene overfill their tiles under a 1 MiB limit, so the tiles are split.
+if [ -z "${quick}" ]; then
+    ${gen} --seed 3 --text clustered 30000 ${tmp_folder}/clustered.dat
+    for engine in octree grid bvh dynamic loose; do
+        echo clustered --engine ${engine} --memory-limit 1
+        ${obj} --engine ${engine} --input ${tmp_folder}/clustered.dat > ${tmp_folder}/correct.dat
+        ${obj} --engine ${engine} --input ${tmp_folder}/clustered.dat --memory-limit 1 > ${tmp_folder}/ans.dat
+        check ${tmp_folder}/correct.dat ${tmp_folder}/ans.dat
+    done
+fi
+
+echo "INDEX:"
+echo
+index=${tmp_folder}/index
+for engine in octree loose; do
+    rm -f ${index}
+
+    echo 18.dat --engine ${engine} --index, cold
+    ${obj} --engine ${engine} --index ${index} < ${test_folder}18.dat > ${tmp_folder}/ans.dat
+    check ${correct_folder}18ans.dat ${tmp_folder}/ans.dat
+    check_that "index is written" test -f ${index}
+    inode=$(get_inode ${index})
+
+    echo 18.dat --engine ${engine} --index, warm
+    ${obj} --engine ${engine} --index ${index} < ${test_folder}18.dat > ${tmp_folder}/ans.dat
+    check ${correct_folder}18ans.dat ${tmp_folder}/ans.dat
+    check_that "warm run keeps the index" test "$(get_inode ${index})" = "${inode}"
+
+    echo 19.dat --engine ${engine} --index, stale input
+    ${obj} --engine ${engine} --index ${index} < ${test_folder}19.dat > ${tmp_folder}/ans.dat
+    check ${correct_folder}19ans.dat ${tmp_folder}/ans.dat
+    check_that "index of another input is rebuilt" test "$(get_inode ${index})" != "${inode}"
+    inode=$(get_inode ${index})
+
+    echo 19.dat --engine ${engine} --index --narrow fast, stale narrow phase
+    ${obj} --engine ${engine} --index ${index} --narrow fast < ${test_folder}19.dat > ${tmp_folder}/ans.dat
+    check ${correct_folder}19ans.dat ${tmp_folder}/ans.dat
+    check_that "index of another narrow phase is rebuilt" test "$(get_inode ${index})" != "${inode}"
+
+    # The offset of the nodes is the 15th 8-byte word of the header, the byte flipped is the slice start of the root.
+    echo 19.dat --engine ${engine} --index, damaged node
+    nodes_offset=$(od -An -t u8 -j 112 -N 8 ${index})
+    printf '\xff' | dd of=${index} bs=1 seek=$((nodes_offset + 32)) conv=notrunc status=none
+    inode=$(get_inode ${index})
+    ${obj} --engine ${engine} --index ${index} < ${test_folder}19.dat > ${tmp_folder}/ans.dat
+    check ${correct_folder}19ans.dat ${tmp_folder}/ans.dat
+    check_that "damaged index is rebuilt" test "$(get_inode ${index})" != "${inode}"
+
+    echo 19.dat --engine ${engine} --index, broken file
+    echo broken > ${index}
+    inode=$(get_inode ${index})
+    ${obj} --engine ${engine} --index ${index} < ${test_folder}19.dat > ${tmp_folder}/ans.dat
+    check ${correct_folder}19ans.dat ${tmp_folder}/ans.dat
+    check_that "broken index is rebuilt" test "$(get_inode ${index})" != "${inode}"
+done
+
+echo "DYNAMIC OCTREE:"
+echo
+for dist in uniform clustered coplanar degenerate mixed; do
+    for narrow in classic fast; do
+        echo ${dist} --narrow ${narrow}, inserts, erases and updates
+        if [ -n "${quick}" ]; then
+            check_that "dynamic octree matches a fresh build" ${dynamic} --steps 200 --narrow ${narrow} ${dist} 50
+        else
+            check_that "dynamic octree matches a fresh build" ${dynamic} --narrow ${narrow} ${dist} 200
+        fi
+    done
+done
+
+exit ${failed}